@@ -93,6 +93,81 @@ extern matrix3x3 square_basis(matrix3x3 lattice_basis, vector3 size);
 extern void ctl_printf(const char *fmt, ...);
 extern void (*ctl_printf_callback)(const char *s);
 
+/* strategies for partitioning the objects of a geom_box_tree among its
+   nodes (see geom_box_tree_builder) */
+typedef enum {
+  GEOM_BOX_TREE_BALANCED, /* minimize the object count of the larger half (default) */
+  GEOM_BOX_TREE_SAH       /* minimize the binned surface-area/volume heuristic cost */
+} geom_box_tree_builder_type;
+
+/* A geom_context bundles the "global input variables" read by the geometry
+   routines, so that several geometries can be used concurrently from
+   different threads.  The fields have the same names and meanings as the
+   corresponding globals. */
+typedef struct {
+  LATTICE geometry_lattice;
+  integer dimensions;
+  boolean ensure_periodicity;
+  MATERIAL_TYPE default_material;
+  GEOMETRIC_OBJECT_LIST geometry;
+  vector3 geometry_center;
+  geom_box_tree_builder_type geom_box_tree_builder;
+  int geom_planar_overlaps;
+  int geom_classify_overlaps;
+  int geom_mesh_qbvh;
+  int geom_mesh_grid_resolution;
+  int geom_mesh_compact;
+} geom_context;
+
+extern const geom_context *geom_set_context(const geom_context *ctx);
+extern const geom_context *geom_get_context(void);
+extern void geom_context_init(geom_context *ctx);
+
+/* A geom_object_query is a flat record, produced by
+   compile_geom_object_query, holding everything that point_in_object_query
+   needs to test whether points lie inside a fixed object, so that the test
+   needn't chase the subclass pointers of the object or redo the same
+   arithmetic for every point. */
+typedef enum {
+  GEOM_QUERY_EMPTY,     /* contains no points */
+  GEOM_QUERY_SPHERE,    /* r.metric.r <= radius_sq */
+  GEOM_QUERY_CYLINDER,  /* |axis.metric.r| <= height/2, and within radius_sq of the axis */
+  GEOM_QUERY_CONE,      /* a cylinder whose radius varies by dradius along the axis */
+  GEOM_QUERY_WEDGE,     /* a cylinder restricted to wedge_angle from e1 towards e2 */
+  GEOM_QUERY_BLOCK,     /* |m.r| <= half_size */
+  GEOM_QUERY_ELLIPSOID, /* |(m.r) * half_size| <= 1, i.e. half_size = inverse semi-axes */
+  GEOM_QUERY_OBJECT     /* prisms, meshes, and compound objects: use o */
+} geom_query_kind;
+
+typedef struct {
+  geom_query_kind kind;
+  boolean cartesian; /* whether the lattice metric is the identity */
+  vector3 center;
+  matrix3x3 m; /* lattice metric (spheres, cylinders) or projection matrix (blocks) */
+  vector3 axis, e1, e2, half_size;
+  number radius, radius_sq, dradius, height, wedge_angle;
+  const GEOMETRIC_OBJECT *o; /* the original object */
+} geom_object_query;
+
+extern void compile_geom_object_query(const GEOMETRIC_OBJECT *o, geom_object_query *q);
+extern boolean point_in_object_query(vector3 p, const geom_object_query *q);
+extern void point_in_object_query_batch(const geom_object_query *q, const double *x,
+                                        const double *y, const double *z, int n, boolean *inside);
+extern void point_in_fixed_objectp_batch(const GEOMETRIC_OBJECT *o, const double *x,
+                                         const double *y, const double *z, int n,
+                                         boolean *inside);
+
+/* signed distance to the surface of an object, negative inside */
+extern double signed_distance_to_object(vector3 p, GEOMETRIC_OBJECT o);
+extern double signed_distance_to_fixed_object(vector3 p, GEOMETRIC_OBJECT o);
+extern double signed_distance_to_object_query(vector3 p, const geom_object_query *q);
+extern void signed_distance_to_object_query_batch(const geom_object_query *q, const double *x,
+                                                  const double *y, const double *z, int n,
+                                                  double *dist);
+extern void signed_distance_to_fixed_object_batch(const GEOMETRIC_OBJECT *o, const double *x,
+                                                  const double *y, const double *z, int n,
+                                                  double *dist);
+
 typedef struct {
   vector3 low, high;
 } geom_box;
@@ -109,12 +184,25 @@ typedef struct geom_box_tree_struct {
   struct geom_box_tree_struct *t1, *t2;
   int nobjects;
   geom_box_object *objects;
+  struct geom_box_tree_compiled_struct *compiled; /* non-NULL for nodes of compiled trees */
+  struct geom_box_tree_struct *view_of; /* for views, the shared subtree (also t1) */
 } * geom_box_tree;
 
 extern void destroy_geom_box_tree(geom_box_tree t);
 extern geom_box_tree create_geom_box_tree(void);
 extern geom_box_tree create_geom_box_tree0(GEOMETRIC_OBJECT_LIST geometry, geom_box b0);
 extern geom_box_tree restrict_geom_box_tree(geom_box_tree, const geom_box *);
+extern geom_box_tree restrict_geom_box_tree_view(geom_box_tree t, const geom_box *b);
+extern geom_box_tree compile_geom_box_tree(geom_box_tree t);
+extern boolean save_geom_box_tree(geom_box_tree t, GEOMETRIC_OBJECT_LIST geometry,
+                                  const char *filename);
+extern geom_box_tree load_geom_box_tree(const char *filename, GEOMETRIC_OBJECT_LIST geometry,
+                                        geom_box b0);
+extern void geom_box_tree_insert(geom_box_tree t, const GEOMETRIC_OBJECT *o, int precedence);
+extern boolean geom_box_tree_remove(geom_box_tree t, const GEOMETRIC_OBJECT *o);
+extern boolean geom_box_tree_update(geom_box_tree t, const GEOMETRIC_OBJECT *o);
+extern void geom_box_tree_rebalance(geom_box_tree t);
+extern boolean geom_box_tree_needs_rebalance(geom_box_tree t, double cost0, double max_ratio);
 extern geom_box_tree geom_tree_search(vector3 p, geom_box_tree t, int *oindex);
 extern geom_box_tree geom_tree_search_next(vector3 p, geom_box_tree t, int *oindex);
 extern MATERIAL_TYPE material_of_point_in_tree_inobject(vector3 p, geom_box_tree t,
@@ -124,9 +212,69 @@ extern MATERIAL_TYPE material_of_unshifted_point_in_tree_inobject(vector3 p, geo
                                                                   boolean *inobject);
 const GEOMETRIC_OBJECT *object_of_point_in_tree(vector3 p, geom_box_tree t, vector3 *shiftby,
                                                 int *precedence);
+extern void material_of_points_in_tree(const vector3 *p, int npoints, geom_box_tree t,
+                                       MATERIAL_TYPE *materials, boolean *inobject);
+extern void objects_of_points_in_tree(const vector3 *p, int npoints, geom_box_tree t,
+                                      const GEOMETRIC_OBJECT **objects, vector3 *shiftby,
+                                      int *precedence);
 extern vector3 to_geom_box_coords(vector3 p, geom_box_object *gbo);
+
+/* the fraction of a box filled by an object of a geom_box_tree (or, for
+   o == NULL, by the default material), from box_material_fractions_in_tree */
+typedef struct {
+  const GEOMETRIC_OBJECT *o;
+  vector3 shiftby;
+  MATERIAL_TYPE material;
+  number fraction;
+} geom_box_fraction;
+
+extern int box_material_fractions_in_tree(geom_box b, geom_box_tree t, number tol,
+                                          integer maxeval, boolean by_material,
+                                          geom_box_fraction *fractions, int maxfractions);
+
+/* a segment s0 <= s <= s1 of a line in an object of a geom_box_tree (or,
+   for o == NULL, in the default material), from intersect_line_with_tree */
+typedef struct {
+  number s0, s1;
+  const GEOMETRIC_OBJECT *o;
+  vector3 shiftby;
+  MATERIAL_TYPE material;
+} geom_line_segment;
+
+extern int intersect_line_with_tree(geom_box_tree t, vector3 p, vector3 d, number a, number b,
+                                    geom_line_segment *segments, int maxsegments);
+
+/* the materials (and, if fractions is not NULL, the fill fractions of
+   those materials) of the nx x ny x nz voxels dividing the unit cell */
+extern void material_grid_in_tree(geom_box_tree t, int nx, int ny, int nz, number tol,
+                                  integer maxeval, MATERIAL_TYPE *materials, number *fractions);
+
+/* A cursor for searching a geom_box_tree for a sequence of nearby points
+   (e.g. a grid sweep), which remembers the path to the last node found so
+   that subsequent searches can start from the nearest enclosing node. */
+#define GEOM_BOX_TREE_CURSOR_DEPTH 64
+typedef struct {
+  geom_box_tree t;
+  int depth; /* path[0..depth] are the nodes from t to the last node found, or -1 */
+  geom_box_tree path[GEOM_BOX_TREE_CURSOR_DEPTH];
+  char skippable[GEOM_BOX_TREE_CURSOR_DEPTH]; /* whether path[0..i-1] have no objects and
+                                                 none is a view (whose subtree outgrows it) */
+} geom_box_tree_cursor;
+
+extern void geom_box_tree_cursor_init(geom_box_tree_cursor *c, geom_box_tree t);
+extern geom_box_tree geom_tree_search_cursor(vector3 p, geom_box_tree_cursor *c, int *oindex);
+extern const GEOMETRIC_OBJECT *object_of_point_in_tree_cursor(vector3 p, geom_box_tree_cursor *c,
+                                                              vector3 *shiftby, int *precedence);
+extern MATERIAL_TYPE material_of_point_in_tree_cursor(vector3 p, geom_box_tree_cursor *c,
+                                                      boolean *inobject);
 extern void display_geom_box_tree(int indentby, geom_box_tree t);
 extern void geom_box_tree_stats(geom_box_tree t, int *depth, int *nobjects);
+extern void geom_box_tree_stats_cost(geom_box_tree t, int *depth, int *nobjects, double *cost);
+
+/* strategy used by create_geom_box_tree to partition the objects among the
+   nodes of the tree; may be changed at runtime before creating a tree (or
+   set in the current geom_context) */
+extern geom_box_tree_builder_type geom_box_tree_builder;
 
 extern void geom_get_bounding_box(GEOMETRIC_OBJECT o, geom_box *box);
 extern number box_overlap_with_object(geom_box b, GEOMETRIC_OBJECT o, number tol, integer maxeval);
@@ -134,6 +282,53 @@ extern number ellipsoid_overlap_with_object(geom_box b, GEOMETRIC_OBJECT o, numb
                                             integer maxeval);
 extern number range_overlap_with_object(vector3 low, vector3 high, GEOMETRIC_OBJECT o, number tol,
                                         integer maxeval);
+/* overlaps of the n boxes dividing b into equal parts along axis (0, 1, 2 for x, y, z),
+   computed together in one pass over the cross-section of b */
+extern void box_row_overlaps_with_object(geom_box b, int axis, int n, GEOMETRIC_OBJECT o,
+                                         number tol, integer maxeval, number *overlaps);
+
+typedef enum {
+  GEOM_BOX_OUTSIDE, /* no point of the box lies in the object */
+  GEOM_BOX_INSIDE,  /* every point of the box lies in the object */
+  GEOM_BOX_MIXED    /* the box may straddle the surface of the object */
+} geom_box_class;
+extern geom_box_class classify_box_against_object(geom_box b, GEOMETRIC_OBJECT o);
+
+/* if nonzero (the default), the overlap functions above first try to
+   approximate the surface of the object within the box by a plane, and
+   use the cubature only if that is not accurate to within tol; like the
+   other globals, this may be overridden by the current geom_context */
+extern int geom_planar_overlaps;
+
+/* if nonzero (the default), the overlap functions above return 0 or 1
+   without integrating for boxes that classify_box_against_object finds
+   to be entirely outside or inside the object (unless overridden by the
+   current geom_context) */
+extern int geom_classify_overlaps;
+
+/* variants of the above that use the given context (or the globals, if
+   ctx is NULL) in place of the calling thread's current context */
+extern void geom_fix_object_list_ctx(const geom_context *ctx, GEOMETRIC_OBJECT_LIST geometry);
+extern boolean point_in_periodic_objectp_ctx(const geom_context *ctx, vector3 p,
+                                             GEOMETRIC_OBJECT o);
+extern boolean point_in_periodic_fixed_objectp_ctx(const geom_context *ctx, vector3 p,
+                                                   GEOMETRIC_OBJECT o);
+extern vector3 shift_to_unit_cell_ctx(const geom_context *ctx, vector3 p);
+extern MATERIAL_TYPE material_of_point_inobject_ctx(const geom_context *ctx, vector3 p,
+                                                    boolean *inobject);
+extern GEOMETRIC_OBJECT object_of_point_ctx(const geom_context *ctx, vector3 p, vector3 *shiftby);
+extern geom_box_tree create_geom_box_tree_ctx(const geom_context *ctx);
+extern geom_box_tree create_geom_box_tree0_ctx(const geom_context *ctx,
+                                               GEOMETRIC_OBJECT_LIST geometry, geom_box b0);
+extern MATERIAL_TYPE material_of_point_in_tree_inobject_ctx(const geom_context *ctx, vector3 p,
+                                                            geom_box_tree t, boolean *inobject);
+extern void material_of_points_in_tree_ctx(const geom_context *ctx, const vector3 *p,
+                                           int npoints, geom_box_tree t,
+                                           MATERIAL_TYPE *materials, boolean *inobject);
+extern number box_overlap_with_object_ctx(const geom_context *ctx, geom_box b, GEOMETRIC_OBJECT o,
+                                          number tol, integer maxeval);
+extern number ellipsoid_overlap_with_object_ctx(const geom_context *ctx, geom_box b,
+                                                GEOMETRIC_OBJECT o, number tol, integer maxeval);
 
 extern vector3 get_grid_size(void);
 extern vector3 get_resolution(void);
@@ -206,6 +401,33 @@ GEOMETRIC_OBJECT make_mesh_with_center(MATERIAL_TYPE material, vector3 center,
                                        const vector3 *vertices, int num_vertices,
                                        const int *triangles, int num_triangles);
 
+// If nonzero (the default), meshes initialized afterwards also collapse
+// their BVH into a 4-wide BVH, whose nodes hold the boxes of all four
+// children so that one node fetch tests them together; ray casting
+// (point_in_mesh, line intersections) and closest-face queries
+// (normal_to_mesh, distances) then traverse that instead.  This is read
+// from the current geom_context if one is set, and copies of a mesh
+// are built as the original was, whatever the setting at the time.
+extern int geom_mesh_qbvh;
+
+// If positive (default 0: none), closed meshes initialized afterwards
+// also get an occupancy grid, with this many cubic cells along the
+// longest side of the bounding box, each classified as inside, outside,
+// or meeting the surface; point_in_mesh casts rays only from points in
+// surface cells.  The grid takes one byte per cell, and its size is
+// shown by display_geometric_object_info.  As for geom_mesh_qbvh, a
+// geom_context may override this, and copies keep the original's grid.
+extern int geom_mesh_grid_resolution;
+
+// If nonzero (default 0), meshes initialized afterwards are stored
+// compactly, for huge meshes: face normals are computed when needed
+// rather than cached, and instead of the binary and 4-wide BVHs there
+// is a single BVH whose nodes store their children's boxes rounded
+// outwards to 16 bits.  Queries give the same results, since faces are
+// still tested in double precision, but traverse more nodes.  Copies of
+// a compact mesh are compact too, and a geom_context may override this.
+extern int geom_mesh_compact;
+
 int vector3_nearly_equal(vector3 v1, vector3 v2, double tolerance);
 
 /**************************************************************************/
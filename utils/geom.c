@@ -20,11 +20,24 @@
  */
 
 #define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#else
+#undef HAVE_MMAP
+#endif
 
 #ifndef LIBCTLGEOM
 #include "ctl-io.h"
@@ -78,6 +91,148 @@ using namespace ctlio;
 
 /**************************************************************************/
 
+/* Geometry contexts.  The functions in this file read the "global input
+   variables" geometry_lattice, dimensions, ensure_periodicity,
+   default_material, geometry, and geometry_center, and the options
+   geom_box_tree_builder, geom_planar_overlaps, geom_classify_overlaps,
+   geom_mesh_qbvh, geom_mesh_grid_resolution, and geom_mesh_compact,
+   only via CTX(name), which refers to the corresponding field of the
+   calling thread's current geom_context if one has been set by
+   geom_set_context, and to the global variable otherwise.  Different
+   threads can thus work on different geometries at the same time, each
+   with its own context. */
+
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define GEOM_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define GEOM_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define GEOM_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define GEOM_THREAD_LOCAL __declspec(thread)
+#else
+#define GEOM_THREAD_LOCAL /* no thread-local storage: contexts are per-process */
+#endif
+
+static GEOM_THREAD_LOCAL const geom_context *geom_current_context = NULL;
+
+#define CTX(name) (*(geom_current_context ? &geom_current_context->name : &name))
+
+/* Set the geometry context of the calling thread to ctx (or to the
+   global variables if ctx is NULL), returning the previous context.
+   ctx is not copied, and must remain valid until it is unset. */
+const geom_context *geom_set_context(const geom_context *ctx) {
+  const geom_context *prev = geom_current_context;
+  geom_current_context = ctx;
+  return prev;
+}
+
+const geom_context *geom_get_context(void) { return geom_current_context; }
+
+/* initialize ctx to a copy of the current context (or globals) */
+void geom_context_init(geom_context *ctx) {
+  ctx->geometry_lattice = CTX(geometry_lattice);
+  ctx->dimensions = CTX(dimensions);
+  ctx->ensure_periodicity = CTX(ensure_periodicity);
+  ctx->default_material = CTX(default_material);
+  ctx->geometry = CTX(geometry);
+  ctx->geometry_center = CTX(geometry_center);
+  ctx->geom_box_tree_builder = CTX(geom_box_tree_builder);
+  ctx->geom_planar_overlaps = CTX(geom_planar_overlaps);
+  ctx->geom_classify_overlaps = CTX(geom_classify_overlaps);
+  ctx->geom_mesh_qbvh = CTX(geom_mesh_qbvh);
+  ctx->geom_mesh_grid_resolution = CTX(geom_mesh_grid_resolution);
+  ctx->geom_mesh_compact = CTX(geom_mesh_compact);
+}
+
+/* Context-taking variants of the public API: each just evaluates the
+   corresponding function call with the calling thread's context
+   temporarily set to ctx. */
+
+#define WITH_CONTEXT(ctx, stmt)                                                                    \
+  {                                                                                                \
+    const geom_context *prev_ctx = geom_set_context(ctx);                                          \
+    stmt;                                                                                          \
+    geom_set_context(prev_ctx);                                                                    \
+  }
+
+void geom_fix_object_list_ctx(const geom_context *ctx, geometric_object_list geometry) {
+  WITH_CONTEXT(ctx, geom_fix_object_list(geometry));
+}
+
+boolean point_in_periodic_objectp_ctx(const geom_context *ctx, vector3 p, geometric_object o) {
+  boolean ret;
+  WITH_CONTEXT(ctx, ret = point_in_periodic_objectp(p, o));
+  return ret;
+}
+
+boolean point_in_periodic_fixed_objectp_ctx(const geom_context *ctx, vector3 p,
+                                            geometric_object o) {
+  boolean ret;
+  WITH_CONTEXT(ctx, ret = point_in_periodic_fixed_objectp(p, o));
+  return ret;
+}
+
+vector3 shift_to_unit_cell_ctx(const geom_context *ctx, vector3 p) {
+  WITH_CONTEXT(ctx, p = shift_to_unit_cell(p));
+  return p;
+}
+
+material_type material_of_point_inobject_ctx(const geom_context *ctx, vector3 p,
+                                             boolean *inobject) {
+  material_type m;
+  WITH_CONTEXT(ctx, m = material_of_point_inobject(p, inobject));
+  return m;
+}
+
+geometric_object object_of_point_ctx(const geom_context *ctx, vector3 p, vector3 *shiftby) {
+  geometric_object o;
+  WITH_CONTEXT(ctx, o = object_of_point(p, shiftby));
+  return o;
+}
+
+geom_box_tree create_geom_box_tree_ctx(const geom_context *ctx) {
+  geom_box_tree t;
+  WITH_CONTEXT(ctx, t = create_geom_box_tree());
+  return t;
+}
+
+geom_box_tree create_geom_box_tree0_ctx(const geom_context *ctx, geometric_object_list geometry,
+                                        geom_box b0) {
+  geom_box_tree t;
+  WITH_CONTEXT(ctx, t = create_geom_box_tree0(geometry, b0));
+  return t;
+}
+
+material_type material_of_point_in_tree_inobject_ctx(const geom_context *ctx, vector3 p,
+                                                     geom_box_tree t, boolean *inobject) {
+  material_type m;
+  WITH_CONTEXT(ctx, m = material_of_point_in_tree_inobject(p, t, inobject));
+  return m;
+}
+
+void material_of_points_in_tree_ctx(const geom_context *ctx, const vector3 *p, int npoints,
+                                    geom_box_tree t, material_type *materials,
+                                    boolean *inobject) {
+  WITH_CONTEXT(ctx, material_of_points_in_tree(p, npoints, t, materials, inobject));
+}
+
+number box_overlap_with_object_ctx(const geom_context *ctx, geom_box b, geometric_object o,
+                                   number tol, integer maxeval) {
+  number ret;
+  WITH_CONTEXT(ctx, ret = box_overlap_with_object(b, o, tol, maxeval));
+  return ret;
+}
+
+number ellipsoid_overlap_with_object_ctx(const geom_context *ctx, geom_box b, geometric_object o,
+                                         number tol, integer maxeval) {
+  number ret;
+  WITH_CONTEXT(ctx, ret = ellipsoid_overlap_with_object(b, o, tol, maxeval));
+  return ret;
+}
+
+/**************************************************************************/
+
 /* Private mesh internals.
 
    Inlined here rather than placed in a separate header because MPB/meep
@@ -95,14 +250,62 @@ typedef struct mesh_bvh_node {
   int     face_count;
 } mesh_bvh_node;
 
+/* A node of the 4-wide BVH collapsed from the binary one, with the
+   boxes of its children stored as structure-of-arrays ([axis][child])
+   so that all four can be tested at once.  A child is either an inner
+   node (child >= 0), a leaf (child < 0, face_count > 0, with faces
+   bvh_face_ids[face_start...]), or an empty slot (neither). */
+#define MESH_QBVH_WIDTH 4
+
+typedef struct mesh_qbvh_node {
+  double bbox_low[3][MESH_QBVH_WIDTH];
+  double bbox_high[3][MESH_QBVH_WIDTH];
+  int    child[MESH_QBVH_WIDTH];
+  int    face_start[MESH_QBVH_WIDTH];
+  int    face_count[MESH_QBVH_WIDTH];
+} mesh_qbvh_node;
+
+/* A node of the quantized BVH that replaces the binary one in compact
+   meshes: the boxes of its two children, rounded outwards to 16-bit
+   fractions of its own box (that of the root is mesh_internal.bbox).
+   A child is an inner node (child >= 0) or a leaf with faces
+   bvh_face_ids[-1 - child...], the last of which is stored as ~id. */
+#define MESH_CBVH_QMAX 65535
+
+typedef struct mesh_cbvh_node {
+  unsigned short bbox_low[2][3];
+  unsigned short bbox_high[2][3];
+  int            child[2];
+} mesh_cbvh_node;
+
+/* The options a mesh was built with, from the geom_mesh_* globals or
+   the current context, which copies of it are built with too. */
+typedef struct mesh_options {
+  int qbvh;
+  int grid_resolution;
+  int compact;
+} mesh_options;
+
 typedef struct mesh_internal {
+  mesh_options   opts;
   int            num_faces;
   int           *face_indices;    /* unpacked flat: 3 ints per triangle */
-  vector3       *face_normals;
-  number        *face_areas;
-  int            num_bvh_nodes;
+  vector3       *face_normals;    /* NULL if compact */
+  geom_box       bbox;
+  int            num_bvh_nodes;   /* 0 if compact */
   mesh_bvh_node *bvh;
   int           *bvh_face_ids;
+  int            bvh_stack_size;  /* traversal stack entries needed */
+  int             num_qbvh_nodes; /* 0 if there is no 4-wide BVH */
+  mesh_qbvh_node *qbvh;
+  int             qbvh_stack_size;
+  int             num_cbvh_nodes; /* 0 if there is no quantized BVH */
+  int             cbvh_root;      /* as a mesh_cbvh_node child */
+  mesh_cbvh_node *cbvh;
+  int             grid_n[3];      /* occupancy grid (NULL grid if none) */
+  vector3         grid_low;
+  double          grid_inv_h;
+  unsigned char  *grid;
   vector3        centroid;
   number         lengthscale;
 } mesh_internal;
@@ -117,22 +320,27 @@ static inline mesh_internal *mesh_priv(const mesh *m) {
 static boolean node_in_polygon(double qx, double qy, vector3 *nodes, int num_nodes);
 static boolean point_in_prism(prism *prsm, vector3 pc);
 static vector3 normal_to_prism(prism *prsm, vector3 pc);
+static double distance_to_prism(prism *prsm, vector3 pc);
 static double intersect_line_segment_with_prism(prism *prsm, vector3 pc, vector3 dc, double a,
                                                 double b);
+int intersect_line_with_prism(prism *prsm, vector3 pc, vector3 dc, double *slist, int slist_len);
 static double get_prism_volume(prism *prsm);
 static void get_prism_bounding_box(prism *prsm, geom_box *box);
 static void display_prism_info(int indentby, geometric_object *o);
 static void init_prism(geometric_object *o);
 static void reinit_prism(geometric_object *o);
-static void init_mesh(geometric_object *o);
+static void init_mesh(geometric_object *o, mesh_options opts);
 static void reinit_mesh(geometric_object *o);
 static boolean point_in_mesh(const mesh *m, vector3 p);
 static vector3 normal_to_mesh(const mesh *m, vector3 p);
+static double distance_to_mesh(const mesh *m, vector3 p);
 static void get_mesh_bounding_box(const mesh *m, geom_box *box);
 static double get_mesh_volume(const mesh *m);
 static void display_mesh_info(int indentby, const geometric_object *o);
 static double intersect_line_segment_with_mesh(const mesh *m, vector3 p, vector3 d,
                                                double a, double b);
+static int intersect_line_with_mesh(const mesh *m, vector3 p, vector3 d, double *slist,
+                                    int slist_len);
 /**************************************************************************/
 
 /* Allows writing to Python's stdout when running from Meep's Python interface */
@@ -158,15 +366,15 @@ void ctl_printf(const char *fmt, ...) {
    its cartesian length is unity. */
 static void lattice_normalize(vector3 *v) {
   *v = vector3_scale(
-      1.0 / sqrt(vector3_dot(*v, matrix3x3_vector3_mult(geometry_lattice.metric, *v))), *v);
+      1.0 / sqrt(vector3_dot(*v, matrix3x3_vector3_mult(CTX(geometry_lattice).metric, *v))), *v);
 }
 
 static vector3 lattice_to_cartesian(vector3 v) {
-  return matrix3x3_vector3_mult(geometry_lattice.basis, v);
+  return matrix3x3_vector3_mult(CTX(geometry_lattice).basis, v);
 }
 
 static vector3 cartesian_to_lattice(vector3 v) {
-  return matrix3x3_vector3_mult(matrix3x3_inverse(geometry_lattice.basis), v);
+  return matrix3x3_vector3_mult(matrix3x3_inverse(CTX(geometry_lattice).basis), v);
 }
 
 /* geom_fix_object_ptr is called after an object's externally-configurable parameters
@@ -189,7 +397,7 @@ void geom_fix_object_ptr(geometric_object *o) {
       if (o->subclass.cylinder_data->which_subclass == CYL WEDGE) {
         vector3 a = o->subclass.cylinder_data->axis;
         vector3 s = o->subclass.cylinder_data->subclass.wedge_data->wedge_start;
-        double p = vector3_dot(s, matrix3x3_vector3_mult(geometry_lattice.metric, a));
+        double p = vector3_dot(s, matrix3x3_vector3_mult(CTX(geometry_lattice).metric, a));
         o->subclass.cylinder_data->subclass.wedge_data->e1 = vector3_minus(s, vector3_scale(p, a));
         lattice_normalize(&o->subclass.cylinder_data->subclass.wedge_data->e1);
         o->subclass.cylinder_data->subclass.wedge_data->e2 = cartesian_to_lattice(vector3_cross(
@@ -248,7 +456,7 @@ void geom_fix_object_list(geometric_object_list geometry) {
 
 void geom_fix_objects0(geometric_object_list geometry) { geom_fix_object_list(geometry); }
 
-void geom_fix_objects(void) { geom_fix_object_list(geometry); }
+void geom_fix_objects(void) { geom_fix_object_list(CTX(geometry)); }
 
 void geom_fix_lattice0(lattice *L) {
   L->basis1 = unit_vector3(L->basis1);
@@ -328,11 +536,12 @@ boolean point_in_fixed_pobjectp(vector3 p, geometric_object *o) {
     case GEOM GEOMETRIC_OBJECT_SELF: return 0;
     case GEOM SPHERE: {
       number radius = o->subclass.sphere_data->radius;
-      return (radius > 0.0 && vector3_dot(r, matrix3x3_vector3_mult(geometry_lattice.metric, r)) <=
-                                  radius * radius);
+      return (radius > 0.0 &&
+              vector3_dot(r, matrix3x3_vector3_mult(CTX(geometry_lattice).metric, r)) <=
+                  radius * radius);
     }
     case GEOM CYLINDER: {
-      vector3 rm = matrix3x3_vector3_mult(geometry_lattice.metric, r);
+      vector3 rm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, r);
       number proj = vector3_dot(o->subclass.cylinder_data->axis, rm);
       number height = o->subclass.cylinder_data->height;
       if (fabs(proj) <= 0.5 * height) {
@@ -397,6 +606,266 @@ boolean point_in_fixed_pobjectp(vector3 p, geometric_object *o) {
   return 0;
 }
 
+/* Initialize the query record q for the fixed object o, for use by
+   point_in_object_query.  q refers to o only for object types that
+   have no specialized record (prisms, meshes, and compound objects),
+   but it must be recomputed if o or the lattice is changed. */
+void compile_geom_object_query(const geometric_object *o, geom_object_query *q) {
+  const vector3 ex = {1, 0, 0}, ey = {0, 1, 0}, ez = {0, 0, 1};
+  matrix3x3 identity;
+
+  identity.c0 = ex;
+  identity.c1 = ey;
+  identity.c2 = ez;
+  memset(q, 0, sizeof(geom_object_query));
+  q->o = o;
+  q->center = o->center;
+  q->m = CTX(geometry_lattice).metric;
+  q->cartesian = matrix3x3_equal(q->m, identity);
+  q->kind = GEOM_QUERY_EMPTY;
+
+  switch (o->which_subclass) {
+    case GEOM SPHERE:
+      q->radius = o->subclass.sphere_data->radius;
+      q->radius_sq = q->radius * q->radius;
+      if (q->radius > 0.0) q->kind = GEOM_QUERY_SPHERE;
+      break;
+    case GEOM CYLINDER: {
+      const cylinder *cyl = o->subclass.cylinder_data;
+      q->axis = cyl->axis;
+      q->height = cyl->height;
+      q->radius = cyl->radius;
+      q->radius_sq = q->radius * q->radius;
+      if (cyl->which_subclass == CYL CONE) {
+        q->dradius = cyl->subclass.cone_data->radius2 - q->radius;
+        q->kind = GEOM_QUERY_CONE;
+      }
+      else if (q->radius != 0.0) {
+        q->kind = GEOM_QUERY_CYLINDER;
+        if (cyl->which_subclass == CYL WEDGE) {
+          q->e1 = cyl->subclass.wedge_data->e1;
+          q->e2 = cyl->subclass.wedge_data->e2;
+          q->wedge_angle = cyl->subclass.wedge_data->wedge_angle;
+          q->kind = GEOM_QUERY_WEDGE;
+        }
+      }
+      break;
+    }
+    case GEOM BLOCK:
+      q->m = o->subclass.block_data->projection_matrix;
+      if (o->subclass.block_data->which_subclass == BLK BLOCK_SELF) {
+        q->half_size = vector3_scale(0.5, o->subclass.block_data->size);
+        q->kind = GEOM_QUERY_BLOCK;
+      }
+      else if (o->subclass.block_data->which_subclass == BLK ELLIPSOID) {
+        q->half_size = o->subclass.block_data->subclass.ellipsoid_data->inverse_semi_axes;
+        q->kind = GEOM_QUERY_ELLIPSOID;
+      }
+      break;
+    case GEOM PRISM:
+    case GEOM MESH:
+    case GEOM COMPOUND_GEOMETRIC_OBJECT: q->kind = GEOM_QUERY_OBJECT; break;
+    default: break;
+  }
+}
+
+/* Equivalent to point_in_fixed_objectp(p, *q->o), where q was
+   initialized by compile_geom_object_query, but faster. */
+boolean point_in_object_query(vector3 p, const geom_object_query *q) {
+  vector3 r = vector3_minus(p, q->center);
+
+  switch (q->kind) {
+    case GEOM_QUERY_EMPTY: return 0;
+    case GEOM_QUERY_SPHERE:
+      return vector3_dot(r, q->cartesian ? r : matrix3x3_vector3_mult(q->m, r)) <= q->radius_sq;
+    case GEOM_QUERY_CYLINDER:
+    case GEOM_QUERY_CONE:
+    case GEOM_QUERY_WEDGE: {
+      vector3 rm = q->cartesian ? r : matrix3x3_vector3_mult(q->m, r);
+      number proj = vector3_dot(q->axis, rm);
+      number radius_sq = q->radius_sq;
+      if (fabs(proj) > 0.5 * q->height) return 0;
+      if (q->kind == GEOM_QUERY_CONE) {
+        number radius = q->radius + (proj / q->height + 0.5) * q->dradius;
+        if (!(radius != 0.0)) return 0;
+        radius_sq = radius * radius;
+      }
+      else if (q->kind == GEOM_QUERY_WEDGE) {
+        number theta = atan2(vector3_dot(rm, q->e2), vector3_dot(rm, q->e1));
+        if (q->wedge_angle > 0) {
+          if (theta < 0) theta = theta + 2 * K_PI;
+          if (theta > q->wedge_angle) return 0;
+        }
+        else {
+          if (theta > 0) theta = theta - 2 * K_PI;
+          if (theta < q->wedge_angle) return 0;
+        }
+      }
+      return vector3_dot(r, rm) - proj * proj <= radius_sq;
+    }
+    case GEOM_QUERY_BLOCK: {
+      vector3 proj = matrix3x3_vector3_mult(q->m, r);
+      return (fabs(proj.x) <= q->half_size.x && fabs(proj.y) <= q->half_size.y &&
+              fabs(proj.z) <= q->half_size.z);
+    }
+    case GEOM_QUERY_ELLIPSOID: {
+      vector3 proj = matrix3x3_vector3_mult(q->m, r);
+      double a = proj.x * q->half_size.x, b = proj.y * q->half_size.y, c = proj.z * q->half_size.z;
+      return (a * a + b * b + c * c <= 1.0);
+    }
+    case GEOM_QUERY_OBJECT: {
+      geometric_object o = *q->o;
+      return point_in_fixed_pobjectp(p, &o);
+    }
+  }
+  return 0;
+}
+
+/* Batched equivalent of point_in_object_query for the n points
+   (x[i],y[i],z[i]), setting inside[i] to whether point i is in the
+   object.  For the common primitives, the points are tested in chunks
+   by branch-free loops over separate coordinate arrays ("structure of
+   arrays") that the compiler can vectorize, testing several points per
+   instruction.  These loops produce a mask of doubles (1.0 or 0.0)
+   rather than of booleans, since converting a comparison of doubles
+   directly to an int is not vectorizable with baseline SSE2.  (When
+   compiled with OpenMP, "omp simd" asks for vectorization even at
+   optimization levels that don't otherwise vectorize loops.) */
+
+#define GEOM_QUERY_CHUNK 64
+
+static inline void sphere_mask(const geom_object_query *q, const double *x, const double *y,
+                               const double *z, int n, double *mask, int cartesian) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double radius_sq = q->radius_sq;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double mx = cartesian ? rx : m.c0.x * rx + m.c1.x * ry + m.c2.x * rz;
+    double my = cartesian ? ry : m.c0.y * rx + m.c1.y * ry + m.c2.y * rz;
+    double mz = cartesian ? rz : m.c0.z * rx + m.c1.z * ry + m.c2.z * rz;
+    mask[i] = rx * mx + ry * my + rz * mz <= radius_sq ? 1.0 : 0.0;
+  }
+}
+
+static inline void cylinder_mask(const geom_object_query *q, const double *x, const double *y,
+                                 const double *z, int n, double *mask, int cartesian, int cone) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double ax = q->axis.x, ay = q->axis.y, az = q->axis.z;
+  const double height = q->height, half_height = 0.5 * q->height;
+  const double radius = q->radius, radius_sq = q->radius_sq, dradius = q->dradius;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double mx = cartesian ? rx : m.c0.x * rx + m.c1.x * ry + m.c2.x * rz;
+    double my = cartesian ? ry : m.c0.y * rx + m.c1.y * ry + m.c2.y * rz;
+    double mz = cartesian ? rz : m.c0.z * rx + m.c1.z * ry + m.c2.z * rz;
+    double proj = ax * mx + ay * my + az * mz;
+    double r = cone ? radius + (proj / height + 0.5) * dradius : radius;
+    double r_sq = cone ? r * r : radius_sq;
+    mask[i] = (fabs(proj) <= half_height) & (!cone | (r != 0.0)) &
+                      (rx * mx + ry * my + rz * mz - proj * proj <= r_sq)
+                  ? 1.0
+                  : 0.0;
+  }
+}
+
+static inline void block_mask(const geom_object_query *q, const double *x, const double *y,
+                              const double *z, int n, double *mask, int ellipsoid) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double sx = q->half_size.x, sy = q->half_size.y, sz = q->half_size.z;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double px = m.c0.x * rx + m.c1.x * ry + m.c2.x * rz;
+    double py = m.c0.y * rx + m.c1.y * ry + m.c2.y * rz;
+    double pz = m.c0.z * rx + m.c1.z * ry + m.c2.z * rz;
+    if (ellipsoid) {
+      double a = px * sx, b = py * sy, c = pz * sz;
+      mask[i] = a * a + b * b + c * c <= 1.0 ? 1.0 : 0.0;
+    }
+    else
+      mask[i] = (fabs(px) <= sx) & (fabs(py) <= sy) & (fabs(pz) <= sz) ? 1.0 : 0.0;
+  }
+}
+
+void point_in_object_query_batch(const geom_object_query *q, const double *x, const double *y,
+                                 const double *z, int n, boolean *inside) {
+  double mask[GEOM_QUERY_CHUNK];
+  int i0, i;
+
+  switch (q->kind) {
+    case GEOM_QUERY_EMPTY:
+      for (i = 0; i < n; ++i)
+        inside[i] = 0;
+      return;
+    case GEOM_QUERY_SPHERE:
+    case GEOM_QUERY_CYLINDER:
+    case GEOM_QUERY_CONE:
+    case GEOM_QUERY_BLOCK:
+    case GEOM_QUERY_ELLIPSOID: break;
+    default: /* wedges, prisms, etc.: no faster than one point at a time */
+      for (i = 0; i < n; ++i) {
+        vector3 p;
+        p.x = x[i];
+        p.y = y[i];
+        p.z = z[i];
+        inside[i] = point_in_object_query(p, q);
+      }
+      return;
+  }
+
+  for (i0 = 0; i0 < n; i0 += GEOM_QUERY_CHUNK) {
+    int nc = MIN(n - i0, GEOM_QUERY_CHUNK);
+    const double *xc = x + i0, *yc = y + i0, *zc = z + i0;
+    switch (q->kind) {
+      case GEOM_QUERY_SPHERE:
+        if (q->cartesian)
+          sphere_mask(q, xc, yc, zc, nc, mask, 1);
+        else
+          sphere_mask(q, xc, yc, zc, nc, mask, 0);
+        break;
+      case GEOM_QUERY_CYLINDER:
+        if (q->cartesian)
+          cylinder_mask(q, xc, yc, zc, nc, mask, 1, 0);
+        else
+          cylinder_mask(q, xc, yc, zc, nc, mask, 0, 0);
+        break;
+      case GEOM_QUERY_CONE:
+        if (q->cartesian)
+          cylinder_mask(q, xc, yc, zc, nc, mask, 1, 1);
+        else
+          cylinder_mask(q, xc, yc, zc, nc, mask, 0, 1);
+        break;
+      case GEOM_QUERY_BLOCK: block_mask(q, xc, yc, zc, nc, mask, 0); break;
+      default: block_mask(q, xc, yc, zc, nc, mask, 1); break;
+    }
+    for (i = 0; i < nc; ++i)
+      inside[i0 + i] = mask[i] != 0.0;
+  }
+}
+
+/* Batched equivalent of point_in_fixed_objectp(p, *o) for the n points
+   p = (x[i],y[i],z[i]); see point_in_object_query_batch. */
+void point_in_fixed_objectp_batch(const geometric_object *o, const double *x, const double *y,
+                                  const double *z, int n, boolean *inside) {
+  geom_object_query q;
+  compile_geom_object_query(o, &q);
+  point_in_object_query_batch(&q, x, y, z, n, inside);
+}
+
 /**************************************************************************/
 
 /* convert a point p inside o to a coordinate in [0,1]^3 that
@@ -478,7 +947,7 @@ vector3 normal_to_fixed_object(vector3 p, geometric_object o) {
   switch (o.which_subclass) {
 
     case GEOM CYLINDER: {
-      vector3 rm = matrix3x3_vector3_mult(geometry_lattice.metric, r);
+      vector3 rm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, r);
       double proj = vector3_dot(o.subclass.cylinder_data->axis, rm),
              height = o.subclass.cylinder_data->height, radius, prad;
       if (fabs(proj) > height * 0.5) return o.subclass.cylinder_data->axis;
@@ -538,6 +1007,378 @@ vector3 normal_to_fixed_object(vector3 p, geometric_object o) {
   return r; // never get here
 }
 
+/**************************************************************************/
+/* Signed distance from a point p (in the lattice basis) to the surface
+   of an object: negative inside the object and positive outside, in
+   Cartesian units.  The distance is exact for every kind of object
+   (for blocks and ellipsoids, as long as their axes e1, e2, e3 are
+   orthogonal), except that for compound objects it is the minimum over
+   the components, which is exact outside the union but may underestimate
+   the depth of points inside it.  Objects that contain no points have a
+   distance of HUGE_VAL everywhere.
+
+   NOT THREAD-SAFE: calls geom_fix_object_ptr; see normal_to_object. */
+
+double signed_distance_to_object(vector3 p, geometric_object o) {
+  geom_fix_object_ptr(&o);
+  return signed_distance_to_fixed_object(p, o);
+}
+
+double signed_distance_to_fixed_object(vector3 p, geometric_object o) {
+  geom_object_query q;
+  compile_geom_object_query(&o, &q);
+  return signed_distance_to_object_query(p, &q);
+}
+
+/* distance from (x,y) to the line segment from (ax,ay) to (bx,by) */
+static double distance_to_segment2(double x, double y, double ax, double ay, double bx,
+                                   double by) {
+  double dx = bx - ax, dy = by - ay, len2 = dx * dx + dy * dy;
+  double t = len2 > 0 ? ((x - ax) * dx + (y - ay) * dy) / len2 : 0;
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  return hypot(x - ax - t * dx, y - ay - t * dy);
+}
+
+/* signed distance to the Cartesian product of a 2d region and the
+   interval |z| <= h/2, given the signed distance d2 to the 2d region */
+static double extruded_distance(double d2, double z, double h) {
+  double dz = fabs(z) - 0.5 * h;
+  return hypot(fmax(d2, 0), fmax(dz, 0)) + fmin(fmax(d2, dz), 0);
+}
+
+/* signed distance from (rho,z), rho >= 0, to the cross-section of a cone
+   whose radius varies linearly from r1 at z = -h/2 to r2 at z = h/2
+   (where, as in point_in_fixed_objectp, only |radius| matters) */
+static double cone_profile_distance(double rho, double z, double h, double r1, double r2) {
+  double z1 = -0.5 * h, z2 = 0.5 * h, a1 = fabs(r1), a2 = fabs(r2), d, radius;
+  d = fmin(distance_to_segment2(rho, z, 0, z1, a1, z1), distance_to_segment2(rho, z, 0, z2, a2, z2));
+  if (r1 * r2 < 0) { /* the side passes through the axis at z0 */
+    double z0 = z1 + h * r1 / (r1 - r2);
+    d = fmin(d, distance_to_segment2(rho, z, a1, z1, 0, z0));
+    d = fmin(d, distance_to_segment2(rho, z, 0, z0, a2, z2));
+  }
+  else
+    d = fmin(d, distance_to_segment2(rho, z, a1, z1, a2, z2));
+  if (fabs(z) > 0.5 * h) return d;
+  radius = r1 + (z / h + 0.5) * (r2 - r1);
+  return radius != 0.0 && rho <= fabs(radius) ? -d : d;
+}
+
+/* signed distance from (x,y) to the sector of the disk of the given
+   radius between angles 0 and wedge_angle (clockwise if negative) */
+static double sector_distance(double x, double y, double radius, double wedge_angle) {
+  double rho = hypot(x, y), theta = atan2(y, x), d;
+  int in_angle;
+  if (fabs(wedge_angle) >= 2 * K_PI) return rho - radius;
+  if (wedge_angle > 0) {
+    if (theta < 0) theta = theta + 2 * K_PI;
+    in_angle = theta <= wedge_angle;
+  }
+  else {
+    if (theta > 0) theta = theta - 2 * K_PI;
+    in_angle = theta >= wedge_angle;
+  }
+  d = fmin(distance_to_segment2(x, y, 0, 0, radius, 0),
+          distance_to_segment2(x, y, 0, 0, radius * cos(wedge_angle), radius * sin(wedge_angle)));
+  if (!in_angle) return d;
+  d = fmin(d, fabs(rho - radius));
+  return rho <= radius ? -d : d;
+}
+
+/* Distance from (y0,y1), y0,y1 >= 0, to the ellipse with semi-axes
+   e0 >= e1 > 0, by bisection on the Lagrange-multiplier equation as
+   described in D. Eberly, "Distance from a point to an ellipse, an
+   ellipsoid, or a hyperellipsoid" (2013). */
+static double ellipse_distance(double e0, double e1, double y0, double y1) {
+  if (y1 > 0) {
+    if (y0 > 0) {
+      double z0 = y0 / e0, z1 = y1 / e1, g = z0 * z0 + z1 * z1 - 1;
+      double r0 = (e0 / e1) * (e0 / e1), n0 = r0 * z0, s0 = z1 - 1, s1, s = 0;
+      if (g == 0) return 0;
+      s1 = g < 0 ? 0 : hypot(n0, z1) - 1;
+      for (;;) {
+        double q0, q1;
+        s = 0.5 * (s0 + s1);
+        if (s == s0 || s == s1) break;
+        q0 = n0 / (s + r0);
+        q1 = z1 / (s + 1);
+        g = q0 * q0 + q1 * q1 - 1;
+        if (g > 0)
+          s0 = s;
+        else if (g < 0)
+          s1 = s;
+        else
+          break;
+      }
+      return hypot(r0 * y0 / (s + r0) - y0, y1 / (s + 1) - y1);
+    }
+    return fabs(y1 - e1);
+  }
+  else {
+    double numer0 = e0 * y0, denom0 = e0 * e0 - e1 * e1;
+    if (numer0 < denom0) {
+      double xde0 = numer0 / denom0;
+      return hypot(e0 * xde0 - y0, e1 * sqrt(1 - xde0 * xde0));
+    }
+    return fabs(y0 - e0);
+  }
+}
+
+/* as ellipse_distance, for the ellipsoid with semi-axes e0 >= e1 >= e2 > 0 */
+static double ellipsoid_distance(double e0, double e1, double e2, double y0, double y1,
+                                 double y2) {
+  if (y2 > 0) {
+    if (y1 > 0) {
+      if (y0 > 0) {
+        double z0 = y0 / e0, z1 = y1 / e1, z2 = y2 / e2, g = z0 * z0 + z1 * z1 + z2 * z2 - 1;
+        double r0 = (e0 / e2) * (e0 / e2), r1 = (e1 / e2) * (e1 / e2);
+        double n0 = r0 * z0, n1 = r1 * z1, s0 = z2 - 1, s1, s = 0;
+        if (g == 0) return 0;
+        s1 = g < 0 ? 0 : sqrt(n0 * n0 + n1 * n1 + z2 * z2) - 1;
+        for (;;) {
+          double q0, q1, q2;
+          s = 0.5 * (s0 + s1);
+          if (s == s0 || s == s1) break;
+          q0 = n0 / (s + r0);
+          q1 = n1 / (s + r1);
+          q2 = z2 / (s + 1);
+          g = q0 * q0 + q1 * q1 + q2 * q2 - 1;
+          if (g > 0)
+            s0 = s;
+          else if (g < 0)
+            s1 = s;
+          else
+            break;
+        }
+        z0 = r0 * y0 / (s + r0) - y0;
+        z1 = r1 * y1 / (s + r1) - y1;
+        z2 = y2 / (s + 1) - y2;
+        return sqrt(z0 * z0 + z1 * z1 + z2 * z2);
+      }
+      return ellipse_distance(e1, e2, y1, y2);
+    }
+    if (y0 > 0) return ellipse_distance(e0, e2, y0, y2);
+    return fabs(y2 - e2);
+  }
+  else {
+    double denom0 = e0 * e0 - e2 * e2, denom1 = e1 * e1 - e2 * e2;
+    double numer0 = e0 * y0, numer1 = e1 * y1;
+    if (numer0 < denom0 && numer1 < denom1) {
+      double xde0 = numer0 / denom0, xde1 = numer1 / denom1;
+      double discr = 1 - xde0 * xde0 - xde1 * xde1;
+      if (discr > 0) {
+        double d0 = e0 * xde0 - y0, d1 = e1 * xde1 - y1;
+        return sqrt(d0 * d0 + d1 * d1 + e2 * e2 * discr);
+      }
+    }
+    return ellipse_distance(e0, e1, y0, y1);
+  }
+}
+
+/* signed distance from proj, in the coordinates of the ellipsoid axes,
+   to the ellipsoid with inverse semi-axes isa */
+static double ellipsoid_signed_distance(vector3 proj, vector3 isa) {
+  double e[3], y[3], d, a = proj.x * isa.x, b = proj.y * isa.y, c = proj.z * isa.z;
+  int i, j;
+  e[0] = 1 / isa.x;
+  e[1] = 1 / isa.y;
+  e[2] = 1 / isa.z;
+  y[0] = fabs(proj.x);
+  y[1] = fabs(proj.y);
+  y[2] = fabs(proj.z);
+  for (i = 0; i < 2; ++i) /* sort the axes by decreasing length */
+    for (j = 2; j > i; --j)
+      if (e[j] > e[j - 1]) {
+        double t = e[j];
+        e[j] = e[j - 1];
+        e[j - 1] = t;
+        t = y[j];
+        y[j] = y[j - 1];
+        y[j - 1] = t;
+      }
+  if (!(e[2] > 0)) { /* degenerate: a flat ellipse, or a segment */
+    double h2 = y[2] * y[2];
+    d = 0;
+    if (!(e[1] > 0)) {
+      d = fmax(y[0] - e[0], 0);
+      h2 += y[1] * y[1];
+    }
+    else if ((y[0] / e[0]) * (y[0] / e[0]) + (y[1] / e[1]) * (y[1] / e[1]) > 1)
+      d = ellipse_distance(e[0], e[1], y[0], y[1]);
+    return sqrt(d * d + h2);
+  }
+  d = ellipsoid_distance(e[0], e[1], e[2], y[0], y[1], y[2]);
+  return a * a + b * b + c * c <= 1.0 ? -d : d;
+}
+
+/* Equivalent to signed_distance_to_fixed_object(p, *q->o), where q was
+   initialized by compile_geom_object_query. */
+double signed_distance_to_object_query(vector3 p, const geom_object_query *q) {
+  vector3 r = vector3_minus(p, q->center);
+
+  switch (q->kind) {
+    case GEOM_QUERY_EMPTY: return HUGE_VAL;
+    case GEOM_QUERY_SPHERE:
+      return sqrt(vector3_dot(r, q->cartesian ? r : matrix3x3_vector3_mult(q->m, r))) - q->radius;
+    case GEOM_QUERY_CYLINDER:
+    case GEOM_QUERY_CONE:
+    case GEOM_QUERY_WEDGE: {
+      vector3 rm = q->cartesian ? r : matrix3x3_vector3_mult(q->m, r);
+      double proj = vector3_dot(q->axis, rm);
+      if (q->kind == GEOM_QUERY_WEDGE)
+        return extruded_distance(sector_distance(vector3_dot(rm, q->e1), vector3_dot(rm, q->e2),
+                                                 q->radius, q->wedge_angle),
+                                 proj, q->height);
+      else {
+        double rho = sqrt(fmax(vector3_dot(r, rm) - proj * proj, 0));
+        if (q->kind == GEOM_QUERY_CYLINDER) return extruded_distance(rho - q->radius, proj, q->height);
+        return cone_profile_distance(rho, proj, q->height, q->radius, q->radius + q->dradius);
+      }
+    }
+    case GEOM_QUERY_BLOCK: {
+      vector3 proj = matrix3x3_vector3_mult(q->m, r);
+      double dx = fabs(proj.x) - q->half_size.x, dy = fabs(proj.y) - q->half_size.y,
+             dz = fabs(proj.z) - q->half_size.z;
+      double ox = fmax(dx, 0), oy = fmax(dy, 0), oz = fmax(dz, 0);
+      return sqrt(ox * ox + oy * oy + oz * oz) + fmin(fmax(dx, fmax(dy, dz)), 0);
+    }
+    case GEOM_QUERY_ELLIPSOID:
+      return ellipsoid_signed_distance(matrix3x3_vector3_mult(q->m, r), q->half_size);
+    case GEOM_QUERY_OBJECT: {
+      const geometric_object *o = q->o;
+      switch (o->which_subclass) {
+        case GEOM PRISM: {
+          double d = distance_to_prism(o->subclass.prism_data, p);
+          return point_in_prism(o->subclass.prism_data, p) ? -d : d;
+        }
+        case GEOM MESH: {
+          double d = distance_to_mesh(o->subclass.mesh_data, p);
+          return point_in_mesh(o->subclass.mesh_data, p) ? -d : d;
+        }
+        case GEOM COMPOUND_GEOMETRIC_OBJECT: {
+          int i;
+          int n = o->subclass.compound_geometric_object_data->component_objects.num_items;
+          geometric_object *os = o->subclass.compound_geometric_object_data->component_objects.items;
+          double d = HUGE_VAL;
+          for (i = 0; i < n; ++i) {
+            geometric_object oi = os[i];
+            oi.center = vector3_plus(oi.center, o->center);
+            d = fmin(d, signed_distance_to_fixed_object(p, oi));
+          }
+          return d;
+        }
+        default: break;
+      }
+    }
+  }
+  return HUGE_VAL;
+}
+
+/* Batched equivalent of signed_distance_to_object_query for the n points
+   (x[i],y[i],z[i]), setting dist[i] to the distance of point i.  As in
+   point_in_object_query_batch, spheres, cylinders, and blocks are
+   handled by branch-free loops that the compiler can vectorize. */
+
+static inline void sphere_distance(const geom_object_query *q, const double *x, const double *y,
+                                   const double *z, int n, double *dist, int cartesian) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double radius = q->radius;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double mx = cartesian ? rx : m.c0.x * rx + m.c1.x * ry + m.c2.x * rz;
+    double my = cartesian ? ry : m.c0.y * rx + m.c1.y * ry + m.c2.y * rz;
+    double mz = cartesian ? rz : m.c0.z * rx + m.c1.z * ry + m.c2.z * rz;
+    dist[i] = sqrt(rx * mx + ry * my + rz * mz) - radius;
+  }
+}
+
+static inline void cylinder_distance(const geom_object_query *q, const double *x, const double *y,
+                                     const double *z, int n, double *dist, int cartesian) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double ax = q->axis.x, ay = q->axis.y, az = q->axis.z;
+  const double half_height = 0.5 * q->height, radius = q->radius;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double mx = cartesian ? rx : m.c0.x * rx + m.c1.x * ry + m.c2.x * rz;
+    double my = cartesian ? ry : m.c0.y * rx + m.c1.y * ry + m.c2.y * rz;
+    double mz = cartesian ? rz : m.c0.z * rx + m.c1.z * ry + m.c2.z * rz;
+    double proj = ax * mx + ay * my + az * mz;
+    double dr = sqrt(fmax(rx * mx + ry * my + rz * mz - proj * proj, 0)) - radius;
+    double dz = fabs(proj) - half_height;
+    double odr = fmax(dr, 0), odz = fmax(dz, 0);
+    dist[i] = sqrt(odr * odr + odz * odz) + fmin(fmax(dr, dz), 0);
+  }
+}
+
+static inline void block_distance(const geom_object_query *q, const double *x, const double *y,
+                                  const double *z, int n, double *dist) {
+  const double cx = q->center.x, cy = q->center.y, cz = q->center.z;
+  const double sx = q->half_size.x, sy = q->half_size.y, sz = q->half_size.z;
+  const matrix3x3 m = q->m;
+  int i;
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (i = 0; i < n; ++i) {
+    double rx = x[i] - cx, ry = y[i] - cy, rz = z[i] - cz;
+    double dx = fabs(m.c0.x * rx + m.c1.x * ry + m.c2.x * rz) - sx;
+    double dy = fabs(m.c0.y * rx + m.c1.y * ry + m.c2.y * rz) - sy;
+    double dz = fabs(m.c0.z * rx + m.c1.z * ry + m.c2.z * rz) - sz;
+    double ox = fmax(dx, 0), oy = fmax(dy, 0), oz = fmax(dz, 0);
+    dist[i] = sqrt(ox * ox + oy * oy + oz * oz) + fmin(fmax(dx, fmax(dy, dz)), 0);
+  }
+}
+
+void signed_distance_to_object_query_batch(const geom_object_query *q, const double *x,
+                                           const double *y, const double *z, int n,
+                                           double *dist) {
+  int i;
+  switch (q->kind) {
+    case GEOM_QUERY_SPHERE:
+      if (q->cartesian)
+        sphere_distance(q, x, y, z, n, dist, 1);
+      else
+        sphere_distance(q, x, y, z, n, dist, 0);
+      break;
+    case GEOM_QUERY_CYLINDER:
+      if (q->cartesian)
+        cylinder_distance(q, x, y, z, n, dist, 1);
+      else
+        cylinder_distance(q, x, y, z, n, dist, 0);
+      break;
+    case GEOM_QUERY_BLOCK: block_distance(q, x, y, z, n, dist); break;
+    default: /* cones, wedges, ellipsoids, etcetera: one point at a time */
+      for (i = 0; i < n; ++i) {
+        vector3 p;
+        p.x = x[i];
+        p.y = y[i];
+        p.z = z[i];
+        dist[i] = signed_distance_to_object_query(p, q);
+      }
+      break;
+  }
+}
+
+/* Batched equivalent of signed_distance_to_fixed_object(p, *o) for the n
+   points p = (x[i],y[i],z[i]); see signed_distance_to_object_query_batch. */
+void signed_distance_to_fixed_object_batch(const geometric_object *o, const double *x,
+                                           const double *y, const double *z, int n,
+                                           double *dist) {
+  geom_object_query q;
+  compile_geom_object_query(o, &q);
+  signed_distance_to_object_query_batch(&q, x, y, z, n, dist);
+}
+
 /**************************************************************************/
 
 /* Here is a useful macro to loop over different possible shifts of
@@ -550,12 +1391,12 @@ vector3 normal_to_fixed_object(vector3 p, geometric_object o) {
 
 #define LOOP_PERIODIC(shiftby, body)                                                               \
   {                                                                                                \
-    switch (dimensions) {                                                                          \
+    switch (CTX(dimensions)) {                                                                     \
       case 1: {                                                                                    \
         int iii;                                                                                   \
         shiftby.y = shiftby.z = 0;                                                                 \
         for (iii = -1; iii <= 1; ++iii) {                                                          \
-          shiftby.x = iii * geometry_lattice.size.x;                                               \
+          shiftby.x = iii * CTX(geometry_lattice).size.x;                                          \
           body;                                                                                    \
         }                                                                                          \
         break;                                                                                     \
@@ -564,9 +1405,9 @@ vector3 normal_to_fixed_object(vector3 p, geometric_object o) {
         int iii, jjj;                                                                              \
         shiftby.z = 0;                                                                             \
         for (iii = -1; iii <= 1; ++iii) {                                                          \
-          shiftby.x = iii * geometry_lattice.size.x;                                               \
+          shiftby.x = iii * CTX(geometry_lattice).size.x;                                          \
           for (jjj = -1; jjj <= 1; ++jjj) {                                                        \
-            shiftby.y = jjj * geometry_lattice.size.y;                                             \
+            shiftby.y = jjj * CTX(geometry_lattice).size.y;                                        \
             body;                                                                                  \
           }                                                                                        \
         }                                                                                          \
@@ -575,17 +1416,17 @@ vector3 normal_to_fixed_object(vector3 p, geometric_object o) {
       case 3: {                                                                                    \
         int iii, jjj, kkk;                                                                         \
         for (iii = -1; iii <= 1; ++iii) {                                                          \
-          shiftby.x = iii * geometry_lattice.size.x;                                               \
+          shiftby.x = iii * CTX(geometry_lattice).size.x;                                          \
           for (jjj = -1; jjj <= 1; ++jjj) {                                                        \
-            shiftby.y = jjj * geometry_lattice.size.y;                                             \
+            shiftby.y = jjj * CTX(geometry_lattice).size.y;                                        \
             for (kkk = -1; kkk <= 1; ++kkk) {                                                      \
-              shiftby.z = kkk * geometry_lattice.size.z;                                           \
+              shiftby.z = kkk * CTX(geometry_lattice).size.z;                                      \
               body;                                                                                \
-              if (geometry_lattice.size.z == 0) break;                                             \
+              if (CTX(geometry_lattice).size.z == 0) break;                                        \
             }                                                                                      \
-            if (geometry_lattice.size.y == 0) break;                                               \
+            if (CTX(geometry_lattice).size.y == 0) break;                                          \
           }                                                                                        \
-          if (geometry_lattice.size.x == 0) break;                                                 \
+          if (CTX(geometry_lattice).size.x == 0) break;                                            \
         }                                                                                          \
         break;                                                                                     \
       }                                                                                            \
@@ -645,7 +1486,7 @@ geometric_object object_of_point0(geometric_object_list geometry, vector3 p, vec
   /* loop in reverse order so that later items are given precedence: */
   for (index = geometry.num_items - 1; index >= 0; --index) {
     o = geometry.items[index];
-    if ((ensure_periodicity && point_shift_in_periodic_fixed_pobjectp(p, &o, shiftby)) ||
+    if ((CTX(ensure_periodicity) && point_shift_in_periodic_fixed_pobjectp(p, &o, shiftby)) ||
         point_in_fixed_pobjectp(p, &o))
       return o;
   }
@@ -654,7 +1495,7 @@ geometric_object object_of_point0(geometric_object_list geometry, vector3 p, vec
 }
 
 geometric_object object_of_point(vector3 p, vector3 *shiftby) {
-  return object_of_point0(geometry, p, shiftby);
+  return object_of_point0(CTX(geometry), p, shiftby);
 }
 
 material_type material_of_point_inobject0(geometric_object_list geometry, vector3 p,
@@ -663,11 +1504,11 @@ material_type material_of_point_inobject0(geometric_object_list geometry, vector
   geometric_object o = object_of_point0(geometry, p, &shiftby);
   *inobject = o.which_subclass != GEOM GEOMETRIC_OBJECT_SELF;
   ;
-  return (*inobject ? o.material : default_material);
+  return (*inobject ? o.material : CTX(default_material));
 }
 
 material_type material_of_point_inobject(vector3 p, boolean *inobject) {
-  return material_of_point_inobject0(geometry, p, inobject);
+  return material_of_point_inobject0(CTX(geometry), p, inobject);
 }
 
 material_type material_of_point0(geometric_object_list geometry, vector3 p) {
@@ -675,7 +1516,7 @@ material_type material_of_point0(geometric_object_list geometry, vector3 p) {
   return material_of_point_inobject0(geometry, p, &inobject);
 }
 
-material_type material_of_point(vector3 p) { return material_of_point0(geometry, p); }
+material_type material_of_point(vector3 p) { return material_of_point0(CTX(geometry), p); }
 
 /**************************************************************************/
 
@@ -757,11 +1598,11 @@ int intersect_line_with_object(vector3 p, vector3 d, geometric_object o, double
   switch (o.which_subclass) {
     case GEOM SPHERE: {
       number radius = o.subclass.sphere_data->radius;
-      vector3 dm = matrix3x3_vector3_mult(geometry_lattice.metric, d);
+      vector3 dm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, d);
       double a = vector3_dot(d, dm);
       double b2 = -vector3_dot(dm, p);
       double c =
-          vector3_dot(p, matrix3x3_vector3_mult(geometry_lattice.metric, p)) - radius * radius;
+          vector3_dot(p, matrix3x3_vector3_mult(CTX(geometry_lattice).metric, p)) - radius * radius;
       double discrim = b2 * b2 - a * c;
       if (discrim < 0)
         return 0;
@@ -777,8 +1618,8 @@ int intersect_line_with_object(vector3 p, vector3 d, geometric_object o, double
       }
     } // case GEOM SPHERE
     case GEOM CYLINDER: {
-      vector3 dm = matrix3x3_vector3_mult(geometry_lattice.metric, d);
-      vector3 pm = matrix3x3_vector3_mult(geometry_lattice.metric, p);
+      vector3 dm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, d);
+      vector3 pm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, p);
       number height = o.subclass.cylinder_data->height;
       number radius = o.subclass.cylinder_data->radius;
       number radius2 = o.subclass.cylinder_data->which_subclass == CYL CONE
@@ -918,6 +1759,68 @@ int intersect_line_with_object(vector3 p, vector3 d, geometric_object o, double
   }
 }
 
+/* narrow [*lo, *hi] to the s where h0 + s*h1 >= 0 */
+static void clip_line_to_half_plane(double h0, double h1, double *lo, double *hi) {
+  if (h1 > 0)
+    *lo = fmax(*lo, -h0 / h1);
+  else if (h1 < 0)
+    *hi = fmin(*hi, -h0 / h1);
+  else if (h0 < 0)
+    *hi = -HUGE_VAL;
+}
+
+/* Clip the segment [s[0], s[1]] of the line p + s*dir inside the full
+   cylinder of the wedge o to the wedge's angular range, storing the
+   resulting crossings (at most 4) in slist and returning their number.
+   With x and y the coordinates along e1 and e2 as in
+   point_in_fixed_pobjectp, and the sign of y flipped for a negative
+   wedge_angle, the wedge is the intersection (for |wedge_angle| <= pi) or
+   the union (otherwise) of the half-planes y >= 0 and
+   x sin(angle) - y cos(angle) >= 0. */
+static int wedge_line_crossings(const geometric_object *o, vector3 p, vector3 dir,
+                                const double s[2], double *slist) {
+  const wedge *w = o->subclass.cylinder_data->subclass.wedge_data;
+  vector3 pm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, vector3_minus(p, o->center));
+  vector3 dm = matrix3x3_vector3_mult(CTX(geometry_lattice).metric, dir);
+  double angle = fabs(w->wedge_angle), sgn = w->wedge_angle > 0 ? 1 : -1;
+  double x0 = vector3_dot(pm, w->e1), x1 = vector3_dot(dm, w->e1);
+  double y0 = sgn * vector3_dot(pm, w->e2), y1 = sgn * vector3_dot(dm, w->e2);
+  double h0 = x0 * sin(angle) - y0 * cos(angle), h1 = x1 * sin(angle) - y1 * cos(angle);
+  double lo, hi;
+  int ns = 0;
+
+  if (angle >= 2 * K_PI) {
+    slist[0] = s[0];
+    slist[1] = s[1];
+    return 2;
+  }
+  if (angle <= K_PI) { /* the segment within both half-planes */
+    lo = s[0];
+    hi = s[1];
+    clip_line_to_half_plane(y0, y1, &lo, &hi);
+    clip_line_to_half_plane(h0, h1, &lo, &hi);
+    if (lo >= hi) return 0;
+    slist[0] = lo;
+    slist[1] = hi;
+    return 2;
+  }
+  /* remove the gap [lo, hi] outside both half-planes from the segment */
+  lo = -HUGE_VAL;
+  hi = HUGE_VAL;
+  clip_line_to_half_plane(-y0, -y1, &lo, &hi);
+  clip_line_to_half_plane(-h0, -h1, &lo, &hi);
+  if (lo >= hi) lo = hi = s[1];
+  if (s[0] < fmin(lo, s[1])) {
+    slist[ns++] = s[0];
+    slist[ns++] = fmin(lo, s[1]);
+  }
+  if (fmax(hi, s[0]) < s[1]) {
+    slist[ns++] = fmax(hi, s[0]);
+    slist[ns++] = s[1];
+  }
+  return ns;
+}
+
 /* Compute the intersections with o of a line along p+s*d in the interval s in [a,b], returning
     the length of the s intersection in this interval.  (Note: o must not be a compound object.) */
 double intersect_line_segment_with_object(vector3 p, vector3 d, geometric_object o, double a,
@@ -932,6 +1835,16 @@ double intersect_line_segment_with_object(vector3 p, vector3 d, geometric_object
     double s[2];
     if (2 == intersect_line_with_object(p, d, o, s)) {
       double ds = (s[0] < s[1] ? MIN(s[1], b) - MAX(s[0], a) : MIN(s[0], b) - MAX(s[1], a));
+      if (o.which_subclass == GEOM CYLINDER &&
+          o.subclass.cylinder_data->which_subclass == CYL WEDGE) {
+        double s01[2], slist[4];
+        int i, ns;
+        s01[0] = MIN(s[0], s[1]);
+        s01[1] = MAX(s[0], s[1]);
+        ns = wedge_line_crossings(&o, p, d, s01, slist);
+        for (i = 0, ds = 0; i < ns; i += 2)
+          ds += MAX(MIN(slist[i + 1], b) - MAX(slist[i], a), 0.0);
+      }
       return (ds > 0 ? ds : 0.0);
     }
     else
@@ -993,7 +1906,7 @@ double geom_object_volume(GEOMETRIC_OBJECT o) {
     case GEOM BLOCK: {
       vector3 size = o.subclass.block_data->size;
       double vol = size.x * size.y * size.z *
-                   fabs(matrix3x3_determinant(geometry_lattice.basis) /
+                   fabs(matrix3x3_determinant(CTX(geometry_lattice).basis) /
                         matrix3x3_determinant(o.subclass.block_data->projection_matrix));
       return o.subclass.block_data->which_subclass == BLK BLOCK_SELF ? vol : vol * (K_PI / 6);
     }
@@ -1103,14 +2016,12 @@ void geom_get_bounding_box(geometric_object o, geom_box *box) {
          The math comes out surpisingly simple--try it! */
 
       number radius = o.subclass.sphere_data->radius;
+      const lattice *L = &CTX(geometry_lattice);
       /* actually, we could achieve the same effect here
          by inverting the geometry_lattice.basis matrix... */
-      number r1 =
-          compute_dot_cross(geometry_lattice.b1, geometry_lattice.b2, geometry_lattice.b3) * radius;
-      number r2 =
-          compute_dot_cross(geometry_lattice.b2, geometry_lattice.b3, geometry_lattice.b1) * radius;
-      number r3 =
-          compute_dot_cross(geometry_lattice.b3, geometry_lattice.b1, geometry_lattice.b2) * radius;
+      number r1 = compute_dot_cross(L->b1, L->b2, L->b3) * radius;
+      number r2 = compute_dot_cross(L->b2, L->b3, L->b1) * radius;
+      number r3 = compute_dot_cross(L->b3, L->b1, L->b2) * radius;
       box->low.x -= r1;
       box->low.y -= r2;
       box->low.z -= r3;
@@ -1129,10 +2040,10 @@ void geom_get_bounding_box(geometric_object o, geom_box *box) {
       number radius = o.subclass.cylinder_data->radius;
       number h = o.subclass.cylinder_data->height * 0.5;
       vector3 axis = /* cylinder axis in cartesian coords */
-          matrix3x3_vector3_mult(geometry_lattice.basis, o.subclass.cylinder_data->axis);
-      vector3 e12 = vector3_cross(geometry_lattice.basis1, geometry_lattice.basis2);
-      vector3 e23 = vector3_cross(geometry_lattice.basis2, geometry_lattice.basis3);
-      vector3 e31 = vector3_cross(geometry_lattice.basis3, geometry_lattice.basis1);
+          matrix3x3_vector3_mult(CTX(geometry_lattice).basis, o.subclass.cylinder_data->axis);
+      vector3 e12 = vector3_cross(CTX(geometry_lattice).basis1, CTX(geometry_lattice).basis2);
+      vector3 e23 = vector3_cross(CTX(geometry_lattice).basis2, CTX(geometry_lattice).basis3);
+      vector3 e31 = vector3_cross(CTX(geometry_lattice).basis3, CTX(geometry_lattice).basis1);
       number elen2, eproj;
       number r1, r2, r3;
       geom_box tmp_box;
@@ -1142,15 +2053,15 @@ void geom_get_bounding_box(geometric_object o, geom_box *box) {
 
       elen2 = vector3_dot(e23, e23);
       eproj = vector3_dot(e23, axis);
-      r1 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e23, geometry_lattice.b1));
+      r1 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e23, CTX(geometry_lattice).b1));
 
       elen2 = vector3_dot(e31, e31);
       eproj = vector3_dot(e31, axis);
-      r2 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e31, geometry_lattice.b2));
+      r2 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e31, CTX(geometry_lattice).b2));
 
       elen2 = vector3_dot(e12, e12);
       eproj = vector3_dot(e12, axis);
-      r3 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e12, geometry_lattice.b3));
+      r3 = fabs(sqrt(fabs(elen2 - eproj * eproj)) / vector3_dot(e12, CTX(geometry_lattice).b3));
 
       /* Get axis in lattice coords: */
       axis = o.subclass.cylinder_data->axis;
@@ -1290,58 +2201,544 @@ static double overlap_integrand(integer ndim, number *x, void *data_) {
   return intersect_line_segment_with_object(p, data->dir, data->o, a0, b0) * scale_result;
 }
 
-number overlap_with_object(geom_box b, int is_ellipsoid, geometric_object o, number tol,
-                           integer maxeval) {
-  overlap_data data;
-  int empty_x = b.low.x == b.high.x;
-  int empty_y = b.low.y == b.high.y;
-  int empty_z = b.low.z == b.high.z;
-  double V0 = ((empty_x ? 1 : b.high.x - b.low.x) * (empty_y ? 1 : b.high.y - b.low.y) *
-               (empty_z ? 1 : b.high.z - b.low.z));
-  vector3 ex = {1, 0, 0}, ey = {0, 1, 0}, ez = {0, 0, 1};
-  geom_box bb;
-  double xmin[2] = {0, 0}, xmax[2] = {0, 0}, esterr;
-  int errflag;
-  unsigned i;
+/* Closed-form (or 1d-quadrature) overlaps for the simplest cases: blocks
+   whose axes are the coordinate axes (with a box or an ellipsoid), and
+   spheres and coordinate-aligned cylinders in a Cartesian lattice (with
+   a box only).  These reduce to the measure of the intersection of a
+   ball with a box, in the 1-3 non-empty dimensions.  As in
+   overlap_integrand, the coordinates along the empty dimensions are 0. */
 
-  geom_get_bounding_box(o, &bb);
-  if (!is_ellipsoid && !empty_x && !empty_y && !empty_z && /* todo: optimize 1d and 2d cases */
-      bb.low.x >= b.low.x && bb.high.x <= b.high.x && bb.low.y >= b.low.y &&
-      bb.high.y <= b.high.y && bb.low.z >= b.low.z && bb.high.z <= b.high.z)
-    return geom_object_volume(o) /
-           (V0 * fabs(matrix3x3_determinant(
-                     geometry_lattice.basis))); /* o is completely contained within b */
-  geom_box_intersection(&bb, &b, &bb);
-  if (bb.low.x > bb.high.x || bb.low.y > bb.high.y || bb.low.z > bb.high.z ||
-      (!empty_x && bb.low.x == bb.high.x) || (!empty_y && bb.low.y == bb.high.y) ||
-      (!empty_z && bb.low.z == bb.high.z))
-    return 0.0;
+/* area of the intersection of the disk X^2+Y^2 <= r^2 with the quadrant
+   X <= x, Y <= y, computed by integrating over X */
+static double disk_quadrant_area(double r, double x, double y) {
+#define DISK_H(t) (0.5 * ((t) * sqrt(r * r - (t) * (t)) + r * r * asin((t) / r)) + 0.25 * K_PI * r * r)
+  double xc = x < -r ? -r : (x > r ? r : x), w, xw, cap;
+  if (y <= -r || xc <= -r) return 0.0;
+  if (y >= r) return 2 * DISK_H(xc);
+  w = sqrt(r * r - y * y); /* the line Y = y cuts the circle at X = -w, w */
+  if (xc <= -w) return y >= 0 ? 2 * DISK_H(xc) : 0.0;
+  xw = xc < w ? xc : w;
+  cap = DISK_H(xw) - DISK_H(-w) - y * (xw + w); /* part of the disk above Y = y */
+  return y >= 0 ? 2 * DISK_H(xc) - cap : 2 * (DISK_H(xw) - DISK_H(-w)) - cap;
+#undef DISK_H
+}
 
-  data.winv[0] = data.winv[1] = data.w0 = 1.0;
-  data.c[0] = data.c[1] = data.c0 = 0;
+static double disk_box_area(double r, const double *lo, const double *hi) {
+  return disk_quadrant_area(r, hi[0], hi[1]) - disk_quadrant_area(r, lo[0], hi[1]) -
+         disk_quadrant_area(r, hi[0], lo[1]) + disk_quadrant_area(r, lo[0], lo[1]);
+}
 
-  data.o = o;
-  data.p.x = data.p.y = data.p.z = 0;
-  data.dim = 0;
-  if (!empty_x) {
-    data.dir = ex;
-    data.a0 = bb.low.x;
-    data.b0 = bb.high.x;
-    data.w0 = 0.5 * (b.high.x - b.low.x);
-    data.c0 = 0.5 * (b.high.x + b.low.x);
-    if (!empty_y) {
-      xmin[data.dim] = bb.low.y;
-      xmax[data.dim] = bb.high.y;
-      data.winv[data.dim] = 2.0 / (b.high.y - b.low.y);
-      data.c[data.dim] = 0.5 * (b.high.y + b.low.y);
-      data.pdim[data.dim++] = 1;
-    }
-    if (!empty_z) {
-      xmin[data.dim] = bb.low.z;
-      xmax[data.dim] = bb.high.z;
-      data.winv[data.dim] = 2.0 / (b.high.z - b.low.z);
-      data.c[data.dim] = 0.5 * (b.high.z + b.low.z);
-      data.pdim[data.dim++] = 2;
+typedef struct {
+  double r, lo[2], hi[2];
+} ball_box_data;
+
+/* area of the slice z = r sin(theta) of the ball times dz/dtheta */
+static double ball_box_integrand(integer ndim, number *theta, void *data_) {
+  const ball_box_data *data = (const ball_box_data *)data_;
+  double rho = data->r * cos(theta[0]);
+  (void)ndim;
+  return rho > 0 ? disk_box_area(rho, data->lo, data->hi) * rho : 0.0;
+}
+
+static int dcmp_overlap(const void *pd1, const void *pd2) {
+  double d1 = *((const double *)pd1), d2 = *((const double *)pd2);
+  return ((d1 < d2) ? -1 : ((d1 > d2) ? 1 : 0));
+}
+
+/* measure of the intersection of the k-dimensional ball of radius r
+   (centered at the origin) with the box lo <= x <= hi */
+static double ball_box_overlap(int k, double r, const double *lo, const double *hi, number tol,
+                               integer maxeval) {
+  ball_box_data data;
+  double za, zb, theta[18], vol = 0;
+  int i, j, nb = 0;
+
+  if (!(r > 0)) return k == 0 && r == 0 ? 1.0 : 0.0;
+  switch (k) {
+    case 0: return 1.0;
+    case 1: return fmax(0, fmin(hi[0], r) - fmax(lo[0], -r));
+    case 2: return fmax(0, disk_box_area(r, lo, hi));
+  }
+
+  /* k == 3: integrate the areas of the slices along z, substituting
+     z = r sin(theta) to remove the square-root singularities at the
+     poles, and splitting the range wherever the slice circle touches an
+     edge or corner of the box, where the area is not smooth */
+  data.r = r;
+  for (i = 0; i < 2; ++i) {
+    data.lo[i] = lo[i];
+    data.hi[i] = hi[i];
+  }
+  za = fmax(lo[2], -r);
+  zb = fmin(hi[2], r);
+  if (za >= zb) return 0.0;
+  theta[nb++] = asin(za / r);
+  theta[nb++] = asin(zb / r);
+  for (i = 0; i < 8; ++i) {
+    double v = i < 4 ? fabs(i & 2 ? (i & 1 ? hi[1] : lo[1]) : (i & 1 ? hi[0] : lo[0]))
+                     : hypot(i & 1 ? hi[0] : lo[0], i & 2 ? hi[1] : lo[1]);
+    if (v < r) {
+      double t = acos(v / r);
+      for (j = 0; j < 2; ++j, t = -t)
+        if (t > theta[0] && t < theta[1]) theta[nb++] = t;
+    }
+  }
+  qsort(theta, nb, sizeof(double), dcmp_overlap);
+  for (i = 0; i + 1 < nb; ++i)
+    if (theta[i + 1] > theta[i]) {
+      double esterr;
+      integer errflag;
+      vol += adaptive_integration(ball_box_integrand, theta + i, theta + i + 1, 1, &data,
+                                  1e-3 * tol * (fmin(hi[0], r) - fmax(lo[0], -r)) *
+                                      (fmin(hi[1], r) - fmax(lo[1], -r)) * (zb - za),
+                                  tol, maxeval, &esterr, &errflag);
+    }
+  return vol;
+}
+
+/* If o and the box (or ellipsoid) b are one of the cases above, set
+   *overlap to the fraction of b that overlaps o and return 1; otherwise
+   return 0.  Assumes that b has at least one non-empty dimension. */
+static int analytic_overlap_with_object(geom_box b, int is_ellipsoid, const geometric_object *o,
+                                        number tol, integer maxeval, double *overlap) {
+  const double blo[3] = {b.low.x, b.low.y, b.low.z}, bhi[3] = {b.high.x, b.high.y, b.high.z};
+  const double c[3] = {o->center.x, o->center.y, o->center.z};
+  const matrix3x3 metric = CTX(geometry_lattice).metric;
+  int cartesian = metric.c0.x == 1 && metric.c0.y == 0 && metric.c0.z == 0 &&
+                  metric.c1.x == 0 && metric.c1.y == 1 && metric.c1.z == 0 &&
+                  metric.c2.x == 0 && metric.c2.y == 0 && metric.c2.z == 1;
+  double lo[3], hi[3], half[3], V0 = 1, r2, f = 1;
+  int i, k = 0, axis = -1;
+
+  switch (o->which_subclass) {
+    case GEOM BLOCK: {
+      const block *blk = o->subclass.block_data;
+      const vector3 e[3] = {blk->e1, blk->e2, blk->e3};
+      const double size[3] = {blk->size.x, blk->size.y, blk->size.z};
+      if (blk->which_subclass != BLK BLOCK_SELF) return 0;
+      half[0] = half[1] = half[2] = -1;
+      for (i = 0; i < 3; ++i) { /* find the coordinate axis of e[i], if any */
+        int a = e[i].y == 0 && e[i].z == 0 ? 0 : (e[i].x == 0 && e[i].z == 0 ? 1 : 2);
+        if ((a == 2 && (e[i].x != 0 || e[i].y != 0)) || half[a] >= 0) return 0;
+        half[a] = 0.5 * size[i] * fabs(a == 0 ? e[i].x : (a == 1 ? e[i].y : e[i].z));
+      }
+      for (i = 0; i < 3; ++i) {
+        if (blo[i] == bhi[i]) {
+          if (fabs(c[i]) > half[i]) f = 0;
+        }
+        else if (!is_ellipsoid)
+          f *= fmax(0, fmin(bhi[i], c[i] + half[i]) - fmax(blo[i], c[i] - half[i])) /
+               (bhi[i] - blo[i]);
+        else { /* scale the ellipsoid inscribed in b to the unit ball */
+          double m = 0.5 * (bhi[i] + blo[i]), w = 0.5 * (bhi[i] - blo[i]);
+          lo[k] = (c[i] - half[i] - m) / w;
+          hi[k++] = (c[i] + half[i] - m) / w;
+        }
+      }
+      if (is_ellipsoid && f != 0)
+        f = ball_box_overlap(k, 1.0, lo, hi, tol, maxeval) /
+            (k == 1 ? 2.0 : (k == 2 ? K_PI : 4 * K_PI / 3));
+      *overlap = f;
+      return 1;
+    }
+    case GEOM CYLINDER: {
+      const cylinder *cyl = o->subclass.cylinder_data;
+      vector3 a = cyl->axis;
+      if (is_ellipsoid || !cartesian || cyl->which_subclass != CYL CYLINDER_SELF) return 0;
+      if (a.y == 0 && a.z == 0)
+        axis = 0;
+      else if (a.x == 0 && a.z == 0)
+        axis = 1;
+      else if (a.x == 0 && a.y == 0)
+        axis = 2;
+      else
+        return 0;
+      if (blo[axis] == bhi[axis])
+        f = fabs(c[axis]) <= 0.5 * cyl->height;
+      else
+        f = fmax(0, fmin(bhi[axis], c[axis] + 0.5 * cyl->height) -
+                        fmax(blo[axis], c[axis] - 0.5 * cyl->height)) /
+            (bhi[axis] - blo[axis]);
+      r2 = cyl->radius * cyl->radius;
+      if (!(cyl->radius != 0)) f = 0;
+      break;
+    }
+    case GEOM SPHERE:
+      if (is_ellipsoid || !cartesian) return 0;
+      r2 = o->subclass.sphere_data->radius * o->subclass.sphere_data->radius;
+      if (!(o->subclass.sphere_data->radius > 0)) f = 0;
+      break;
+    default: return 0;
+  }
+
+  /* the ball of radius^2 r2 in the dimensions other than axis */
+  for (i = 0; i < 3; ++i)
+    if (i != axis) {
+      if (blo[i] == bhi[i])
+        r2 -= c[i] * c[i];
+      else {
+        lo[k] = blo[i] - c[i];
+        hi[k++] = bhi[i] - c[i];
+        V0 *= bhi[i] - blo[i];
+      }
+    }
+  *overlap = f == 0 || r2 < 0 ? 0.0 : f * ball_box_overlap(k, sqrt(r2), lo, hi, tol, maxeval) / V0;
+  return 1;
+}
+
+/* Planar approximation of the overlap, for boxes straddling a surface
+   that is nearly flat on the scale of the box (as for most of the pixels
+   along an interface).  The signed distance to o is sampled at the
+   center, face and edge midpoints, and corners of b, and is fit by the
+   plane through the center value with the central-difference gradient.
+   The overlap of b with the half-space behind this plane is exact, and is
+   used if moving the plane by twice the largest misfit of the samples
+   changes it by at most a relative tol; otherwise (curved surfaces,
+   edges and corners of o, features smaller than b) we return 0 and the
+   caller falls back to the cubature.  This is only tried for the shapes
+   with flat faces, blocks and meshes, and may be disabled by setting
+   geom_planar_overlaps = 0 (in the globals or the current context). */
+
+int geom_planar_overlaps = 1;
+
+/* fraction of the unit cube 0 <= u_i <= 1 (i < n <= 3) where
+   sum_i a_i u_i <= t, by inclusion-exclusion over the corners */
+static double cube_halfspace_fraction(int n, const double *a0, double t) {
+  double a[3], amax = 0, sum = 0, denom = 1, f = 0;
+  int i, m = 0, corner;
+
+  for (i = 0; i < n; ++i)
+    amax = fmax(amax, fabs(a0[i]));
+  for (i = 0; i < n; ++i) {
+    double ai = fabs(a0[i]);
+    if (a0[i] < 0) t += ai; /* flip u_i -> 1 - u_i */
+    if (ai <= 1e-4 * amax)
+      t -= 0.5 * ai; /* average over u_i instead, to avoid cancellation */
+    else {
+      a[m++] = ai;
+      sum += ai;
+      denom *= ai * m;
+    }
+  }
+  if (t < 0) return 0.0;
+  if (t >= sum) return 1.0; /* including a degenerate plane with d = 0 throughout b */
+  if (t > 0.5 * sum) return 1.0 - cube_halfspace_fraction(m, a, sum - t);
+  for (corner = 0; corner < (1 << m); ++corner) {
+    double s = t;
+    int sign = 1;
+    for (i = 0; i < m; ++i)
+      if (corner & (1 << i)) {
+        s -= a[i];
+        sign = -sign;
+      }
+    if (s > 0) f += sign * (m == 1 ? s : (m == 2 ? s * s : s * s * s));
+  }
+  return f / denom;
+}
+
+/* fraction of the unit n-ball (n = 1, 2, 3) where v_1 <= s */
+static double ball_halfspace_fraction(int n, double s) {
+  s = fmax(-1, fmin(1, s));
+  switch (n) {
+    case 1: return 0.5 * (1 + s);
+    case 2: return 0.5 + (asin(s) + s * sqrt(1 - s * s)) / K_PI;
+    default: return 0.25 * (1 + s) * (1 + s) * (2 - s);
+  }
+}
+
+/* the fraction of the box (or ellipsoid) b where d <= delta, for the
+   plane d = d0 + sum_i a_i (u_i - 1/2) in the coordinates 0 <= u_i <= 1
+   along the m non-empty dimensions of b */
+static double planar_fraction(int is_ellipsoid, int m, const double *a, double d0, double delta) {
+  int i;
+  if (is_ellipsoid) { /* the plane is at distance -d0/|a/2| from the center of the unit ball */
+    double g = 0;
+    for (i = 0; i < m; ++i)
+      g += 0.25 * a[i] * a[i];
+    return ball_halfspace_fraction(m, (delta - d0) / sqrt(g));
+  }
+  else {
+    double t = delta - d0;
+    for (i = 0; i < m; ++i)
+      t += 0.5 * a[i];
+    return cube_halfspace_fraction(m, a, t);
+  }
+}
+
+/* set *f to the fraction for the plane, and return whether moving the
+   plane by twice the misfit changes it by at most a relative tol */
+static int planar_fraction_within_tol(int is_ellipsoid, int m, const double *a, double d0,
+                                      double misfit, number tol, double *f) {
+  double g = 0;
+  int i;
+  for (i = 0; i < m; ++i)
+    g += a[i] * a[i];
+  if (is_ellipsoid && !(g > 0)) return 0;
+  *f = planar_fraction(is_ellipsoid, m, a, d0, 0);
+  return planar_fraction(is_ellipsoid, m, a, d0, 2 * misfit) -
+             planar_fraction(is_ellipsoid, m, a, d0, -2 * misfit) <=
+         2 * tol * *f;
+}
+
+static int planar_overlap_with_object(geom_box b, int is_ellipsoid, const geometric_object *o,
+                                      number tol, double *overlap) {
+  const double blo[3] = {b.low.x, b.low.y, b.low.z}, bhi[3] = {b.high.x, b.high.y, b.high.z};
+  double c[3], w[3], x[27], y[27], z[27], d[27], a[3], misfit = 0, f;
+  int off[27][3], dims[3], i, k, n = 1, n0, m = 0;
+
+  /* only blocks and meshes: the other shapes are mostly curved, or (for
+     prisms) have distances that cost more than the cubature itself */
+  if (!(o->which_subclass == GEOM MESH ||
+        (o->which_subclass == GEOM BLOCK &&
+         o->subclass.block_data->which_subclass == BLK BLOCK_SELF)))
+    return 0;
+  for (i = 0; i < 3; ++i) { /* as in overlap_integrand, empty dimensions are at 0 */
+    c[i] = blo[i] == bhi[i] ? 0 : 0.5 * (blo[i] + bhi[i]);
+    w[i] = 0.5 * (bhi[i] - blo[i]);
+    if (w[i] > 0) dims[m++] = i;
+  }
+
+  /* the samples are the center, the pairs of face midpoints, and then
+     the edge midpoints and corners */
+  memset(off, 0, sizeof(off));
+  for (i = 0; i < m; ++i, n += 2) {
+    off[n][dims[i]] = -1;
+    off[n + 1][dims[i]] = 1;
+  }
+  n0 = n;
+  for (k = 0; k < 27; ++k) {
+    const int s[3] = {k % 3 - 1, k / 3 % 3 - 1, k / 9 - 1};
+    if (abs(s[0]) + abs(s[1]) + abs(s[2]) > 1 && (s[0] == 0 || w[0] > 0) &&
+        (s[1] == 0 || w[1] > 0) && (s[2] == 0 || w[2] > 0)) {
+      for (i = 0; i < 3; ++i)
+        off[n][i] = s[i];
+      ++n;
+    }
+  }
+  for (k = 0; k < n; ++k) {
+    x[k] = c[0] + off[k][0] * w[0];
+    y[k] = c[1] + off[k][1] * w[1];
+    z[k] = c[2] + off[k][2] * w[2];
+  }
+
+  /* fit the plane to the center and face midpoints, whose misfits (the
+     second differences of d) already reject most curved surfaces */
+  signed_distance_to_fixed_object_batch(o, x, y, z, n0, d);
+  for (k = 0; k < n0; ++k)
+    if (!isfinite(d[k])) return 0;
+  for (i = 0; i < m; ++i) {
+    a[i] = d[2 * i + 2] - d[2 * i + 1];
+    misfit = fmax(misfit, fabs(0.5 * (d[2 * i + 1] + d[2 * i + 2]) - d[0]));
+  }
+  if (!planar_fraction_within_tol(is_ellipsoid, m, a, d[0], misfit, tol, &f)) return 0;
+
+  signed_distance_to_fixed_object_batch(o, x + n0, y + n0, z + n0, n - n0, d + n0);
+  for (k = n0; k < n; ++k) {
+    double dp = d[0];
+    if (!isfinite(d[k])) return 0;
+    for (i = 0; i < m; ++i)
+      dp += 0.5 * off[k][dims[i]] * a[i];
+    misfit = fmax(misfit, fabs(d[k] - dp));
+  }
+  if (!planar_fraction_within_tol(is_ellipsoid, m, a, d[0], misfit, tol, &f)) return 0;
+  *overlap = f;
+  return 1;
+}
+
+/**************************************************************************/
+
+/* classify_box_against_object: whether the box b lies entirely outside
+   the (fixed) object o, entirely inside it, or possibly straddles its
+   surface.  The answer is conservative: GEOM_BOX_MIXED is returned
+   whenever the cheap tests below are inconclusive, but GEOM_BOX_INSIDE
+   and GEOM_BOX_OUTSIDE are only returned if they are true (up to
+   roundoff), so that callers can skip integrating over such boxes.
+
+   The tests are, in order: the bounding box of o; the corners of b
+   (which must all lie in o for b to be inside, and suffice if o is
+   convex); the planes of the faces of blocks and of the boxes of
+   ellipsoids; and, when the signed distance to o is exact, whether the
+   sphere circumscribing b lies within or outside o.  A compound object
+   contains b if one of its components does.
+
+   overlap_with_object uses this to return 0 or 1 for uniform boxes
+   without integrating, unless geom_classify_overlaps = 0 (in the globals
+   or the current context). */
+
+int geom_classify_overlaps = 1;
+
+/* the Cartesian radius of the sphere circumscribing b */
+static double box_circumradius(const geom_box *b) {
+  vector3 h = vector3_scale(0.5, vector3_minus(b->high, b->low));
+  double r2 = 0;
+  int i;
+  for (i = 0; i < 4; ++i) {
+    vector3 v = h;
+    if (i & 1) v.x = -v.x;
+    if (i & 2) v.y = -v.y;
+    r2 = fmax(r2, vector3_dot(v, matrix3x3_vector3_mult(CTX(geometry_lattice).metric, v)));
+  }
+  return sqrt(r2);
+}
+
+/* whether the axes of a block or ellipsoid are orthogonal, in which case
+   signed_distance_to_object_query is exact for it */
+static int block_axes_orthogonal(const block *blk) {
+  vector3 e1 = lattice_to_cartesian(blk->e1), e2 = lattice_to_cartesian(blk->e2),
+          e3 = lattice_to_cartesian(blk->e3);
+  return fabs(vector3_dot(e1, e2)) <= 1e-12 && fabs(vector3_dot(e2, e3)) <= 1e-12 &&
+         fabs(vector3_dot(e1, e3)) <= 1e-12;
+}
+
+geom_box_class classify_box_against_object(geom_box b, geometric_object o) {
+  geom_object_query q;
+  geom_box bb;
+  vector3 corner[8];
+  int i, j, nin = 0, convex = 0, exact = 1;
+
+  geom_get_bounding_box(o, &bb);
+  if (!geom_boxes_intersect(&b, &bb)) return GEOM_BOX_OUTSIDE;
+
+  if (o.which_subclass == GEOM COMPOUND_GEOMETRIC_OBJECT) {
+    int n = o.subclass.compound_geometric_object_data->component_objects.num_items;
+    geometric_object *os = o.subclass.compound_geometric_object_data->component_objects.items;
+    geom_box_class c = GEOM_BOX_OUTSIDE;
+    for (i = 0; i < n; ++i) {
+      geometric_object oi = os[i];
+      oi.center = vector3_plus(oi.center, o.center);
+      switch (classify_box_against_object(b, oi)) {
+        case GEOM_BOX_INSIDE: return GEOM_BOX_INSIDE;
+        case GEOM_BOX_MIXED: c = GEOM_BOX_MIXED; break;
+        default: break;
+      }
+    }
+    return c;
+  }
+
+  compile_geom_object_query(&o, &q);
+  for (i = 0; i < 8; ++i) {
+    corner[i].x = i & 1 ? b.high.x : b.low.x;
+    corner[i].y = i & 2 ? b.high.y : b.low.y;
+    corner[i].z = i & 4 ? b.high.z : b.low.z;
+    nin += point_in_object_query(corner[i], &q);
+  }
+  if (nin > 0 && nin < 8) return GEOM_BOX_MIXED;
+
+  switch (q.kind) {
+    case GEOM_QUERY_EMPTY: return GEOM_BOX_OUTSIDE;
+    case GEOM_QUERY_SPHERE:
+    case GEOM_QUERY_CYLINDER: convex = 1; break;
+    case GEOM_QUERY_CONE: convex = q.radius * (q.radius + q.dradius) >= 0; break;
+    case GEOM_QUERY_WEDGE: convex = fabs(q.wedge_angle) <= K_PI; break;
+    case GEOM_QUERY_BLOCK:
+    case GEOM_QUERY_ELLIPSOID: {
+      /* b is outside if its corners all lie beyond the same face plane */
+      vector3 half = q.half_size;
+      if (q.kind == GEOM_QUERY_ELLIPSOID) {
+        half.x = 1 / half.x;
+        half.y = 1 / half.y;
+        half.z = 1 / half.z;
+      }
+      if (nin == 0) {
+        int beyond[6] = {1, 1, 1, 1, 1, 1};
+        for (i = 0; i < 8; ++i) {
+          vector3 proj = matrix3x3_vector3_mult(q.m, vector3_minus(corner[i], q.center));
+          beyond[0] &= proj.x > half.x;
+          beyond[1] &= proj.x < -half.x;
+          beyond[2] &= proj.y > half.y;
+          beyond[3] &= proj.y < -half.y;
+          beyond[4] &= proj.z > half.z;
+          beyond[5] &= proj.z < -half.z;
+        }
+        for (j = 0; j < 6; ++j)
+          if (beyond[j]) return GEOM_BOX_OUTSIDE;
+      }
+      convex = 1;
+      exact = block_axes_orthogonal(o.subclass.block_data);
+      break;
+    }
+    default: /* prisms and meshes, whose distances are only Cartesian in Cartesian lattices */
+      exact = q.cartesian;
+      break;
+  }
+  if (nin == 8 && convex) return GEOM_BOX_INSIDE;
+
+  if (exact) {
+    vector3 c = vector3_scale(0.5, vector3_plus(b.low, b.high));
+    double d = signed_distance_to_object_query(c, &q), r = box_circumradius(&b);
+    if (nin == 8 && d < -r) return GEOM_BOX_INSIDE;
+    if (nin == 0 && d > r) return GEOM_BOX_OUTSIDE;
+  }
+  return GEOM_BOX_MIXED;
+}
+
+number overlap_with_object(geom_box b, int is_ellipsoid, geometric_object o, number tol,
+                           integer maxeval) {
+  overlap_data data;
+  int empty_x = b.low.x == b.high.x;
+  int empty_y = b.low.y == b.high.y;
+  int empty_z = b.low.z == b.high.z;
+  double V0 = ((empty_x ? 1 : b.high.x - b.low.x) * (empty_y ? 1 : b.high.y - b.low.y) *
+               (empty_z ? 1 : b.high.z - b.low.z));
+  vector3 ex = {1, 0, 0}, ey = {0, 1, 0}, ez = {0, 0, 1};
+  geom_box bb;
+  double xmin[2] = {0, 0}, xmax[2] = {0, 0}, esterr, overlap;
+  int errflag;
+  unsigned i;
+
+  geom_get_bounding_box(o, &bb);
+  if (!is_ellipsoid && !empty_x && !empty_y && !empty_z && /* todo: optimize 1d and 2d cases */
+      bb.low.x >= b.low.x && bb.high.x <= b.high.x && bb.low.y >= b.low.y &&
+      bb.high.y <= b.high.y && bb.low.z >= b.low.z && bb.high.z <= b.high.z)
+    return geom_object_volume(o) /
+           (V0 * fabs(matrix3x3_determinant(
+                     CTX(geometry_lattice).basis))); /* o is completely contained within b */
+  geom_box_intersection(&bb, &b, &bb);
+  if (bb.low.x > bb.high.x || bb.low.y > bb.high.y || bb.low.z > bb.high.z ||
+      (!empty_x && bb.low.x == bb.high.x) || (!empty_y && bb.low.y == bb.high.y) ||
+      (!empty_z && bb.low.z == bb.high.z))
+    return 0.0;
+  if (CTX(geom_classify_overlaps)) { /* as in the integrand, empty dimensions are at 0 */
+    geom_box bc = b;
+    if (empty_x) bc.low.x = bc.high.x = 0;
+    if (empty_y) bc.low.y = bc.high.y = 0;
+    if (empty_z) bc.low.z = bc.high.z = 0;
+    switch (classify_box_against_object(bc, o)) {
+      case GEOM_BOX_INSIDE: return 1.0;
+      case GEOM_BOX_OUTSIDE: return 0.0;
+      default: break;
+    }
+  }
+  if (!(empty_x && empty_y && empty_z) &&
+      (analytic_overlap_with_object(b, is_ellipsoid, &o, tol, maxeval, &overlap) ||
+       (CTX(geom_planar_overlaps) && planar_overlap_with_object(b, is_ellipsoid, &o, tol, &overlap))))
+    return overlap;
+
+  data.winv[0] = data.winv[1] = data.w0 = 1.0;
+  data.c[0] = data.c[1] = data.c0 = 0;
+
+  data.o = o;
+  data.p.x = data.p.y = data.p.z = 0;
+  data.dim = 0;
+  if (!empty_x) {
+    data.dir = ex;
+    data.a0 = bb.low.x;
+    data.b0 = bb.high.x;
+    data.w0 = 0.5 * (b.high.x - b.low.x);
+    data.c0 = 0.5 * (b.high.x + b.low.x);
+    if (!empty_y) {
+      xmin[data.dim] = bb.low.y;
+      xmax[data.dim] = bb.high.y;
+      data.winv[data.dim] = 2.0 / (b.high.y - b.low.y);
+      data.c[data.dim] = 0.5 * (b.high.y + b.low.y);
+      data.pdim[data.dim++] = 1;
+    }
+    if (!empty_z) {
+      xmin[data.dim] = bb.low.z;
+      xmax[data.dim] = bb.high.z;
+      data.winv[data.dim] = 2.0 / (b.high.z - b.low.z);
+      data.c[data.dim] = 0.5 * (b.high.z + b.low.z);
+      data.pdim[data.dim++] = 2;
     }
   }
   else if (!empty_y) {
@@ -1440,12 +2837,362 @@ number CTLIO range_overlap_with_object(vector3 low, vector3 high, geometric_obje
 
 /**************************************************************************/
 
+/* A line_quadrature integrates a vector of n_v functions of lines along
+   the direction dir, over the 0-2 transverse coordinates t of the lines,
+   by an iterated adaptive 15-point Gauss-Kronrod rule.  Each line is
+   computed only once for the whole vector, so this is the basis of the
+   overlap functions below that compute many fractions at once. */
+
+typedef struct line_quadrature_struct line_quadrature;
+struct line_quadrature_struct {
+  int nv;              /* length of the vector */
+  int ntrans, trans[2]; /* number and axes (0, 1, 2) of the transverse coordinates */
+  double lo[2], hi[2];  /* range of each transverse coordinate */
+  double abstol[2];     /* tolerance of the integral over each transverse coordinate */
+  integer neval, maxeval;
+  /* add the vector for the line at the transverse coordinates t to v */
+  void (*line)(line_quadrature *q, const double *t, double *v);
+  /* the largest error in the results, given the difference d of two estimates */
+  double (*error)(const line_quadrature *q, const double *d);
+  void *data;
+};
+
+/* 15-point Gauss-Kronrod nodes in [0,1] and weights, and the weights of
+   the embedded 7-point Gauss rule, which uses the odd-numbered nodes */
+static const double gk15_x[8] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.0};
+static const double gk15_wk[8] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714};
+static const double g7_w[4] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327};
+
+/* add to result the integral over lo <= t[level] <= hi (and over the
+   whole range of the later coordinates) to within abstol */
+static void line_quadrature_integrate(line_quadrature *q, int level, double lo, double hi,
+                                      double abstol, double *t, double *result) {
+  const int nv = q->nv;
+  double *f = (double *)malloc(sizeof(double) * 3 * nv), *K = f + nv, *G = K + nv;
+  double c = 0.5 * (lo + hi), hw = 0.5 * (hi - lo);
+  int i, j;
+
+  CHECK(f, "out of memory");
+  memset(K, 0, sizeof(double) * 2 * nv);
+  for (j = 0; j < 15; ++j) {
+    int k = j < 8 ? j : 14 - j;
+    t[level] = c + (j < 8 ? -hw : hw) * gk15_x[k];
+    memset(f, 0, sizeof(double) * nv);
+    if (level + 1 < q->ntrans)
+      line_quadrature_integrate(q, level + 1, q->lo[level + 1], q->hi[level + 1],
+                                q->abstol[level + 1], t, f);
+    else {
+      q->line(q, t, f);
+      ++q->neval;
+    }
+    for (i = 0; i < nv; ++i)
+      K[i] += gk15_wk[k] * f[i];
+    if (k % 2)
+      for (i = 0; i < nv; ++i)
+        G[i] += g7_w[k / 2] * f[i];
+  }
+
+  for (i = 0; i < nv; ++i) /* error estimate from the difference of the two rules */
+    G[i] -= K[i];
+  if (hw * q->error(q, G) <= abstol || q->neval >= q->maxeval ||
+      hw <= 1e-12 * (q->hi[level] - q->lo[level]))
+    for (i = 0; i < nv; ++i)
+      result[i] += hw * K[i];
+  else {
+    line_quadrature_integrate(q, level, lo, c, 0.5 * abstol, t, result);
+    line_quadrature_integrate(q, level, c, hi, 0.5 * abstol, t, result);
+  }
+  free(f);
+}
+
+/* set result to the integral over all the transverse coordinates */
+static void line_quadrature_run(line_quadrature *q, double *result) {
+  double t[2] = {0, 0};
+  memset(result, 0, sizeof(double) * q->nv);
+  q->neval = 0;
+  if (q->ntrans == 0) {
+    q->line(q, t, result);
+    q->neval = 1;
+  }
+  else
+    line_quadrature_integrate(q, 0, q->lo[0], q->hi[0], q->abstol[0], t, result);
+}
+
+/* the point p0 with its transverse coordinates replaced by t */
+static vector3 line_quadrature_point(const line_quadrature *q, const double *t, vector3 p0) {
+  int k;
+  for (k = 0; k < q->ntrans; ++k)
+    if (q->trans[k] == 0)
+      p0.x = t[k];
+    else if (q->trans[k] == 1)
+      p0.y = t[k];
+    else
+      p0.z = t[k];
+  return p0;
+}
+
+/* the largest absolute value of the elements of d */
+static double line_quadrature_max_error(const line_quadrature *q, const double *d) {
+  double err = 0;
+  int i;
+  for (i = 0; i < q->nv; ++i)
+    err = fmax(err, fabs(d[i]));
+  return err;
+}
+
+/* The sorted crossings of the line p + s*dir with the surface of o (which
+   must not be a compound object), with the line outside o at s = -infinity,
+   are stored in *slist, which has room for *slist_len >= 2 values and is
+   enlarged as needed (by malloc if *slist is the buffer slist0, which is
+   not freed, and by realloc otherwise); returns the number of crossings. */
+static int line_crossings_with_object(const geometric_object *o, vector3 p, vector3 dir,
+                                      double **slist, int *slist_len, const double *slist0) {
+  int ns;
+  if (*slist_len < 4) { /* room for the two segments of a wedge */
+    *slist_len = 4;
+    *slist = *slist == slist0 ? (double *)malloc(sizeof(double) * 4)
+                              : (double *)realloc(*slist, sizeof(double) * 4);
+    CHECK(*slist, "out of memory");
+  }
+  switch (o->which_subclass) {
+    case GEOM PRISM:
+    case GEOM MESH:
+      while (1) {
+        ns = o->which_subclass == GEOM PRISM
+                 ? intersect_line_with_prism(o->subclass.prism_data, p, dir, *slist, *slist_len)
+                 : intersect_line_with_mesh(o->subclass.mesh_data, p, dir, *slist, *slist_len);
+        if (ns <= *slist_len) return ns;
+        *slist_len = ns;
+        *slist = *slist == slist0 ? (double *)malloc(sizeof(double) * ns)
+                                  : (double *)realloc(*slist, sizeof(double) * ns);
+        CHECK(*slist, "out of memory");
+      }
+    case GEOM COMPOUND_GEOMETRIC_OBJECT: return 0;
+    default: {
+      double s[2], s01[2];
+      if (2 != intersect_line_with_object(p, dir, *o, s)) return 0;
+      s01[0] = fmin(s[0], s[1]);
+      s01[1] = fmax(s[0], s[1]);
+      if (o->which_subclass == GEOM CYLINDER &&
+          o->subclass.cylinder_data->which_subclass == CYL WEDGE)
+        return wedge_line_crossings(o, p, dir, s01, *slist);
+      (*slist)[0] = s01[0];
+      (*slist)[1] = s01[1];
+      return 2;
+    }
+  }
+}
+
+/**************************************************************************/
+
+/* box_row_overlaps_with_object: the overlap fractions of a whole row of
+   n adjacent boxes, dividing b into n equal parts along the given axis
+   (0, 1, 2 for x, y, z), as from n calls to box_overlap_with_object.
+   Instead of integrating each box separately, we integrate over the
+   cross-section of the row, intersecting each line along the row with o
+   only once and distributing its interior segments among the boxes, so
+   that the cost grows with the number of intersections rather than with
+   the number of boxes.  Every fraction is computed to within tol, unless
+   more than maxeval lines (for the whole row) would be needed.  As in
+   overlap_with_object, o must not be a compound object. */
+
+typedef struct {
+  const geometric_object *o;
+  vector3 dir;
+  int n;
+  double a, h; /* the row is a <= s <= a + n*h along dir */
+  double *slist;
+  int slist_len;
+} row_overlap_data;
+
+/* Add the interior lengths of the line to v, where v[i] holds the
+   partial length in box i and v[n+i] the difference from box i-1 of the
+   number of boxes covered entirely, so that each line costs
+   O(crossings) rather than O(n). */
+static void row_overlap_line(line_quadrature *q, const double *t, double *v) {
+  row_overlap_data *data = (row_overlap_data *)q->data;
+  const int n = data->n;
+  const double b = data->a + n * data->h;
+  vector3 p = {0, 0, 0}; /* as in overlap_integrand, empty dimensions are at 0 */
+  int k, ns;
+
+  p = line_quadrature_point(q, t, p);
+  ns = line_crossings_with_object(data->o, p, data->dir, &data->slist, &data->slist_len, NULL);
+  for (k = 0; k < ns; k += 2) {
+    double s0 = fmax(data->slist[k], data->a);
+    double s1 = k + 1 < ns ? fmin(data->slist[k + 1], b) : b;
+    int i0, i1;
+    if (s1 <= s0) continue;
+    i0 = (int)((s0 - data->a) / data->h);
+    i1 = (int)((s1 - data->a) / data->h);
+    if (i0 > n - 1) i0 = n - 1;
+    if (i1 > n - 1) i1 = n - 1;
+    if (i0 == i1)
+      v[i0] += s1 - s0;
+    else {
+      v[i0] += data->a + (i0 + 1) * data->h - s0;
+      v[i1] += s1 - (data->a + i1 * data->h);
+      v[n + i0 + 1] += 1;
+      v[n + i1] -= 1;
+    }
+  }
+}
+
+static double row_overlap_error(const line_quadrature *q, const double *d) {
+  const row_overlap_data *data = (const row_overlap_data *)q->data;
+  double err = 0, covered = 0;
+  int i;
+  for (i = 0; i < data->n; ++i) {
+    covered += d[data->n + i];
+    err = fmax(err, fabs(d[i] + covered * data->h));
+  }
+  return err;
+}
+
+void box_row_overlaps_with_object(geom_box b, int axis, int n, geometric_object o, number tol,
+                                  integer maxeval, number *overlaps) {
+  const double blo[3] = {b.low.x, b.low.y, b.low.z}, bhi[3] = {b.high.x, b.high.y, b.high.z};
+  row_overlap_data data;
+  line_quadrature q;
+  geom_box bb;
+  double bblo[3], bbhi[3], W = 1, covered = 0, *v;
+  int i, k;
+
+  CHECK(axis >= 0 && axis < 3 && n > 0 && bhi[axis] > blo[axis],
+        "invalid row in box_row_overlaps_with_object");
+  for (i = 0; i < n; ++i)
+    overlaps[i] = 0;
+  geom_get_bounding_box(o, &bb);
+  bblo[0] = bb.low.x;
+  bblo[1] = bb.low.y;
+  bblo[2] = bb.low.z;
+  bbhi[0] = bb.high.x;
+  bbhi[1] = bb.high.y;
+  bbhi[2] = bb.high.z;
+
+  data.o = &o;
+  data.n = n;
+  data.dir.x = axis == 0;
+  data.dir.y = axis == 1;
+  data.dir.z = axis == 2;
+  data.a = blo[axis];
+  data.h = (bhi[axis] - blo[axis]) / n;
+  q.nv = 2 * n;
+  q.ntrans = 0;
+  for (k = 0; k < 3; ++k) {
+    if (bblo[k] > bhi[k] || bbhi[k] < blo[k]) return; /* no intersection */
+    if (k != axis && bhi[k] > blo[k]) {
+      /* integrate only over the part of the cross-section within bb */
+      q.trans[q.ntrans] = k;
+      q.lo[q.ntrans] = fmax(blo[k], bblo[k]);
+      q.hi[q.ntrans] = fmin(bhi[k], bbhi[k]);
+      if (q.lo[q.ntrans] == q.hi[q.ntrans]) return;
+      W *= bhi[k] - blo[k];
+      q.abstol[q.ntrans++] = tol * data.h * (bhi[k] - blo[k]);
+    }
+  }
+  q.maxeval = maxeval;
+  q.line = row_overlap_line;
+  q.error = row_overlap_error;
+  q.data = &data;
+  data.slist_len = 64;
+  data.slist = (double *)malloc(sizeof(double) * data.slist_len);
+  v = (double *)malloc(sizeof(double) * 2 * n);
+  CHECK(data.slist && v, "out of memory");
+
+  line_quadrature_run(&q, v);
+  for (i = 0; i < n; ++i) {
+    covered += v[n + i];
+    overlaps[i] = (v[i] + covered * data.h) / (data.h * W);
+  }
+  free(v);
+  free(data.slist);
+}
+
+/**************************************************************************/
+
 /* geom_box_tree: a tree of boxes and the objects contained within
    them.  The tree recursively partitions the unit cell, allowing us
    to perform binary searches for the object containing a given point. */
 
+/* A "compiled" geom_box_tree (see compile_geom_box_tree) stores the
+   same tree in a few flat arrays rather than in separately allocated
+   nodes: the nodes are in depth-first (pre-)order, so that the first
+   child of node i (if any) is node i+1, and the objects of all the
+   nodes are packed in the same order, so that the objects of node i
+   are objects[nodes[i].first .. nodes[i+1].first-1].  Each node also
+   stores the index "next" of the first node after its subtree, which
+   lets us search the tree with a simple forward loop over the array.
+
+   For compatibility with code that walks the tree (or that uses the
+   nodes returned by geom_tree_search), trees[i] is an ordinary
+   geom_box_tree node equivalent to nodes[i], whose t1/t2/objects
+   pointers point into the same arrays; the root of the compiled tree
+   is trees[0]. */
+typedef struct {
+  geom_box b;
+  int t1, t2; /* indices of the children, or -1 if none */
+  int next;   /* index of the first node after this subtree */
+  int first;  /* index of the first object of this node */
+} geom_box_tree_node;
+
+struct geom_box_tree_compiled_struct {
+  int nnodes, nobjects;
+  geom_box_tree_node *nodes; /* nnodes + 1 entries, the last of which is a sentinel */
+  struct geom_box_tree_struct *trees;
+  geom_box_object *objects;
+  geom_object_query *queries; /* query records for the objects[i].o */
+
+  /* for trees read by load_geom_box_tree, the file contents, into which
+     nodes and objects point (memory-mapped if mapped is true) */
+  char *data;
+  size_t ndata;
+  int mapped;
+};
+typedef struct geom_box_tree_compiled_struct *geom_box_tree_compiled;
+
+static void free_geom_box_tree_file(char *data, size_t ndata, int mapped) {
+#ifdef HAVE_MMAP
+  if (mapped)
+    munmap(data, ndata);
+  else
+#else
+  (void)ndata;
+  (void)mapped;
+#endif
+    FREE(data);
+}
+
+static void destroy_geom_box_tree_compiled(geom_box_tree_compiled c) {
+  if (c->data)
+    free_geom_box_tree_file(c->data, c->ndata, c->mapped);
+  else {
+    FREE(c->nodes);
+    if (c->objects) FREE(c->objects);
+  }
+  if (c->trees) FREE(c->trees);
+  if (c->queries) FREE(c->queries);
+  FREE1(c);
+}
+
 void destroy_geom_box_tree(geom_box_tree t) {
-  if (t) {
+  if (t && t->view_of) { /* the other nodes belong to the viewed tree */
+    FREE1(t);
+  }
+  else if (t && t->compiled) { /* t must be the root, trees[0] */
+    destroy_geom_box_tree_compiled(t->compiled);
+  }
+  else if (t) {
     destroy_geom_box_tree(t->t1);
     destroy_geom_box_tree(t->t2);
     if (t->objects) FREE(t->objects);
@@ -1470,6 +3217,8 @@ static geom_box_tree new_geom_box_tree(void) {
   t->t1 = t->t2 = NULL;
   t->nobjects = 0;
   t->objects = NULL;
+  t->compiled = NULL;
+  t->view_of = NULL;
   return t;
 }
 
@@ -1488,54 +3237,100 @@ static void divide_geom_box(const geom_box *b, int divide_axis, number divide_po
 #define VEC_I(v, i) ((i) == 0 ? (v).x : ((i) == 1 ? (v).y : (v).z))
 #define SMALL 1.0e-7
 
+/* Objects are counted, stored, and partitioned in parallel (if OpenMP
+   is enabled) only for nodes with at least this many objects, so that
+   small trees and subtrees don't pay the threading overhead.  The
+   resulting tree does not depend on the number of threads. */
+#define GEOM_BOX_TREE_PARALLEL_MIN 1024
+
 /* Find the best place (best_partition) to "cut" along the axis
    divide_axis in order to maximally divide the objects between
    the partitions.  Upon return, n1 and n2 are the number of objects
    below and above the partition, respectively. */
 static void find_best_partition(int nobjects, const geom_box_object *objects, int divide_axis,
                                 number *best_partition, int *n1, int *n2) {
-  number cur_partition;
-  int i, j, cur_n1, cur_n2;
+  /* the counts n1, n2 of each of the 2*nobjects candidate partitions */
+  int *cur_n = MALLOC(int, 4 * nobjects);
+  int i;
 
+  CHECK(cur_n || nobjects == 0, "out of memory");
   *n1 = *n2 = nobjects + 1;
   *best_partition = 0;
 
   /* Search for the best partition, by checking all possible partitions
      either just above the high end of an object or just below the
-     low end of an object. */
+     low end of an object.  (Each candidate is counted independently,
+     possibly in parallel, and the first best one is chosen below.) */
 
-  for (i = 0; i < nobjects; ++i) {
-    cur_partition = VEC_I(objects[i].box.high, divide_axis) * (1 + SMALL);
-    cur_n1 = cur_n2 = 0;
+#ifdef _OPENMP
+#pragma omp taskloop grainsize(64) if (nobjects >= GEOM_BOX_TREE_PARALLEL_MIN)
+#endif
+  for (i = 0; i < 2 * nobjects; ++i) {
+    number cur_partition = i < nobjects
+                               ? VEC_I(objects[i].box.high, divide_axis) * (1 + SMALL)
+                               : VEC_I(objects[i - nobjects].box.low, divide_axis) * (1 - SMALL);
+    int j, cur_n1 = 0, cur_n2 = 0;
     for (j = 0; j < nobjects; ++j) {
       double low = VEC_I(objects[j].box.low, divide_axis);
       double high = VEC_I(objects[j].box.high, divide_axis);
       cur_n1 += low <= cur_partition;
       cur_n2 += high >= cur_partition;
     }
-    CHECK(cur_n1 + cur_n2 >= nobjects, "assertion failure 1 in find_best_partition");
+    cur_n[2 * i] = cur_n1;
+    cur_n[2 * i + 1] = cur_n2;
+  }
+
+  for (i = 0; i < 2 * nobjects; ++i) {
+    int cur_n1 = cur_n[2 * i], cur_n2 = cur_n[2 * i + 1];
+    CHECK(cur_n1 + cur_n2 >= nobjects, "assertion failure in find_best_partition");
     if (MAX(cur_n1, cur_n2) < MAX(*n1, *n2)) {
-      *best_partition = cur_partition;
+      *best_partition = i < nobjects ? VEC_I(objects[i].box.high, divide_axis) * (1 + SMALL)
+                                     : VEC_I(objects[i - nobjects].box.low, divide_axis) *
+                                           (1 - SMALL);
       *n1 = cur_n1;
       *n2 = cur_n2;
     }
   }
-  for (i = 0; i < nobjects; ++i) {
-    cur_partition = VEC_I(objects[i].box.low, divide_axis) * (1 - SMALL);
-    cur_n1 = cur_n2 = 0;
-    for (j = 0; j < nobjects; ++j) {
-      double low = VEC_I(objects[j].box.low, divide_axis);
-      double high = VEC_I(objects[j].box.high, divide_axis);
-      cur_n1 += low <= cur_partition;
-      cur_n2 += high >= cur_partition;
+  FREE(cur_n);
+}
+
+/* Cut the leaf t in two along divide_axis at divide_point, moving its
+   objects into the new children t->t1 and t->t2, which must receive
+   exactly n1 and n2 objects, respectively. */
+static void split_geom_box_tree(geom_box_tree t, int divide_axis, number divide_point, int n1,
+                                int n2) {
+  int j;
+
+  divide_geom_box(&t->b, divide_axis, divide_point, &t->b1, &t->b2);
+  t->t1 = new_geom_box_tree();
+  t->t2 = new_geom_box_tree();
+  t->t1->b = t->b1;
+  t->t2->b = t->b2;
+
+  t->t1->nobjects = n1;
+  t->t1->objects = MALLOC(geom_box_object, t->t1->nobjects);
+  CHECK(t->t1->objects, "out of memory");
+
+  t->t2->nobjects = n2;
+  t->t2->objects = MALLOC(geom_box_object, t->t2->nobjects);
+  CHECK(t->t2->objects, "out of memory");
+
+  for (j = n1 = n2 = 0; j < t->nobjects; ++j) {
+    if (geom_boxes_intersect(&t->b1, &t->objects[j].box)) {
+      CHECK(n1 < t->t1->nobjects, "BUG in divide_geom_box_tree");
+      t->t1->objects[n1++] = t->objects[j];
     }
-    CHECK(cur_n1 + cur_n2 >= nobjects, "assertion failure 2 in find_best_partition");
-    if (MAX(cur_n1, cur_n2) < MAX(*n1, *n2)) {
-      *best_partition = cur_partition;
-      *n1 = cur_n1;
-      *n2 = cur_n2;
+    if (geom_boxes_intersect(&t->b2, &t->objects[j].box)) {
+      CHECK(n2 < t->t2->nobjects, "BUG in divide_geom_box_tree");
+      t->t2->objects[n2++] = t->objects[j];
     }
   }
+  CHECK(j == t->nobjects && n1 == t->t1->nobjects && n2 == t->t2->nobjects,
+        "BUG in divide_geom_box_tree: wrong nobjects");
+
+  t->nobjects = 0;
+  FREE(t->objects);
+  t->objects = NULL;
 }
 
 /* divide_geom_box_tree: recursively divide t in two, each time
@@ -1546,7 +3341,7 @@ static void divide_geom_box_tree(geom_box_tree t) {
   int division_nobjects[3][2] = {{0, 0}, {0, 0}, {0, 0}};
   number division_point[3];
   int best = -1;
-  int i, j, n1, n2;
+  int i;
 
   if (!t) return;
   if (t->t1 || t->t2) { /* this node has already been divided */
@@ -1560,7 +3355,7 @@ static void divide_geom_box_tree(geom_box_tree t) {
   /* Try partitioning along each dimension, counting the
      number of objects in the partitioned boxes and finding
      the best partition. */
-  for (i = 0; i < dimensions; ++i) {
+  for (i = 0; i < CTX(dimensions); ++i) {
     if (VEC_I(t->b.high, i) == VEC_I(t->b.low, i)) continue; /* skip empty dimensions */
     find_best_partition(t->nobjects, t->objects, i, &division_point[i], &division_nobjects[i][0],
                         &division_nobjects[i][1]);
@@ -1575,46 +3370,155 @@ static void divide_geom_box_tree(geom_box_tree t) {
       MIN(division_nobjects[best][0], division_nobjects[best][1]) + 1 >= t->nobjects)
     return; /* division didn't help us */
 
-  divide_geom_box(&t->b, best, division_point[best], &t->b1, &t->b2);
-  t->t1 = new_geom_box_tree();
-  t->t2 = new_geom_box_tree();
-  t->t1->b = t->b1;
-  t->t2->b = t->b2;
+  split_geom_box_tree(t, best, division_point[best], division_nobjects[best][0],
+                      division_nobjects[best][1]);
 
-  t->t1->nobjects = division_nobjects[best][0];
-  t->t1->objects = MALLOC(geom_box_object, t->t1->nobjects);
-  CHECK(t->t1->objects, "out of memory");
+  /* the two halves are independent, so divide them concurrently */
+#ifdef _OPENMP
+#pragma omp task if (t->t1->nobjects >= GEOM_BOX_TREE_PARALLEL_MIN)
+#endif
+  divide_geom_box_tree(t->t1);
+  divide_geom_box_tree(t->t2);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+}
 
-  t->t2->nobjects = division_nobjects[best][1];
-  t->t2->objects = MALLOC(geom_box_object, t->t2->nobjects);
-  CHECK(t->t2->objects, "out of memory");
+/* Alternative to divide_geom_box_tree, used when geom_box_tree_builder
+   is GEOM_BOX_TREE_SAH.  Rather than balancing the object counts, each
+   candidate cut is scored by the expected number of object tests for a
+   query point that lands in t: the traversal cost plus, for each half,
+   the probability of landing in that half times its object count.  This
+   is the surface-area heuristic (SAH) familiar from ray tracing, except
+   that for point queries the probability of landing in a child is its
+   fraction of the volume rather than of the surface area.  We stop
+   dividing once no cut is cheaper than leaving t as a leaf.
+
+   For large nodes, the candidate cuts are restricted to the boundaries
+   of GEOM_BOX_TREE_SAH_BINS uniform bins per axis, so each node is
+   partitioned in O(nobjects) time instead of the O(nobjects^2) of
+   find_best_partition.  Small nodes instead try cuts just outside each
+   object's bounding box, as in find_best_partition; otherwise, the
+   cheapest cut is often a thin sliver next to an object boundary that
+   lies inside a bin, and we would keep slicing ever-thinner slivers off
+   that bin without ever reaching the boundary. */
+
+#define GEOM_BOX_TREE_SAH_BINS 32
+#define GEOM_BOX_TREE_SAH_TRAVERSAL_COST 1.0 /* relative to an object test */
+#define GEOM_BOX_TREE_SAH_MAX_DEPTH 64
+
+/* SAH cost of cutting t along axis i at cut, given the number of objects
+   below (n1) and above (n2) the cut */
+static double sah_cost(geom_box_tree t, int i, double cut, int n1, int n2) {
+  double blow = VEC_I(t->b.low, i), bhigh = VEC_I(t->b.high, i);
+  return GEOM_BOX_TREE_SAH_TRAVERSAL_COST +
+         ((cut - blow) * n1 + (bhigh - cut) * n2) / (bhigh - blow);
+}
+
+static void divide_geom_box_tree_sah(geom_box_tree t, int depth) {
+  int nlow[GEOM_BOX_TREE_SAH_BINS], nhigh[GEOM_BOX_TREE_SAH_BINS];
+  double best_cost = 0, best_point = 0;
+  int best = -1;
+  int i, j, k, n1, n2;
 
-  for (j = n1 = n2 = 0; j < t->nobjects; ++j) {
-    if (geom_boxes_intersect(&t->b1, &t->objects[j].box)) {
-      CHECK(n1 < t->t1->nobjects, "BUG in divide_geom_box_tree");
-      t->t1->objects[n1++] = t->objects[j];
+  if (!t) return;
+  if (t->t1 || t->t2) { /* this node has already been divided */
+    divide_geom_box_tree_sah(t->t1, depth + 1);
+    divide_geom_box_tree_sah(t->t2, depth + 1);
+    return;
+  }
+
+  if (t->nobjects <= 2 || depth >= GEOM_BOX_TREE_SAH_MAX_DEPTH) return;
+
+  for (i = 0; i < CTX(dimensions); ++i) {
+    double blow = VEC_I(t->b.low, i), bhigh = VEC_I(t->b.high, i);
+    double lo = bhigh, hi = blow;
+
+    if (bhigh == blow) continue; /* skip empty dimensions */
+
+    /* the extent of the objects within t, which may be much smaller
+       than t itself (e.g. for an "infinite" unit cell) */
+    for (j = 0; j < t->nobjects; ++j) {
+      lo = MIN(lo, VEC_I(t->objects[j].box.low, i));
+      hi = MAX(hi, VEC_I(t->objects[j].box.high, i));
     }
-    if (geom_boxes_intersect(&t->b2, &t->objects[j].box)) {
-      CHECK(n2 < t->t2->nobjects, "BUG in divide_geom_box_tree");
-      t->t2->objects[n2++] = t->objects[j];
+    lo = MAX(lo, blow);
+    hi = MIN(hi, bhigh);
+    if (hi <= lo) continue;
+
+    if (t->nobjects <= 2 * GEOM_BOX_TREE_SAH_BINS) {
+      for (j = 0; j < 2 * t->nobjects; ++j) {
+        double cut = j < t->nobjects ? VEC_I(t->objects[j].box.high, i) + SMALL * (hi - lo)
+                                     : VEC_I(t->objects[j - t->nobjects].box.low, i) -
+                                           SMALL * (hi - lo);
+        if (cut <= blow || cut >= bhigh) continue;
+        for (k = n1 = n2 = 0; k < t->nobjects; ++k) {
+          n1 += VEC_I(t->objects[k].box.low, i) <= cut;
+          n2 += VEC_I(t->objects[k].box.high, i) >= cut;
+        }
+        if (best < 0 || sah_cost(t, i, cut, n1, n2) < best_cost) {
+          best = i;
+          best_cost = sah_cost(t, i, cut, n1, n2);
+          best_point = cut;
+        }
+      }
+    }
+    else {
+      double scale = GEOM_BOX_TREE_SAH_BINS / (hi - lo);
+
+      for (k = 0; k < GEOM_BOX_TREE_SAH_BINS; ++k)
+        nlow[k] = nhigh[k] = 0;
+      for (j = 0; j < t->nobjects; ++j) {
+        int klow = (int)floor((VEC_I(t->objects[j].box.low, i) - lo) * scale);
+        int khigh = (int)floor((VEC_I(t->objects[j].box.high, i) - lo) * scale);
+        nlow[MAX(0, MIN(GEOM_BOX_TREE_SAH_BINS - 1, klow))] += 1;
+        nhigh[MAX(0, MIN(GEOM_BOX_TREE_SAH_BINS - 1, khigh))] += 1;
+      }
+
+      /* sweep the cuts between bins k-1 and k: objects starting below the
+         cut go in the lower half, objects ending above it in the upper */
+      for (k = 1, n1 = 0, n2 = t->nobjects; k < GEOM_BOX_TREE_SAH_BINS; ++k) {
+        double cut = lo + k / scale;
+        n1 += nlow[k - 1];
+        n2 -= nhigh[k - 1];
+        if (best < 0 || sah_cost(t, i, cut, n1, n2) < best_cost) {
+          best = i;
+          best_cost = sah_cost(t, i, cut, n1, n2);
+          best_point = cut;
+        }
+      }
     }
   }
-  CHECK(j == t->nobjects && n1 == t->t1->nobjects && n2 == t->t2->nobjects,
-        "BUG in divide_geom_box_tree: wrong nobjects");
 
-  t->nobjects = 0;
-  FREE(t->objects);
-  t->objects = NULL;
+  if (best < 0 || best_cost >= t->nobjects) return; /* division doesn't help us */
 
-  divide_geom_box_tree(t->t1);
-  divide_geom_box_tree(t->t2);
+  /* the binned counts are estimates, so recount exactly */
+  divide_geom_box(&t->b, best, best_point, &t->b1, &t->b2);
+  for (j = n1 = n2 = 0; j < t->nobjects; ++j) {
+    n1 += geom_boxes_intersect(&t->b1, &t->objects[j].box);
+    n2 += geom_boxes_intersect(&t->b2, &t->objects[j].box);
+  }
+  if (n1 == t->nobjects && n2 == t->nobjects) return;
+
+  split_geom_box_tree(t, best, best_point, n1, n2);
+
+#ifdef _OPENMP
+#pragma omp task if (n1 >= GEOM_BOX_TREE_PARALLEL_MIN)
+#endif
+  divide_geom_box_tree_sah(t->t1, depth + 1);
+  divide_geom_box_tree_sah(t->t2, depth + 1);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
 }
 
+geom_box_tree_builder_type geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+
 geom_box_tree create_geom_box_tree(void) {
   geom_box b0;
-  b0.low = vector3_plus(geometry_center, vector3_scale(-0.5, geometry_lattice.size));
-  b0.high = vector3_plus(geometry_center, vector3_scale(0.5, geometry_lattice.size));
-  return create_geom_box_tree0(geometry, b0);
+  b0.low = vector3_plus(CTX(geometry_center), vector3_scale(-0.5, CTX(geometry_lattice).size));
+  b0.high = vector3_plus(CTX(geometry_center), vector3_scale(0.5, CTX(geometry_lattice).size));
+  return create_geom_box_tree0(CTX(geometry), b0);
 }
 
 static int num_objects_in_box(const geometric_object *o, vector3 shiftby, const geom_box *b) {
@@ -1658,50 +3562,152 @@ static int store_objects_in_box(const geometric_object *o, vector3 shiftby, cons
   }
 }
 
+/* Return the number of box objects for o (including its periodic
+   images, if ensure_periodicity) that intersect b, storing them in bo
+   with the given precedence if bo is non-NULL.
+
+   Rather than trying all 3^dimensions shifts of o, as LOOP_PERIODIC
+   would, we compute the bounding box of o once and keep, along each
+   axis, only the shifts by which it still intersects b (usually just
+   the zero shift, unless o crosses the edge of the cell).  The shifts
+   are visited in the same order as LOOP_PERIODIC, so the box objects
+   (and hence the shiftby and precedence found by searches) are the
+   same as if every shift were tried. */
+static int box_objects_of_object(const geometric_object *o, const geom_box *b,
+                                 geom_box_object *bo, int precedence) {
+  vector3 shiftby = {0, 0, 0};
+  geom_box ob;
+  int shift_lo[3] = {0, 0, 0}, shift_hi[3] = {0, 0, 0};
+  int i, j, k, n = 0;
+
+  if (!CTX(ensure_periodicity))
+    return bo ? store_objects_in_box(o, shiftby, b, bo, precedence)
+              : num_objects_in_box(o, shiftby, b);
+
+  geom_get_bounding_box(*o, &ob);
+  for (i = 0; i < CTX(dimensions); ++i) {
+    number L = VEC_I(CTX(geometry_lattice).size, i);
+    if (L == 0) continue; /* all shifts are 0, so try just one */
+    shift_lo[i] = VEC_I(ob.high, i) - L >= VEC_I(b->low, i) ? -1 : 0;
+    shift_hi[i] = VEC_I(ob.low, i) + L <= VEC_I(b->high, i) ? 1 : 0;
+  }
+
+  for (i = shift_lo[0]; i <= shift_hi[0]; ++i)
+    for (j = shift_lo[1]; j <= shift_hi[1]; ++j)
+      for (k = shift_lo[2]; k <= shift_hi[2]; ++k) {
+        shiftby.x = i * CTX(geometry_lattice).size.x;
+        shiftby.y = j * CTX(geometry_lattice).size.y;
+        shiftby.z = k * CTX(geometry_lattice).size.z;
+        if (o->which_subclass == GEOM COMPOUND_GEOMETRIC_OBJECT)
+          n += bo ? store_objects_in_box(o, shiftby, b, bo + n, precedence)
+                  : num_objects_in_box(o, shiftby, b);
+        else {
+          geom_box sb = ob;
+          geom_box_shift(&sb, shiftby);
+          if (geom_boxes_intersect(&sb, b)) {
+            if (bo) {
+              bo[n].box = sb;
+              bo[n].o = o;
+              bo[n].shiftby = shiftby;
+              bo[n].precedence = precedence;
+            }
+            ++n;
+          }
+        }
+      }
+  return n;
+}
+
+/* divide the leaf t, at the given depth of the tree, using the
+   partitioning strategy selected by geom_box_tree_builder */
+static void partition_geom_box_tree(geom_box_tree t, int depth) {
+  const geom_context *ctx = geom_current_context;
+
+  /* a team of threads for the tasks spawned by the divide functions;
+     one thread starts at the root, and the others pick up subtrees */
+#ifdef _OPENMP
+#pragma omp parallel if (t->nobjects >= GEOM_BOX_TREE_PARALLEL_MIN)
+#endif
+  {
+    const geom_context *prev = geom_set_context(ctx); /* as in the calling thread */
+#ifdef _OPENMP
+#pragma omp single
+#endif
+    {
+      if (CTX(geom_box_tree_builder) == GEOM_BOX_TREE_SAH)
+        divide_geom_box_tree_sah(t, depth);
+      else
+        divide_geom_box_tree(t);
+    }
+    geom_set_context(prev);
+  }
+}
+
 geom_box_tree create_geom_box_tree0(geometric_object_list geometry, geom_box b0) {
+  const geom_context *ctx = geom_current_context;
   geom_box_tree t = new_geom_box_tree();
-  int i, index;
+  int *index = MALLOC(int, geometry.num_items);
+  int i;
 
+  CHECK(index || geometry.num_items == 0, "out of memory");
   t->b = b0;
 
-  for (i = geometry.num_items - 1; i >= 0; --i) {
-    vector3 shiftby = {0, 0, 0};
-    if (ensure_periodicity) {
-      LOOP_PERIODIC(shiftby, t->nobjects += num_objects_in_box(geometry.items + i, shiftby, &t->b));
-    }
-    else
-      t->nobjects += num_objects_in_box(geometry.items + i, shiftby, &t->b);
-  }
+#ifdef _OPENMP
+#pragma omp parallel if (geometry.num_items >= GEOM_BOX_TREE_PARALLEL_MIN)
+#endif
+  {
+    const geom_context *prev = geom_set_context(ctx); /* as in the calling thread */
 
-  t->objects = MALLOC(geom_box_object, t->nobjects);
-  CHECK(t->objects || t->nobjects == 0, "out of memory");
+    /* Count the box objects of each object (in parallel), then set
+       index[i] to where those of object i start in t->objects; they are
+       stored in reverse order, since the last object takes precedence. */
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+    for (i = 0; i < geometry.num_items; ++i)
+      index[i] = box_objects_of_object(geometry.items + i, &t->b, NULL, 0);
+#ifdef _OPENMP
+#pragma omp single
+#endif
+    {
+      int j;
+      for (j = geometry.num_items - 1; j >= 0; --j) {
+        int n = index[j];
+        index[j] = t->nobjects;
+        t->nobjects += n;
+      }
+      t->objects = MALLOC(geom_box_object, t->nobjects);
+      CHECK(t->objects || t->nobjects == 0, "out of memory");
+    }
 
-  for (i = geometry.num_items - 1, index = 0; i >= 0; --i) {
-    vector3 shiftby = {0, 0, 0};
-    if (ensure_periodicity) {
-      int precedence = t->nobjects - index;
-      LOOP_PERIODIC(shiftby, index += store_objects_in_box(geometry.items + i, shiftby, &t->b,
-                                                           t->objects + index, precedence));
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 64)
+#endif
+    for (i = 0; i < geometry.num_items; ++i) {
+      int n = box_objects_of_object(geometry.items + i, &t->b, t->objects + index[i],
+                                    t->nobjects - index[i]);
+      CHECK(index[i] + n == (i == 0 ? t->nobjects : index[i - 1]), "bug in create_geom_box_tree0");
     }
-    else
-      index += store_objects_in_box(geometry.items + i, shiftby, &t->b, t->objects + index,
-                                    t->nobjects - index);
+    geom_set_context(prev);
   }
-  CHECK(index == t->nobjects, "bug in create_geom_box_tree0");
+  FREE(index);
 
-  divide_geom_box_tree(t);
+  partition_geom_box_tree(t, 0);
 
   return t;
 }
 
-/* create a new tree from t, pruning all nodes that don't intersect b */
-geom_box_tree restrict_geom_box_tree(geom_box_tree t, const geom_box *b) {
+/* helper function for restrict_geom_box_tree */
+static geom_box_tree restrict_geom_box_tree0(geom_box_tree t, const geom_box *b) {
   geom_box_tree tr;
   int i, j;
 
   if (!t || !geom_boxes_intersect(&t->b, b)) return NULL;
 
   tr = new_geom_box_tree();
+  tr->b = t->b;
+  tr->b1 = t->b1;
+  tr->b2 = t->b2;
 
   for (i = 0, j = 0; i < t->nobjects; ++i)
     if (geom_boxes_intersect(&t->objects[i].box, b)) ++j;
@@ -1712,27 +3718,718 @@ geom_box_tree restrict_geom_box_tree(geom_box_tree t, const geom_box *b) {
   for (i = 0, j = 0; i < t->nobjects; ++i)
     if (geom_boxes_intersect(&t->objects[i].box, b)) tr->objects[j++] = t->objects[i];
 
-  tr->t1 = restrict_geom_box_tree(t->t1, b);
-  tr->t2 = restrict_geom_box_tree(t->t2, b);
+  tr->t1 = restrict_geom_box_tree0(t->t1, b);
+  tr->t2 = restrict_geom_box_tree0(t->t2, b);
+
+  if (tr->nobjects == 0) {
+    if (tr->t1 && !tr->t2) {
+      geom_box_tree tr0 = tr;
+      tr = tr->t1;
+      FREE(tr0->objects);
+      FREE1(tr0);
+    }
+    else if (tr->t2 && !tr->t1) {
+      geom_box_tree tr0 = tr;
+      tr = tr->t2;
+      FREE(tr0->objects);
+      FREE1(tr0);
+    }
+  }
+
+  return tr;
+}
+
+/* create a new tree from t, pruning all nodes that don't intersect b;
+   the new tree is compiled if t is compiled */
+geom_box_tree restrict_geom_box_tree(geom_box_tree t, const geom_box *b) {
+  geom_box_tree tr = restrict_geom_box_tree0(t, b);
+  if (tr && t->compiled) {
+    geom_box_tree trc = compile_geom_box_tree(tr);
+    destroy_geom_box_tree(tr);
+    return trc;
+  }
+  return tr;
+}
+
+/* Return a "view" of t restricted to b, which can be searched just like
+   the tree returned by restrict_geom_box_tree(t, b) for points in b,
+   but which shares the nodes and objects of t rather than copying them:
+   it is a single new node, whose box is the part of b inside t and whose
+   only child is the smallest subtree of t that holds all of the objects
+   intersecting b.  Points outside b are not found in the view.
+
+   A view is cheap to create and to deallocate (with destroy_geom_box_tree,
+   which leaves t alone), but t must not be destroyed or modified while
+   the view is in use.  Returns NULL if b does not intersect t. */
+geom_box_tree restrict_geom_box_tree_view(geom_box_tree t, const geom_box *b) {
+  geom_box_tree tv;
+
+  if (!t || !geom_boxes_intersect(&t->b, b)) return NULL;
+
+  /* descend past nodes whose objects all miss b and that have at most
+     one child intersecting b, since these contribute nothing to the
+     search for a point in b other than a longer path */
+  for (;;) {
+    int i, in1, in2;
+    for (i = 0; i < t->nobjects; ++i)
+      if (geom_boxes_intersect(&t->objects[i].box, b)) break;
+    if (i < t->nobjects) break;
+    in1 = t->t1 && geom_boxes_intersect(&t->t1->b, b);
+    in2 = t->t2 && geom_boxes_intersect(&t->t2->b, b);
+    if (in1 && in2) break;
+    if (!in1 && !in2) return NULL; /* no objects intersect b */
+    t = in1 ? t->t1 : t->t2;
+  }
+
+  tv = new_geom_box_tree();
+  geom_box_intersection(&tv->b, &t->b, b);
+  tv->b1 = tv->b2 = tv->b;
+  tv->t1 = t;
+  tv->view_of = t;
+  return tv;
+}
+
+/* helper functions for compile_geom_box_tree: count the nodes and
+   objects of t, and copy t into c in depth-first order starting at
+   node index n and object index *nobj, returning the index of the
+   node following the subtree. */
+static void count_geom_box_tree(geom_box_tree t, int *nnodes, int *nobjects) {
+  if (t) {
+    *nnodes += 1;
+    *nobjects += t->nobjects;
+    count_geom_box_tree(t->t1, nnodes, nobjects);
+    count_geom_box_tree(t->t2, nnodes, nobjects);
+  }
+}
+
+static int flatten_geom_box_tree(geom_box_tree t, geom_box_tree_compiled c, int n, int *nobj) {
+  geom_box_tree_node *node = c->nodes + n;
+  int i, next = n + 1;
+
+  node->b = t->b;
+  node->first = *nobj;
+  for (i = 0; i < t->nobjects; ++i)
+    c->objects[(*nobj)++] = t->objects[i];
+  node->t1 = t->t1 ? next : -1;
+  if (t->t1) next = flatten_geom_box_tree(t->t1, c, next, nobj);
+  node->t2 = t->t2 ? next : -1;
+  if (t->t2) next = flatten_geom_box_tree(t->t2, c, next, nobj);
+  node->next = next;
+  return next;
+}
+
+/* helper function for compile_geom_box_tree and load_geom_box_tree:
+   allocate and initialize c->trees from c->nodes, and c->queries from
+   c->objects, returning the root */
+static geom_box_tree init_compiled_trees(geom_box_tree_compiled c) {
+  int i;
+
+  c->trees = MALLOC(struct geom_box_tree_struct, c->nnodes);
+  c->queries = MALLOC(geom_object_query, c->nobjects);
+  CHECK(c->trees && (c->queries || c->nobjects == 0), "out of memory");
+  for (i = 0; i < c->nobjects; ++i)
+    compile_geom_object_query(c->objects[i].o, c->queries + i);
+  for (i = 0; i < c->nnodes; ++i) {
+    geom_box_tree_node *node = c->nodes + i;
+    geom_box_tree ti = c->trees + i;
+    ti->b = node->b;
+    ti->t1 = node->t1 >= 0 ? c->trees + node->t1 : NULL;
+    ti->t2 = node->t2 >= 0 ? c->trees + node->t2 : NULL;
+    ti->b1 = ti->t1 ? ti->t1->b : node->b;
+    ti->b2 = ti->t2 ? ti->t2->b : node->b;
+    ti->nobjects = node[1].first - node->first;
+    ti->objects = ti->nobjects ? c->objects + node->first : NULL;
+    ti->compiled = c;
+    ti->view_of = NULL;
+  }
+  return c->trees;
+}
+
+/* Return a compiled copy of t (see geom_box_tree_compiled, above),
+   which is faster to search than t but which can otherwise be used
+   in exactly the same way, and must likewise be deallocated with
+   destroy_geom_box_tree.  The original tree t is not modified. */
+geom_box_tree compile_geom_box_tree(geom_box_tree t) {
+  geom_box_tree_compiled c;
+  int nobj = 0;
+
+  if (!t) return NULL;
+
+  c = MALLOC1(struct geom_box_tree_compiled_struct);
+  CHECK(c, "out of memory");
+  c->nnodes = c->nobjects = 0;
+  count_geom_box_tree(t, &c->nnodes, &c->nobjects);
+  c->nodes = MALLOC(geom_box_tree_node, c->nnodes + 1);
+  c->objects = MALLOC(geom_box_object, c->nobjects);
+  CHECK(c->nodes && (c->objects || c->nobjects == 0), "out of memory");
+
+  CHECK(flatten_geom_box_tree(t, c, 0, &nobj) == c->nnodes && nobj == c->nobjects,
+        "BUG in compile_geom_box_tree");
+  c->nodes[c->nnodes].first = c->nobjects; /* sentinel */
+  c->data = NULL;
+  c->ndata = 0;
+  c->mapped = 0;
+
+  return init_compiled_trees(c);
+}
+
+/**************************************************************************/
+
+/* Saving a geom_box_tree to a file, and loading it back, so that
+   programs repeatedly run with the same geometry needn't rebuild the
+   tree each time.  The file holds the arrays of a compiled tree
+   (see geom_box_tree_compiled), preceded by a header, so that loading
+   it is mostly a matter of mapping the file into memory: only the
+   geometric-object pointers need to be fixed up, since the file
+   instead stores the index of each object in a depth-first listing of
+   the geometry (including the components of compound objects).
+
+   The header includes a hash of everything that the tree depends on:
+   the bounding box of each object (and the nesting of compound
+   objects), the lattice size, dimensions, ensure_periodicity, and the
+   tree's bounding box.  Other changes to the objects (e.g. their
+   materials) don't invalidate the tree, but any change that does
+   causes load_geom_box_tree to reject the file.  The file format is
+   specific to the machine and to the libctl version that wrote it. */
+
+#define GEOM_BOX_TREE_FILE_VERSION 1
+#define GEOM_BOX_TREE_FILE_ALIGN 64 /* alignment of the arrays in the file */
+
+typedef struct {
+  char magic[8]; /* "CTLGEOMT" */
+  int32_t version;
+  int32_t endian; /* 0x01020304 in the byte order of the machine */
+  int32_t sizeof_number, sizeof_node, sizeof_object;
+  int32_t nnodes, nobjects, ngeometry;
+  uint64_t hash;
+  uint64_t nodes_offset, objects_offset, size;
+} geom_box_tree_file_header;
+
+#define ALIGN_UP(n)                                                                                \
+  (((n) + GEOM_BOX_TREE_FILE_ALIGN - 1) / GEOM_BOX_TREE_FILE_ALIGN * GEOM_BOX_TREE_FILE_ALIGN)
+
+/* 64-bit FNV-1a hash of n bytes of data, continuing from h */
+static uint64_t fnv1a_hash(uint64_t h, const void *data, size_t n) {
+  const unsigned char *d = (const unsigned char *)data;
+  size_t i;
+  for (i = 0; i < n; ++i)
+    h = (h ^ d[i]) * 1099511628211ULL;
+  return h;
+}
+#define FNV1A_INIT 14695981039346656037ULL
+
+/* Set objs[*n...] (if objs is non-NULL) to the objects of the depth-first
+   listing of o and its components, incrementing *n, and update the hash
+   h with their bounding boxes (shifted by shiftby) and nesting. */
+static uint64_t list_geometric_objects(const geometric_object *o, vector3 shiftby,
+                                       const geometric_object **objs, int *n, uint64_t h) {
+  if (objs) objs[*n] = o;
+  *n += 1;
+  if (o->which_subclass == GEOM COMPOUND_GEOMETRIC_OBJECT) {
+    int i, no = o->subclass.compound_geometric_object_data->component_objects.num_items;
+    geometric_object *os = o->subclass.compound_geometric_object_data->component_objects.items;
+    h = fnv1a_hash(h, &no, sizeof(int));
+    h = fnv1a_hash(h, &o->center, sizeof(vector3));
+    shiftby = vector3_plus(shiftby, o->center);
+    for (i = 0; i < no; ++i)
+      h = list_geometric_objects(os + i, shiftby, objs, n, h);
+  }
+  else {
+    geom_box b;
+    geom_get_bounding_box(*o, &b);
+    geom_box_shift(&b, shiftby);
+    h = fnv1a_hash(h, &b, sizeof(geom_box));
+  }
+  return h;
+}
+
+/* Return the depth-first listing of the objects of geometry, which
+   must be deallocated with FREE, setting *n to its length and *hash to
+   the hash (see above) of a tree of those objects in the box b0. */
+static const geometric_object **list_geometry_objects(geometric_object_list geometry,
+                                                      const geom_box *b0, int *n,
+                                                      uint64_t *hash) {
+  const geometric_object **objs;
+  vector3 zero = {0, 0, 0};
+  uint64_t h = FNV1A_INIT;
+  int i, nobjs = 0;
+
+  for (i = 0; i < geometry.num_items; ++i)
+    list_geometric_objects(geometry.items + i, zero, NULL, &nobjs, 0);
+  objs = MALLOC(const geometric_object *, nobjs);
+  CHECK(objs || nobjs == 0, "out of memory");
+
+  h = fnv1a_hash(h, &geometry.num_items, sizeof(int));
+  h = fnv1a_hash(h, &CTX(dimensions), sizeof(CTX(dimensions)));
+  h = fnv1a_hash(h, &CTX(ensure_periodicity), sizeof(CTX(ensure_periodicity)));
+  h = fnv1a_hash(h, &CTX(geometry_lattice).size, sizeof(vector3));
+  h = fnv1a_hash(h, b0, sizeof(geom_box));
+  for (i = 0, *n = 0; i < geometry.num_items; ++i)
+    h = list_geometric_objects(geometry.items + i, zero, objs, n, h);
+  *hash = h;
+  return objs;
+}
+
+/* index of an object in a listing, for sorting/searching by address */
+typedef struct {
+  const geometric_object *o;
+  int index;
+} object_index;
+
+static int object_index_cmp(const void *a, const void *b) {
+  size_t oa = (size_t)((const object_index *)a)->o, ob = (size_t)((const object_index *)b)->o;
+  return oa < ob ? -1 : (oa > ob ? 1 : 0);
+}
+
+/* Save the tree t, which must have been created from the objects of
+   geometry (by create_geom_box_tree0 or the other functions above), to
+   the file filename, which can be loaded by load_geom_box_tree.
+   Returns whether the file was successfully written. */
+boolean save_geom_box_tree(geom_box_tree t, geometric_object_list geometry, const char *filename) {
+  geom_box_tree tc = (t && t->compiled && t == t->compiled->trees) ? t : compile_geom_box_tree(t);
+  geom_box_tree_compiled c;
+  geom_box_tree_file_header h;
+  const geometric_object **objs;
+  object_index *index;
+  geom_box_object *objects;
+  char *data;
+  FILE *f;
+  int i, ngeometry, ok = 1;
+
+  if (!tc) return 0;
+  c = tc->compiled;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "CTLGEOMT", 8);
+  h.version = GEOM_BOX_TREE_FILE_VERSION;
+  h.endian = 0x01020304;
+  h.sizeof_number = sizeof(number);
+  h.sizeof_node = sizeof(geom_box_tree_node);
+  h.sizeof_object = sizeof(geom_box_object);
+  h.nnodes = c->nnodes;
+  h.nobjects = c->nobjects;
+  objs = list_geometry_objects(geometry, &tc->b, &ngeometry, &h.hash);
+  h.ngeometry = ngeometry;
+  h.nodes_offset = ALIGN_UP(sizeof(h));
+  h.objects_offset = ALIGN_UP(h.nodes_offset + sizeof(geom_box_tree_node) * (c->nnodes + 1));
+  h.size = h.objects_offset + sizeof(geom_box_object) * c->nobjects;
+
+  /* the contents of the file, with zero padding */
+  data = MALLOC(char, h.size);
+  CHECK(data, "out of memory");
+  memset(data, 0, h.size);
+  memcpy(data, &h, sizeof(h));
+  memcpy(data + h.nodes_offset, c->nodes, sizeof(geom_box_tree_node) * (c->nnodes + 1));
+  objects = (geom_box_object *)(data + h.objects_offset);
+  memcpy(objects, c->objects, sizeof(geom_box_object) * c->nobjects);
+
+  /* replace the object pointers by their indices in objs */
+  index = MALLOC(object_index, h.ngeometry);
+  CHECK(index || h.ngeometry == 0, "out of memory");
+  for (i = 0; i < h.ngeometry; ++i) {
+    index[i].o = objs[i];
+    index[i].index = i;
+  }
+  qsort(index, h.ngeometry, sizeof(object_index), object_index_cmp);
+  for (i = 0; i < c->nobjects && ok; ++i) {
+    object_index key, *found;
+    key.o = objects[i].o;
+    found = (object_index *)bsearch(&key, index, h.ngeometry, sizeof(object_index),
+                                    object_index_cmp);
+    ok = found != NULL; /* otherwise, t was not created from geometry */
+    if (ok) objects[i].o = (const geometric_object *)(size_t)found->index;
+  }
+
+  if (ok && (f = fopen(filename, "wb"))) {
+    ok = fwrite(data, 1, h.size, f) == h.size;
+    ok = (fclose(f) == 0) && ok;
+  }
+  else
+    ok = 0;
+
+  if (index) FREE(index);
+  if (objs) FREE(objs);
+  FREE(data);
+  if (tc != t) destroy_geom_box_tree(tc);
+  return ok;
+}
+
+/* helper function for load_geom_box_tree: read the file into memory,
+   mapping it if possible, returning NULL if it can't be read */
+static char *read_geom_box_tree_file(const char *filename, size_t *ndata, int *mapped) {
+  char *data = NULL;
+  FILE *f;
+  long n;
+
+#ifdef HAVE_MMAP
+  {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      /* a private, writable mapping, so that we can fix up the object
+         pointers: only the pages of objects are then copied */
+      void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        close(fd);
+        *ndata = st.st_size;
+        *mapped = 1;
+        return (char *)p;
+      }
+    }
+    close(fd);
+  }
+#endif
+
+  *mapped = 0;
+  if (!(f = fopen(filename, "rb"))) return NULL;
+  if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+    data = MALLOC(char, n);
+    CHECK(data, "out of memory");
+    if (fread(data, 1, n, f) != (size_t)n) {
+      FREE(data);
+      data = NULL;
+    }
+    *ndata = n;
+  }
+  fclose(f);
+  return data;
+}
+
+/* Load a tree saved by save_geom_box_tree, returning NULL if the file
+   can't be read or was not saved for a tree of the objects of geometry
+   in the box b0 (as passed to create_geom_box_tree0), with the current
+   lattice, dimensions, and ensure_periodicity; otherwise the result
+   is a compiled tree (see compile_geom_box_tree) equivalent to the one
+   that was saved, which refers to the objects of geometry.  As for any
+   tree, it must be deallocated with destroy_geom_box_tree. */
+geom_box_tree load_geom_box_tree(const char *filename, geometric_object_list geometry,
+                                 geom_box b0) {
+  geom_box_tree_file_header h;
+  geom_box_tree_compiled c;
+  const geometric_object **objs;
+  uint64_t hash;
+  int ngeometry, mapped, i, ok;
+  size_t ndata;
+  char *data = read_geom_box_tree_file(filename, &ndata, &mapped);
+
+  if (!data) return NULL;
+  if (ndata < sizeof(h)) {
+    free_geom_box_tree_file(data, ndata, mapped);
+    return NULL;
+  }
+  memcpy(&h, data, sizeof(h));
+  objs = list_geometry_objects(geometry, &b0, &ngeometry, &hash);
+  ok = !memcmp(h.magic, "CTLGEOMT", 8) && h.version == GEOM_BOX_TREE_FILE_VERSION &&
+       h.endian == 0x01020304 && h.sizeof_number == sizeof(number) &&
+       h.sizeof_node == sizeof(geom_box_tree_node) &&
+       h.sizeof_object == sizeof(geom_box_object) && h.ngeometry == ngeometry &&
+       h.hash == hash && h.nnodes > 0 && h.nobjects >= 0 && h.size == ndata &&
+       h.nodes_offset % GEOM_BOX_TREE_FILE_ALIGN == 0 &&
+       h.objects_offset % GEOM_BOX_TREE_FILE_ALIGN == 0 &&
+       h.nodes_offset + sizeof(geom_box_tree_node) * (h.nnodes + 1) <= h.objects_offset &&
+       h.objects_offset + sizeof(geom_box_object) * h.nobjects == h.size;
+  if (!ok) {
+    if (objs) FREE(objs);
+    free_geom_box_tree_file(data, ndata, mapped);
+    return NULL;
+  }
+
+  c = MALLOC1(struct geom_box_tree_compiled_struct);
+  CHECK(c, "out of memory");
+  c->nnodes = h.nnodes;
+  c->nobjects = h.nobjects;
+  c->nodes = (geom_box_tree_node *)(data + h.nodes_offset);
+  c->objects = (geom_box_object *)(data + h.objects_offset);
+  c->trees = NULL;
+  c->queries = NULL;
+  c->data = data;
+  c->ndata = ndata;
+  c->mapped = mapped;
+
+  /* check the node indices, so that a corrupted file can't crash us */
+  for (i = 0; ok && i < c->nnodes; ++i) {
+    const geom_box_tree_node *node = c->nodes + i;
+    ok = node->next > i && node->next <= c->nnodes && (node->t1 < 0 || node->t1 == i + 1) &&
+         (node->t2 < 0 || (node->t2 > i && node->t2 < node->next)) && node->first >= 0 &&
+         node->first <= node[1].first;
+  }
+  ok = ok && c->nodes[c->nnodes].first == c->nobjects;
+
+  /* replace the object indices by pointers */
+  for (i = 0; ok && i < c->nobjects; ++i) {
+    size_t k = (size_t)c->objects[i].o;
+    ok = k < (size_t)ngeometry;
+    if (ok) c->objects[i].o = objs[k];
+  }
+  if (objs) FREE(objs);
+
+  if (!ok) {
+    destroy_geom_box_tree_compiled(c);
+    return NULL;
+  }
+  return init_compiled_trees(c);
+}
+
+/**************************************************************************/
+
+/* Incremental modification of a geom_box_tree, e.g. for optimization
+   loops that move a few objects at a time, without rebuilding the
+   whole tree.  Inserting an object adds its box objects to the leaves
+   that they intersect, re-dividing only those leaves, and removing an
+   object deletes its box objects, merging sibling leaves that become
+   nearly empty; the upper levels of the tree are left alone, so after
+   many modifications the tree may be less efficient than a new one, in
+   which case it can be re-partitioned with geom_box_tree_rebalance.
+
+   The objects within each node are kept in order of decreasing
+   precedence (as in the trees made by create_geom_box_tree), which is
+   what makes the first object found by tree_search the one with the
+   highest precedence.  Objects of equal precedence (the periodic images
+   of an object) are ordered by their shifts, as in LOOP_PERIODIC.
+
+   These functions only apply to trees made by create_geom_box_tree,
+   not to compiled or restricted trees or views. */
+
+static int geom_box_object_cmp(const geom_box_object *a, const geom_box_object *b) {
+  if (a->precedence != b->precedence) return a->precedence > b->precedence ? -1 : 1;
+  if (a->o != b->o) return (size_t)a->o < (size_t)b->o ? -1 : 1;
+  if (a->shiftby.x != b->shiftby.x) return a->shiftby.x < b->shiftby.x ? -1 : 1;
+  if (a->shiftby.y != b->shiftby.y) return a->shiftby.y < b->shiftby.y ? -1 : 1;
+  if (a->shiftby.z != b->shiftby.z) return a->shiftby.z < b->shiftby.z ? -1 : 1;
+  return 0;
+}
+
+static int geom_box_object_qsort_cmp(const void *a, const void *b) {
+  return geom_box_object_cmp((const geom_box_object *)a, (const geom_box_object *)b);
+}
+
+/* insert bo into the leaves of t that it intersects, re-dividing them */
+static void insert_geom_box_object(geom_box_tree t, const geom_box_object *bo, int depth) {
+  geom_box_object *objects;
+  int i, j;
+
+  if (!t || !geom_boxes_intersect(&t->b, &bo->box)) return;
+  if (t->t1 || t->t2) {
+    insert_geom_box_object(t->t1, bo, depth + 1);
+    insert_geom_box_object(t->t2, bo, depth + 1);
+    return;
+  }
+
+  objects = MALLOC(geom_box_object, t->nobjects + 1);
+  CHECK(objects, "out of memory");
+  for (i = j = 0; i < t->nobjects && geom_box_object_cmp(t->objects + i, bo) <= 0; ++i)
+    objects[j++] = t->objects[i];
+  objects[j++] = *bo;
+  for (; i < t->nobjects; ++i)
+    objects[j++] = t->objects[i];
+  if (t->objects) FREE(t->objects);
+  t->objects = objects;
+  t->nobjects += 1;
+
+  partition_geom_box_tree(t, depth);
+}
+
+/* Insert the object o (and its periodic images, if ensure_periodicity)
+   into t with the given precedence; objects of higher precedence are
+   found first by the searches, so o takes precedence over all of the
+   objects of a tree made by create_geom_box_tree if precedence is
+   greater than the number of objects reported by geom_box_tree_stats.
+   As for create_geom_box_tree0, o must remain valid for as long as the
+   tree is in use, and parts of o outside the tree's box are omitted. */
+void geom_box_tree_insert(geom_box_tree t, const geometric_object *o, int precedence) {
+  geom_box_object *bo;
+  int i, n;
+
+  CHECK(t && !t->compiled && !t->view_of,
+        "geom_box_tree_insert: cannot modify a compiled tree or a view");
+  n = box_objects_of_object(o, &t->b, NULL, 0);
+  if (n == 0) return;
+  bo = MALLOC(geom_box_object, n);
+  CHECK(bo, "out of memory");
+  box_objects_of_object(o, &t->b, bo, precedence);
+  for (i = 0; i < n; ++i)
+    insert_geom_box_object(t, bo + i, 0);
+  FREE(bo);
+}
+
+/* whether c is o or one of its (possibly nested) component objects */
+static int object_has_component(const geometric_object *o, const geometric_object *c) {
+  if (o == c) return 1;
+  if (o->which_subclass == GEOM COMPOUND_GEOMETRIC_OBJECT) {
+    int i, n = o->subclass.compound_geometric_object_data->component_objects.num_items;
+    geometric_object *os = o->subclass.compound_geometric_object_data->component_objects.items;
+    for (i = 0; i < n; ++i)
+      if (object_has_component(os + i, c)) return 1;
+  }
+  return 0;
+}
+
+/* replace the objects of the leaf t by the union of the objects of its
+   children (keeping one copy of the objects in both), and delete them */
+static void merge_geom_box_tree_children(geom_box_tree t) {
+  geom_box_tree t1 = t->t1, t2 = t->t2;
+  int i1 = 0, i2 = 0, n = 0;
+
+  if (t->objects) FREE(t->objects);
+  t->objects = MALLOC(geom_box_object, t1->nobjects + t2->nobjects);
+  CHECK(t->objects || t1->nobjects + t2->nobjects == 0, "out of memory");
+  while (i1 < t1->nobjects || i2 < t2->nobjects) {
+    int c = i1 == t1->nobjects   ? 1
+            : i2 == t2->nobjects ? -1
+                                 : geom_box_object_cmp(t1->objects + i1, t2->objects + i2);
+    t->objects[n++] = c <= 0 ? t1->objects[i1] : t2->objects[i2];
+    i1 += c <= 0;
+    i2 += c >= 0;
+  }
+  t->nobjects = n;
+  t->t1 = t->t2 = NULL;
+  destroy_geom_box_tree(t1);
+  destroy_geom_box_tree(t2);
+}
+
+/* helper function for geom_box_tree_remove, returning the number of
+   objects (counting duplicates in different leaves) removed from t */
+static int remove_geom_box_objects(geom_box_tree t, const geometric_object *o) {
+  int i, n, nremoved = 0;
+
+  if (!t) return 0;
+  for (i = n = 0; i < t->nobjects; ++i)
+    if (!object_has_component(o, t->objects[i].o)) t->objects[n++] = t->objects[i];
+  nremoved = t->nobjects - n;
+  t->nobjects = n;
+  if (n == 0 && t->objects) {
+    FREE(t->objects);
+    t->objects = NULL;
+  }
+
+  nremoved += remove_geom_box_objects(t->t1, o);
+  nremoved += remove_geom_box_objects(t->t2, o);
+
+  /* undo divisions of t that no longer help, as in divide_geom_box_tree */
+  if (nremoved && t->t1 && t->t2 && !t->t1->t1 && !t->t1->t2 && !t->t2->t1 && !t->t2->t2 &&
+      !t->nobjects && t->t1->nobjects + t->t2->nobjects <= 2)
+    merge_geom_box_tree_children(t);
+
+  return nremoved;
+}
+
+/* Remove the object o (as passed to geom_box_tree_insert, or an item of
+   the geometry passed to create_geom_box_tree0) from t, including all
+   of its periodic images and components; returns whether it was found. */
+boolean geom_box_tree_remove(geom_box_tree t, const geometric_object *o) {
+  CHECK(t && !t->compiled && !t->view_of,
+        "geom_box_tree_remove: cannot modify a compiled tree or a view");
+  return remove_geom_box_objects(t, o) > 0;
+}
+
+/* helper function for geom_box_tree_update: set *precedence to the
+   highest precedence of o in t, returning whether o was found */
+static int get_object_precedence(geom_box_tree t, const geometric_object *o, int *precedence) {
+  int i, found = 0;
+  if (!t) return 0;
+  for (i = 0; i < t->nobjects; ++i)
+    if (object_has_component(o, t->objects[i].o) &&
+        (!found++ || t->objects[i].precedence > *precedence))
+      *precedence = t->objects[i].precedence;
+  if (get_object_precedence(t->t1, o, precedence)) found = 1;
+  if (get_object_precedence(t->t2, o, precedence)) found = 1;
+  return found;
+}
+
+/* Update t after the object o has been modified (e.g. given a new
+   center or size, followed by geom_fix_object_ptr), keeping its
+   precedence; returns whether o was found in t.  (An object that was
+   entirely outside the tree's box, and hence not found, must instead
+   be added with geom_box_tree_insert.) */
+boolean geom_box_tree_update(geom_box_tree t, const geometric_object *o) {
+  int precedence = 0;
+  CHECK(t && !t->compiled && !t->view_of,
+        "geom_box_tree_update: cannot modify a compiled tree or a view");
+  if (!get_object_precedence(t, o, &precedence)) return 0;
+  remove_geom_box_objects(t, o);
+  geom_box_tree_insert(t, o, precedence);
+  return 1;
+}
 
-  if (tr->nobjects == 0) {
-    if (tr->t1 && !tr->t2) {
-      geom_box_tree tr0 = tr;
-      tr = tr->t1;
-      FREE1(tr0);
-    }
-    else if (tr->t2 && !tr->t1) {
-      geom_box_tree tr0 = tr;
-      tr = tr->t2;
-      FREE1(tr0);
-    }
-  }
+/* helper function for geom_box_tree_rebalance: append the objects of
+   all the nodes of t to objects, starting at index n */
+static int collect_geom_box_objects(geom_box_tree t, geom_box_object *objects, int n) {
+  int i;
+  if (!t) return n;
+  for (i = 0; i < t->nobjects; ++i)
+    objects[n++] = t->objects[i];
+  n = collect_geom_box_objects(t->t1, objects, n);
+  return collect_geom_box_objects(t->t2, objects, n);
+}
+
+/* Re-partition t from scratch, as if it had been newly created from
+   its current objects. */
+void geom_box_tree_rebalance(geom_box_tree t) {
+  geom_box_object *objects;
+  int depth, nobjects, i, n;
+
+  CHECK(t && !t->compiled && !t->view_of,
+        "geom_box_tree_rebalance: cannot modify a compiled tree or a view");
+  geom_box_tree_stats(t, &depth, &nobjects);
+  objects = MALLOC(geom_box_object, nobjects);
+  CHECK(objects || nobjects == 0, "out of memory");
+  CHECK(collect_geom_box_objects(t, objects, 0) == nobjects, "BUG in geom_box_tree_rebalance");
+
+  /* sort, and remove the duplicates of objects that were in several leaves */
+  qsort(objects, nobjects, sizeof(geom_box_object), geom_box_object_qsort_cmp);
+  for (i = n = 0; i < nobjects; ++i)
+    if (n == 0 || geom_box_object_cmp(objects + n - 1, objects + i)) objects[n++] = objects[i];
+
+  destroy_geom_box_tree(t->t1);
+  destroy_geom_box_tree(t->t2);
+  t->t1 = t->t2 = NULL;
+  if (t->objects) FREE(t->objects);
+  t->objects = objects;
+  t->nobjects = n;
 
-  return tr;
+  partition_geom_box_tree(t, 0);
 }
 
 /**************************************************************************/
 
+/* whether p lies in the i-th object of the node t, using the query
+   records of compiled trees */
+static int point_in_node_object(vector3 p, geom_box_tree t, int i) {
+  const geom_box_object *gbo = t->objects + i;
+  p = vector3_minus(p, gbo->shiftby);
+  if (t->compiled)
+    return point_in_object_query(p, t->compiled->queries + (gbo - t->compiled->objects));
+  return point_in_fixed_objectp(p, *gbo->o);
+}
+
+/* the equivalent of tree_search (below) for the subtree of the compiled
+   tree c rooted at node n: rather than recursing, we loop over the
+   nodes in depth-first order, skipping the subtrees of nodes that don't
+   contain p, which visits the nodes in the same order as tree_search. */
+static geom_box_tree compiled_tree_search(vector3 p, geom_box_tree_compiled c, int n,
+                                          int *oindex) {
+  const geom_box_tree_node *nodes = c->nodes;
+  int end = nodes[n].next;
+  int i = nodes[n].first + *oindex;
+
+  while (n < end) {
+    if (geom_box_contains_point(&nodes[n].b, p)) {
+      for (; i < nodes[n + 1].first; ++i)
+        if (geom_box_contains_point(&c->objects[i].box, p) &&
+            point_in_object_query(vector3_minus(p, c->objects[i].shiftby), c->queries + i)) {
+          *oindex = i - nodes[n].first;
+          return c->trees + n;
+        }
+      n += 1; /* descend into the first child (or continue to the next subtree) */
+    }
+    else
+      n = nodes[n].next;
+    i = nodes[n].first;
+  }
+  return NULL;
+}
+
 /* recursively search the tree for the given point, returning the
    subtree (if any) that contains it and the index oindex of the
    object in that tree.  The input value of oindex indicates the
@@ -1741,11 +4438,11 @@ static geom_box_tree tree_search(vector3 p, geom_box_tree t, int *oindex) {
   int i;
   geom_box_tree gbt;
 
+  if (t && t->compiled) return compiled_tree_search(p, t->compiled, t - t->compiled->trees, oindex);
   if (!t || !geom_box_contains_point(&t->b, p)) return NULL;
 
   for (i = *oindex; i < t->nobjects; ++i)
-    if (geom_box_contains_point(&t->objects[i].box, p) &&
-        point_in_fixed_objectp(vector3_minus(p, t->objects[i].shiftby), *t->objects[i].o)) {
+    if (geom_box_contains_point(&t->objects[i].box, p) && point_in_node_object(p, t, i)) {
       *oindex = i;
       return t;
     }
@@ -1759,18 +4456,19 @@ static geom_box_tree tree_search(vector3 p, geom_box_tree t, int *oindex) {
 /* shift p to be within the unit cell of the lattice (centered on the
    origin) */
 vector3 shift_to_unit_cell(vector3 p) {
-  while (p.x >= 0.5 * geometry_lattice.size.x)
-    p.x -= geometry_lattice.size.x;
-  while (p.x < -0.5 * geometry_lattice.size.x)
-    p.x += geometry_lattice.size.x;
-  while (p.y >= 0.5 * geometry_lattice.size.y)
-    p.y -= geometry_lattice.size.y;
-  while (p.y < -0.5 * geometry_lattice.size.y)
-    p.y += geometry_lattice.size.y;
-  while (p.z >= 0.5 * geometry_lattice.size.z)
-    p.z -= geometry_lattice.size.z;
-  while (p.z < -0.5 * geometry_lattice.size.z)
-    p.z += geometry_lattice.size.z;
+  vector3 size = CTX(geometry_lattice).size;
+  while (p.x >= 0.5 * size.x)
+    p.x -= size.x;
+  while (p.x < -0.5 * size.x)
+    p.x += size.x;
+  while (p.y >= 0.5 * size.y)
+    p.y -= size.y;
+  while (p.y < -0.5 * size.y)
+    p.y += size.y;
+  while (p.z >= 0.5 * size.z)
+    p.z -= size.z;
+  while (p.z < -0.5 * size.z)
+    p.z += size.z;
   return p;
 }
 
@@ -1801,7 +4499,7 @@ material_type material_of_unshifted_point_in_tree_inobject(vector3 p, geom_box_t
   }
   else {
     *inobject = 0;
-    return default_material;
+    return CTX(default_material);
   }
 }
 
@@ -1827,6 +4525,315 @@ geom_box_tree geom_tree_search(vector3 p, geom_box_tree t, int *oindex) {
 
 /**************************************************************************/
 
+/* Batched tree searches: rather than searching the tree separately for
+   each point, we search it for blocks of GEOM_POINT_BLOCK points at a
+   time, descending into each node only once for all of the points of
+   the block that lie in the node.  At each node, the list of (indices
+   of) points remaining to be searched is filtered by a branch-free loop
+   over the coordinates, which are stored separately ("structure of
+   arrays" style), so that the work per node is proportional to the
+   number of points actually in the node.  Each point gets the same
+   result as tree_search, since it still visits the nodes and objects
+   in the same order.  Blocks are independent, so large batches are
+   split among OpenMP threads (if compiled with OpenMP). */
+
+#define GEOM_POINT_BLOCK 64
+
+/* a list of (indices of) points in a block, along with their bounding box */
+typedef struct {
+  int n, k[GEOM_POINT_BLOCK];
+  geom_box b;
+} point_list;
+
+static void point_list_bounds(point_list *l, const double *x, const double *y, const double *z) {
+  int j;
+  l->b.low.x = l->b.low.y = l->b.low.z = HUGE_VAL;
+  l->b.high.x = l->b.high.y = l->b.high.z = -HUGE_VAL;
+  for (j = 0; j < l->n; ++j) {
+    int k = l->k[j];
+    l->b.low.x = MIN(l->b.low.x, x[k]);
+    l->b.high.x = MAX(l->b.high.x, x[k]);
+    l->b.low.y = MIN(l->b.low.y, y[k]);
+    l->b.high.y = MAX(l->b.high.y, y[k]);
+    l->b.low.z = MIN(l->b.low.z, z[k]);
+    l->b.high.z = MAX(l->b.high.z, z[k]);
+  }
+}
+
+/* return the list of the points of l that are in b: either l itself, if
+   all of them are (as is often the case for blocks of nearby points),
+   or *in, or NULL if there are none. */
+static point_list *points_in_box(const geom_box *b, const double *x, const double *y,
+                                 const double *z, point_list *l, point_list *in) {
+  const double xlo = b->low.x, ylo = b->low.y, zlo = b->low.z;
+  const double xhi = b->high.x, yhi = b->high.y, zhi = b->high.z;
+  int j, count = 0;
+
+  if (!l->n || !geom_boxes_intersect(b, &l->b)) return NULL;
+  if (geom_box_contains_point(b, l->b.low) && geom_box_contains_point(b, l->b.high)) return l;
+  for (j = 0; j < l->n; ++j) {
+    int k = l->k[j];
+    in->k[count] = k;
+    count += (x[k] >= xlo) & (x[k] <= xhi) & (y[k] >= ylo) & (y[k] <= yhi) & (z[k] >= zlo) &
+             (z[k] <= zhi);
+  }
+  if (!(in->n = count)) return NULL;
+  point_list_bounds(in, x, y, z);
+  return in;
+}
+
+/* remove the points that have been found (hits[k] != NULL) from l */
+static void point_list_remove_found(point_list *l, const geom_box_object **hits, const double *x,
+                                    const double *y, const double *z) {
+  int j, n0 = l->n;
+  for (j = l->n = 0; j < n0; ++j) {
+    l->k[l->n] = l->k[j];
+    l->n += hits[l->k[j]] == NULL;
+  }
+  if (l->n < n0) point_list_bounds(l, x, y, z);
+}
+
+/* search t for the points in l, setting hits[k] to the object containing
+   point k (if any, otherwise hits[k] is left NULL), and removing the
+   points that were found from l.  Returns the number of points found. */
+static int tree_search_points(geom_box_tree t, const double *x, const double *y, const double *z,
+                              point_list *l, const geom_box_object **hits) {
+  point_list in0, inobj0, *in, *inobj;
+  int i, j, nfound = 0;
+
+  if (!t || !(in = points_in_box(&t->b, x, y, z, l, &in0))) return 0;
+
+  for (i = 0; i < t->nobjects && in->n; ++i) {
+    const geom_box_object *gbo = t->objects + i;
+    const geom_object_query *q = t->compiled ? t->compiled->queries + (gbo - t->compiled->objects)
+                                             : NULL;
+    int nfound0 = nfound;
+    if (!(inobj = points_in_box(&gbo->box, x, y, z, in, &inobj0))) continue;
+    if (q) { /* gather the shifted points and test them all at once */
+      double xs[GEOM_POINT_BLOCK], ys[GEOM_POINT_BLOCK], zs[GEOM_POINT_BLOCK];
+      boolean inside[GEOM_POINT_BLOCK];
+      for (j = 0; j < inobj->n; ++j) {
+        int k = inobj->k[j];
+        xs[j] = x[k] - gbo->shiftby.x;
+        ys[j] = y[k] - gbo->shiftby.y;
+        zs[j] = z[k] - gbo->shiftby.z;
+      }
+      point_in_object_query_batch(q, xs, ys, zs, inobj->n, inside);
+      for (j = 0; j < inobj->n; ++j)
+        if (inside[j]) {
+          hits[inobj->k[j]] = gbo;
+          ++nfound;
+        }
+    }
+    else
+      for (j = 0; j < inobj->n; ++j) {
+        int k = inobj->k[j];
+        vector3 p;
+        p.x = x[k] - gbo->shiftby.x;
+        p.y = y[k] - gbo->shiftby.y;
+        p.z = z[k] - gbo->shiftby.z;
+        if (point_in_fixed_objectp(p, *gbo->o)) {
+          hits[k] = gbo;
+          ++nfound;
+        }
+      }
+    if (nfound > nfound0) point_list_remove_found(in, hits, x, y, z);
+  }
+
+  nfound += tree_search_points(t->t1, x, y, z, in, hits);
+  nfound += tree_search_points(t->t2, x, y, z, in, hits);
+
+  if (nfound && in != l) point_list_remove_found(l, hits, x, y, z);
+  return nfound;
+}
+
+/* set hits[i] to the object of the tree t containing p[i] (shifted to
+   the unit cell if shift is true), or NULL if none, for i < npoints */
+static void tree_search_all_points(const vector3 *p, int npoints, geom_box_tree t, int shift,
+                                   const geom_box_object **hits) {
+  const geom_context *ctx = geom_current_context;
+  int nblocks = (npoints + GEOM_POINT_BLOCK - 1) / GEOM_POINT_BLOCK;
+  int ib;
+
+#ifdef _OPENMP
+#pragma omp parallel if (nblocks > 1)
+#endif
+  {
+    const geom_context *prev = geom_set_context(ctx); /* as in the calling thread */
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (ib = 0; ib < nblocks; ++ib) {
+      double x[GEOM_POINT_BLOCK], y[GEOM_POINT_BLOCK], z[GEOM_POINT_BLOCK];
+      point_list l;
+      int k, i0 = ib * GEOM_POINT_BLOCK;
+      l.n = MIN(GEOM_POINT_BLOCK, npoints - i0);
+      for (k = 0; k < l.n; ++k) {
+        vector3 pk = shift ? shift_to_unit_cell(p[i0 + k]) : p[i0 + k];
+        x[k] = pk.x;
+        y[k] = pk.y;
+        z[k] = pk.z;
+        l.k[k] = k;
+        hits[i0 + k] = NULL;
+      }
+      point_list_bounds(&l, x, y, z);
+      tree_search_points(t, x, y, z, &l, hits + i0);
+    }
+    geom_set_context(prev);
+  }
+}
+
+/* Batched equivalent of calling material_of_point_in_tree_inobject for
+   each of the npoints points p[i], storing the results in materials[i]
+   and inobject[i] (inobject may be NULL if it is not needed). */
+void material_of_points_in_tree(const vector3 *p, int npoints, geom_box_tree t,
+                                material_type *materials, boolean *inobject) {
+  const geom_box_object **hits = MALLOC(const geom_box_object *, npoints);
+  int i;
+
+  CHECK(hits || npoints == 0, "out of memory");
+  tree_search_all_points(p, npoints, t, 1, hits);
+  for (i = 0; i < npoints; ++i) {
+    materials[i] = hits[i] ? hits[i]->o->material : CTX(default_material);
+    if (inobject) inobject[i] = hits[i] != NULL;
+  }
+  FREE(hits);
+}
+
+/* Batched equivalent of calling object_of_point_in_tree for each of the
+   npoints points p[i], storing the results in objects[i], shiftby[i],
+   and precedence[i] (shiftby and precedence may be NULL if they are not
+   needed).  As for object_of_point_in_tree, the points are not shifted
+   into the unit cell, and objects[i] is NULL for points not in any object. */
+void objects_of_points_in_tree(const vector3 *p, int npoints, geom_box_tree t,
+                               const geometric_object **objects, vector3 *shiftby,
+                               int *precedence) {
+  const geom_box_object **hits = MALLOC(const geom_box_object *, npoints);
+  int i;
+
+  CHECK(hits || npoints == 0, "out of memory");
+  tree_search_all_points(p, npoints, t, 0, hits);
+  for (i = 0; i < npoints; ++i) {
+    objects[i] = hits[i] ? hits[i]->o : NULL;
+    if (shiftby) {
+      if (hits[i])
+        shiftby[i] = hits[i]->shiftby;
+      else
+        shiftby[i].x = shiftby[i].y = shiftby[i].z = 0;
+    }
+    if (precedence) precedence[i] = hits[i] ? hits[i]->precedence : 0;
+  }
+  FREE(hits);
+}
+
+/**************************************************************************/
+
+/* Searching with a geom_box_tree_cursor: when we search for a sequence
+   of nearby points, as when sweeping over a grid, consecutive points
+   usually lie in the same leaf of the tree, so we remember the path to
+   the node where the last point was found (or where the search ended)
+   and start the next search from the deepest node on that path that
+   contains the new point in its interior.  This gives exactly the same
+   result as searching from the root: the children of a node only share
+   the plane that divides them, so a point in the interior of a node
+   cannot be in any node outside its subtree, which therefore contains
+   the first object found by tree_search (provided that the ancestors
+   of the node have no objects of their own, which is always the case
+   for trees made by create_geom_box_tree, so we track this).  The one
+   exception is the shared subtree of a view, whose box may extend
+   beyond the view's, so we never restart below the root of a view.
+
+   For the same reason, we still scan the objects of the last leaf from
+   the beginning, rather than starting with the object found for the
+   previous point: a point in the last object may also be in an earlier
+   object of the leaf, which takes precedence.  Since the leaf's objects
+   are tested first against their bounding boxes, this costs little.
+
+   A cursor is not thread-safe, but each thread may use its own. */
+
+void geom_box_tree_cursor_init(geom_box_tree_cursor *c, geom_box_tree t) {
+  c->t = t;
+  c->depth = -1;
+}
+
+/* like geom_box_contains_point, but excluding the boundary of b (except
+   along any axis where b is empty) */
+static int geom_box_interior_contains_point(const geom_box *b, vector3 p) {
+  return ((b->low.x < p.x && p.x < b->high.x) || (b->low.x == b->high.x && p.x == b->low.x)) &&
+         ((b->low.y < p.y && p.y < b->high.y) || (b->low.y == b->high.y && p.y == b->low.y)) &&
+         ((b->low.z < p.z && p.z < b->high.z) || (b->low.z == b->high.z && p.z == b->low.z));
+}
+
+/* as tree_search(p, t, oindex) with *oindex == 0, where t is at the
+   given depth of the cursor path, recording the path to the last node
+   visited in c */
+static geom_box_tree cursor_tree_search(vector3 p, geom_box_tree_cursor *c, geom_box_tree t,
+                                        int depth, int *oindex) {
+  geom_box_tree gbt;
+  int i;
+
+  if (!t || !geom_box_contains_point(&t->b, p)) return NULL;
+  if (depth == GEOM_BOX_TREE_CURSOR_DEPTH) { /* path is full, so stop recording */
+    *oindex = 0;
+    return tree_search(p, t, oindex);
+  }
+
+  c->path[depth] = t;
+  c->skippable[depth] = depth == 0 || (c->skippable[depth - 1] && !c->path[depth - 1]->nobjects &&
+                                       !c->path[depth - 1]->view_of);
+  c->depth = depth;
+
+  for (i = 0; i < t->nobjects; ++i)
+    if (geom_box_contains_point(&t->objects[i].box, p) && point_in_node_object(p, t, i)) {
+      *oindex = i;
+      return t;
+    }
+
+  gbt = cursor_tree_search(p, c, t->t1, depth + 1, oindex);
+  if (!gbt) gbt = cursor_tree_search(p, c, t->t2, depth + 1, oindex);
+  return gbt;
+}
+
+/* Equivalent to geom_tree_search(p, c->t, oindex), but faster if p is
+   close to the point of the previous search with the cursor c. */
+geom_box_tree geom_tree_search_cursor(vector3 p, geom_box_tree_cursor *c, int *oindex) {
+  int depth = c->depth;
+
+  while (depth >= 0 &&
+         !(c->skippable[depth] && geom_box_interior_contains_point(&c->path[depth]->b, p)))
+    --depth;
+  return cursor_tree_search(p, c, depth >= 0 ? c->path[depth] : c->t, MAX(depth, 0), oindex);
+}
+
+/* equivalent to object_of_point_in_tree(p, c->t, shiftby, precedence) */
+const geometric_object *object_of_point_in_tree_cursor(vector3 p, geom_box_tree_cursor *c,
+                                                       vector3 *shiftby, int *precedence) {
+  int oindex;
+  geom_box_tree t = geom_tree_search_cursor(p, c, &oindex);
+  if (t) {
+    geom_box_object *gbo = t->objects + oindex;
+    *shiftby = gbo->shiftby;
+    *precedence = gbo->precedence;
+    return gbo->o;
+  }
+  else {
+    shiftby->x = shiftby->y = shiftby->z = 0;
+    *precedence = 0;
+    return 0;
+  }
+}
+
+/* equivalent to material_of_point_in_tree_inobject(p, c->t, inobject) */
+material_type material_of_point_in_tree_cursor(vector3 p, geom_box_tree_cursor *c,
+                                               boolean *inobject) {
+  int oindex;
+  geom_box_tree t = geom_tree_search_cursor(shift_to_unit_cell(p), c, &oindex);
+  *inobject = t != NULL;
+  return t ? t->objects[oindex].o->material : CTX(default_material);
+}
+
+/**************************************************************************/
+
 /* convert a vector p in the given object to some coordinate
    in [0,1]^3 that is a more "natural" map of the object interior. */
 vector3 to_geom_box_coords(vector3 p, geom_box_object *gbo) {
@@ -1835,6 +4842,699 @@ vector3 to_geom_box_coords(vector3 p, geom_box_object *gbo) {
 
 /**************************************************************************/
 
+/* A line_sweep divides a line p + s*d, a <= s <= b, into segments
+   belonging to the objects of a list of box objects, in order of
+   decreasing precedence (as in the nodes of a geom_box_tree), giving
+   each segment to the first object that contains it, as tree_search
+   would.  The line is intersected once with each object whose bounding
+   box it passes through, and the ends of the interior segments are
+   swept in order, so the cost grows with the number of crossings.
+   Small lines need no memory allocation, since the buffers start out
+   in the line_sweep itself. */
+
+/* an end of an interior segment of the k-th object along a line */
+typedef struct {
+  double s;
+  int k, inside;
+} line_event;
+
+/* the segment s0 <= s <= s1 of a line belongs to the k-th object
+   (k == nobjects for the default material) */
+typedef struct {
+  double s0, s1;
+  int k;
+} line_segment;
+
+#define LINE_SWEEP_BUF 32
+
+typedef struct {
+  const geom_box_object *objects;
+  int nobjects;
+  double *slist;
+  int slist_len;
+  line_event *events;
+  int nevents_max;
+  line_segment *segments;
+  int nsegments_max;
+  int *inside;
+  double slist0[LINE_SWEEP_BUF];
+  line_event events0[LINE_SWEEP_BUF];
+  line_segment segments0[LINE_SWEEP_BUF];
+  int inside0[LINE_SWEEP_BUF];
+} line_sweep;
+
+/* return a buffer of n_new elements of the given size with the first
+   n_old elements of buf, which is reallocated unless it is buf0 */
+static void *grow_buffer(void *buf, const void *buf0, int n_old, int n_new, size_t size) {
+  void *p;
+  if (buf == buf0) {
+    p = malloc(size * n_new);
+    if (p) memcpy(p, buf, size * n_old);
+  }
+  else
+    p = realloc(buf, size * n_new);
+  CHECK(p, "out of memory");
+  return p;
+}
+
+static void line_sweep_init(line_sweep *ls, const geom_box_object *objects, int nobjects) {
+  ls->objects = objects;
+  ls->nobjects = nobjects;
+  ls->slist = ls->slist0;
+  ls->slist_len = LINE_SWEEP_BUF;
+  ls->events = ls->events0;
+  ls->nevents_max = LINE_SWEEP_BUF;
+  ls->segments = ls->segments0;
+  ls->nsegments_max = LINE_SWEEP_BUF;
+  ls->inside = nobjects < LINE_SWEEP_BUF ? ls->inside0 : (int *)malloc(sizeof(int) * nobjects);
+  CHECK(ls->inside, "out of memory");
+}
+
+static void line_sweep_destroy(line_sweep *ls) {
+  if (ls->inside != ls->inside0) free(ls->inside);
+  if (ls->segments != ls->segments0) free(ls->segments);
+  if (ls->events != ls->events0) free(ls->events);
+  if (ls->slist != ls->slist0) free(ls->slist);
+}
+
+static int line_event_cmp(const void *a, const void *b) {
+  double sa = ((const line_event *)a)->s, sb = ((const line_event *)b)->s;
+  return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+/* the line p + s*d, with the reciprocals of the components of d, for
+   clipping it to many boxes */
+typedef struct {
+  vector3 p, d, dinv;
+} line_clip;
+
+static void line_clip_init(line_clip *lc, vector3 p, vector3 d) {
+  lc->p = p;
+  lc->d = d;
+  lc->dinv.x = d.x != 0 ? 1 / d.x : 0;
+  lc->dinv.y = d.y != 0 ? 1 / d.y : 0;
+  lc->dinv.z = d.z != 0 ? 1 / d.z : 0;
+}
+
+/* clip [*a, *b] to the part of the line inside the box, returning
+   whether it is nonempty */
+static int line_clip_to_box(const line_clip *lc, const geom_box *box, double *a, double *b) {
+  int k;
+  for (k = 0; k < 3; ++k) {
+    double p = VEC_I(lc->p, k), lo = VEC_I(box->low, k), hi = VEC_I(box->high, k);
+    if (VEC_I(lc->d, k) == 0) {
+      if (p < lo || p > hi) return 0;
+    }
+    else {
+      double s0 = (lo - p) * VEC_I(lc->dinv, k), s1 = (hi - p) * VEC_I(lc->dinv, k);
+      if (s0 > s1) {
+        double s = s0;
+        s0 = s1;
+        s1 = s;
+      }
+      if (s0 > *a) *a = s0;
+      if (s1 < *b) *b = s1;
+      if (*a > *b) return 0;
+    }
+  }
+  return 1;
+}
+
+static void line_sweep_add_segment(line_sweep *ls, int *nseg, double s0, double s1, int k) {
+  if (s1 <= s0) return;
+  if (*nseg > 0 && ls->segments[*nseg - 1].k == k && ls->segments[*nseg - 1].s1 == s0) {
+    ls->segments[*nseg - 1].s1 = s1;
+    return;
+  }
+  if (*nseg == ls->nsegments_max) {
+    ls->segments = (line_segment *)grow_buffer(ls->segments, ls->segments0, *nseg, 2 * *nseg,
+                                               sizeof(line_segment));
+    ls->nsegments_max *= 2;
+  }
+  ls->segments[*nseg].s0 = s0;
+  ls->segments[*nseg].s1 = s1;
+  ls->segments[(*nseg)++].k = k;
+}
+
+/* append to the nseg segments in ls->segments those of the line,
+   a <= s <= b, in order, returning the new number of segments; they
+   cover [a, b] (if a < b) without gaps */
+static int line_sweep_run(line_sweep *ls, const line_clip *lc, double a, double b, int nseg) {
+  const int n = ls->nobjects;
+  double s = a;
+  int j, k, ne = 0, owner = n;
+
+  for (k = 0; k < n; ++k) {
+    const geom_box_object *gbo = ls->objects + k;
+    double ak = a, bk = b;
+    int ns;
+    if (!line_clip_to_box(lc, &gbo->box, &ak, &bk)) continue;
+    ns = line_crossings_with_object(gbo->o, vector3_minus(lc->p, gbo->shiftby), lc->d, &ls->slist,
+                                    &ls->slist_len, ls->slist0);
+    if (ne + ns + 1 > ls->nevents_max) {
+      ls->events = (line_event *)grow_buffer(ls->events, ls->events0, ne, 2 * (ne + ns + 1),
+                                             sizeof(line_event));
+      ls->nevents_max = 2 * (ne + ns + 1);
+    }
+    for (j = 0; j < ns; j += 2) {
+      double s0 = fmax(ls->slist[j], a);
+      double s1 = j + 1 < ns ? fmin(ls->slist[j + 1], b) : b;
+      if (s1 <= s0) continue;
+      ls->events[ne].s = s0;
+      ls->events[ne].k = k;
+      ls->events[ne++].inside = 1;
+      ls->events[ne].s = s1;
+      ls->events[ne].k = k;
+      ls->events[ne++].inside = 0;
+    }
+  }
+  if (ne > 16)
+    qsort(ls->events, ne, sizeof(line_event), line_event_cmp);
+  else /* insertion sort, faster for the few crossings of most lines */
+    for (j = 1; j < ne; ++j) {
+      line_event e = ls->events[j];
+      for (k = j; k > 0 && ls->events[k - 1].s > e.s; --k)
+        ls->events[k] = ls->events[k - 1];
+      ls->events[k] = e;
+    }
+
+  memset(ls->inside, 0, sizeof(int) * n);
+  for (j = 0; j < ne; ++j) {
+    const line_event *e = ls->events + j;
+    line_sweep_add_segment(ls, &nseg, s, e->s, owner);
+    s = e->s;
+    ls->inside[e->k] += e->inside ? 1 : -1;
+    if (e->inside) {
+      if (e->k < owner) owner = e->k;
+    }
+    else if (e->k == owner)
+      for (owner = 0; owner < n && ls->inside[owner] <= 0; ++owner)
+        ;
+  }
+  line_sweep_add_segment(ls, &nseg, s, b, owner);
+  return nseg;
+}
+
+/* store in objects (if non-NULL) the box objects of t intersecting b,
+   returning their number (including duplicates from different nodes) */
+static int box_objects_in_tree(geom_box_tree t, const geom_box *b, geom_box_object *objects) {
+  int i, n = 0;
+  if (!t || !geom_boxes_intersect(&t->b, b)) return 0;
+  for (i = 0; i < t->nobjects; ++i)
+    if (geom_boxes_intersect(&t->objects[i].box, b)) {
+      if (objects) objects[n] = t->objects[i];
+      ++n;
+    }
+  n += box_objects_in_tree(t->t1, b, objects ? objects + n : NULL);
+  n += box_objects_in_tree(t->t2, b, objects ? objects + n : NULL);
+  return n;
+}
+
+/* a list of box objects, enlarged as needed, whose buffer starts out in
+   the list itself */
+typedef struct {
+  geom_box_object *objects;
+  int n, nmax;
+  geom_box_object objects0[LINE_SWEEP_BUF];
+} box_object_list;
+
+/* append to l the box objects of t whose boxes the line passes through
+   for a <= s <= b (including duplicates from different nodes) */
+static void line_objects_in_tree(geom_box_tree t, const line_clip *lc, double a, double b,
+                                 box_object_list *l) {
+  int i;
+  if (!t || !line_clip_to_box(lc, &t->b, &a, &b)) return;
+  for (i = 0; i < t->nobjects; ++i) {
+    double ai = a, bi = b;
+    if (line_clip_to_box(lc, &t->objects[i].box, &ai, &bi)) {
+      if (l->n == l->nmax) {
+        l->objects = (geom_box_object *)grow_buffer(l->objects, l->objects0, l->n, 2 * l->n,
+                                                    sizeof(geom_box_object));
+        l->nmax *= 2;
+      }
+      l->objects[l->n++] = t->objects[i];
+    }
+  }
+  line_objects_in_tree(t->t1, lc, a, b, l);
+  line_objects_in_tree(t->t2, lc, a, b, l);
+}
+
+/* sort the box objects in order of decreasing precedence, removing the
+   duplicates of objects split among several nodes, and return their number */
+static int unique_box_objects(geom_box_object *objects, int n) {
+  int i, j;
+  if (n > 16)
+    qsort(objects, n, sizeof(geom_box_object), geom_box_object_qsort_cmp);
+  else
+    for (i = 1; i < n; ++i) {
+      geom_box_object o = objects[i];
+      for (j = i; j > 0 && geom_box_object_cmp(objects + j - 1, &o) > 0; --j)
+        objects[j] = objects[j - 1];
+      objects[j] = o;
+    }
+  for (i = j = 0; i < n; ++i)
+    if (j == 0 || geom_box_object_cmp(objects + j - 1, objects + i)) objects[j++] = objects[i];
+  return j;
+}
+
+/* intersect_line_with_tree: the segments of the line p + s*d,
+   a <= s <= b, in order of increasing s, each belonging to the object
+   found by tree_search at its points (or, with o == NULL, to the default
+   material), so that the segments cover [a, b] without gaps.  Adjacent
+   segments belong to different objects.  The first maxsegments segments
+   are stored in segments, and the number of segments is returned, so
+   that the caller can try again with a larger array if necessary.  As
+   in tree_search, p is not shifted into the unit cell. */
+int intersect_line_with_tree(geom_box_tree t, vector3 p, vector3 d, number a, number b,
+                             geom_line_segment *segments, int maxsegments) {
+  box_object_list l;
+  const geom_box_object *objects;
+  line_sweep ls;
+  line_clip lc;
+  double ta = a, tb = b;
+  int i, n, nseg = 0;
+
+  if (!(a < b)) return 0;
+  line_clip_init(&lc, p, d);
+  /* outside the box of the tree, tree_search finds no objects */
+  if (!t || !line_clip_to_box(&lc, &t->b, &ta, &tb)) ta = tb = b;
+  l.objects = l.objects0;
+  l.n = 0;
+  l.nmax = LINE_SWEEP_BUF;
+  line_objects_in_tree(t, &lc, ta, tb, &l);
+  n = unique_box_objects(l.objects, l.n);
+  objects = l.objects;
+
+  line_sweep_init(&ls, objects, n);
+  line_sweep_add_segment(&ls, &nseg, a, ta, n);
+  if (ta < tb) nseg = line_sweep_run(&ls, &lc, ta, tb, nseg);
+  line_sweep_add_segment(&ls, &nseg, tb, b, n);
+  for (i = 0; i < nseg && i < maxsegments; ++i) {
+    int k = ls.segments[i].k;
+    segments[i].s0 = ls.segments[i].s0;
+    segments[i].s1 = ls.segments[i].s1;
+    if (k < n) {
+      segments[i].o = objects[k].o;
+      segments[i].shiftby = objects[k].shiftby;
+      segments[i].material = objects[k].o->material;
+    }
+    else {
+      segments[i].o = NULL;
+      segments[i].shiftby.x = segments[i].shiftby.y = segments[i].shiftby.z = 0;
+      segments[i].material = CTX(default_material);
+    }
+  }
+  line_sweep_destroy(&ls);
+  if (l.objects != l.objects0) free(l.objects);
+  return nseg;
+}
+
+/**************************************************************************/
+
+/* box_material_fractions_in_tree: the fractions of the box b filled by
+   each object of the tree t (as found by tree_search, i.e. respecting
+   precedence), and by the default material, in a single integration,
+   whose lines are divided among the objects by a line_sweep, so that
+   overlapping objects are not double-counted.
+
+   The box objects intersecting b are stored, in order of decreasing
+   precedence, in fractions[0..n-2], followed by the default material
+   (with o = NULL) in fractions[n-1], where n is the return value; if
+   by_material, entries with the same material are merged into the
+   first of them.  If n > maxfractions, nothing is computed, and the
+   caller should try again with a larger array.  Every fraction is
+   computed to within tol, unless more than maxeval lines would be
+   needed.  As in tree_search, the point p is not shifted into the
+   unit cell, and empty dimensions of b are at b.low. */
+
+typedef struct {
+  line_sweep ls;
+  const geom_box *tb; /* the box of the tree */
+  vector3 p0; /* the lines are p0 + s*dir for a <= s <= b, on their transverse coordinates */
+  vector3 dir;
+  double a, b;
+} fractions_data;
+
+static void fractions_line(line_quadrature *q, const double *t, double *v) {
+  fractions_data *data = (fractions_data *)q->data;
+  double a = data->a, b = data->b;
+  line_clip lc;
+  int i, nseg = 0;
+  line_clip_init(&lc, line_quadrature_point(q, t, data->p0), data->dir);
+  if (line_clip_to_box(&lc, data->tb, &a, &b) && a < b)
+    nseg = line_sweep_run(&data->ls, &lc, a, b, 0);
+  for (i = 0; i < nseg; ++i)
+    if (data->ls.segments[i].k < data->ls.nobjects)
+      v[data->ls.segments[i].k] += data->ls.segments[i].s1 - data->ls.segments[i].s0;
+}
+
+int box_material_fractions_in_tree(geom_box b, geom_box_tree t, number tol, integer maxeval,
+                                   boolean by_material, geom_box_fraction *fractions,
+                                   int maxfractions) {
+  const double blo[3] = {b.low.x, b.low.y, b.low.z}, bhi[3] = {b.high.x, b.high.y, b.high.z};
+  const geom_box *tb = t ? &t->b : &b;
+  fractions_data data;
+  line_quadrature q;
+  geom_box_object *objects, *active;
+  geom_box bb;
+  double bblo[3], bbhi[3], L = 1, W = 1, sum = 0, *v;
+  int i, j, k, n, na, *index, inside = 0, axis = -1;
+
+  n = box_objects_in_tree(t, &b, NULL);
+  objects = MALLOC(geom_box_object, n + 1);
+  n = unique_box_objects(objects, box_objects_in_tree(t, &b, objects));
+
+  if (n + 1 > maxfractions) { /* count the distinct entries */
+    if (by_material)
+      for (i = j = 0; i <= n; ++i) {
+        MATERIAL_TYPE m = i < n ? objects[i].o->material : CTX(default_material);
+        for (k = 0; k < i; ++k)
+          if (!memcmp(&m, &objects[k].o->material, sizeof(MATERIAL_TYPE))) break;
+        j += k == i;
+      }
+    else
+      j = n + 1;
+    if (j > maxfractions) {
+      FREE(objects);
+      return j;
+    }
+  }
+
+  /* only the objects that b is not outside of, down to the first one
+     that contains b, if any, need be integrated; the rest get nothing */
+  active = MALLOC(geom_box_object, n + 1);
+  index = MALLOC(int, n + 1);
+  for (i = na = 0; i < n && !inside; ++i) {
+    geom_box bs = b;
+    geom_box_class c;
+    geom_box_shift(&bs, vector3_scale(-1, objects[i].shiftby));
+    c = classify_box_against_object(bs, *objects[i].o);
+    if (c == GEOM_BOX_OUTSIDE) continue;
+    active[na] = objects[i];
+    index[na++] = i;
+    inside = c == GEOM_BOX_INSIDE;
+  }
+
+  /* integrate only over the part of the cross-section within the
+     bounding boxes of the objects */
+  bb = b;
+  if (na > 0) {
+    bb = active[0].box;
+    for (i = 1; i < na; ++i)
+      geom_box_union(&bb, &bb, &active[i].box);
+  }
+  bblo[0] = fmax(blo[0], bb.low.x);
+  bblo[1] = fmax(blo[1], bb.low.y);
+  bblo[2] = fmax(blo[2], bb.low.z);
+  bbhi[0] = fmin(bhi[0], bb.high.x);
+  bbhi[1] = fmin(bhi[1], bb.high.y);
+  bbhi[2] = fmin(bhi[2], bb.high.z);
+
+  q.ntrans = 0;
+  for (k = 0; k < 3; ++k)
+    if (bhi[k] > blo[k]) {
+      if (axis < 0) {
+        axis = k;
+        L = bhi[k] - blo[k];
+      }
+      else {
+        q.trans[q.ntrans] = k;
+        q.lo[q.ntrans] = bblo[k];
+        q.hi[q.ntrans] = bbhi[k];
+        W *= bhi[k] - blo[k];
+        q.abstol[q.ntrans++] = tol * L * (bhi[k] - blo[k]);
+      }
+    }
+
+  v = (double *)malloc(sizeof(double) * (n + na + 1));
+  CHECK(v, "out of memory");
+  memset(v, 0, sizeof(double) * n);
+  if (axis < 0) { /* a single point */
+    int oindex = 0;
+    geom_box_tree gbt = tree_search(b.low, t, &oindex);
+    const geom_box_object *gbo = gbt ? gbt->objects + oindex : NULL;
+    for (i = 0; i < n; ++i)
+      v[i] = gbo && !geom_box_object_cmp(gbo, objects + i);
+  }
+  else if (inside && na == 1 && geom_box_contains_point(tb, b.low) &&
+           geom_box_contains_point(tb, b.high))
+    v[index[0]] = 1; /* (outside the box of the tree, there are no objects) */
+  else {
+    double *va = v + n;
+    data.p0 = b.low;
+    data.dir.x = data.dir.y = data.dir.z = 0;
+    if (axis == 0) {
+      data.p0.x = 0;
+      data.dir.x = 1;
+    }
+    else if (axis == 1) {
+      data.p0.y = 0;
+      data.dir.y = 1;
+    }
+    else {
+      data.p0.z = 0;
+      data.dir.z = 1;
+    }
+    data.a = blo[axis];
+    data.b = bhi[axis];
+    data.tb = tb;
+    line_sweep_init(&data.ls, active, na);
+
+    q.nv = na;
+    q.maxeval = maxeval;
+    q.line = fractions_line;
+    q.error = line_quadrature_max_error;
+    q.data = &data;
+    for (k = 0; k < q.ntrans && q.lo[k] < q.hi[k]; ++k)
+      ;
+    if (na > 0 && k == q.ntrans) { /* unless no lines pass through the objects */
+      line_quadrature_run(&q, va);
+      for (i = 0; i < na; ++i)
+        v[index[i]] = va[i] / (L * W);
+    }
+    line_sweep_destroy(&data.ls);
+  }
+
+  for (i = j = 0; i <= n; ++i) {
+    geom_box_fraction f;
+    if (i < n) {
+      f.o = objects[i].o;
+      f.shiftby = objects[i].shiftby;
+      f.material = objects[i].o->material;
+      f.fraction = v[i];
+      sum += v[i];
+    }
+    else {
+      f.o = NULL;
+      f.shiftby.x = f.shiftby.y = f.shiftby.z = 0;
+      f.material = CTX(default_material);
+      f.fraction = fmax(0, 1 - sum);
+    }
+    if (by_material) {
+      for (k = 0; k < j; ++k)
+        if (!memcmp(&f.material, &fractions[k].material, sizeof(MATERIAL_TYPE))) break;
+      if (k < j) {
+        fractions[k].fraction += f.fraction;
+        continue;
+      }
+    }
+    fractions[j++] = f;
+  }
+  free(v);
+  FREE(index);
+  FREE(active);
+  FREE(objects);
+  return j;
+}
+
+/**************************************************************************/
+
+/* material_grid_in_tree: the materials of the nx x ny x nz grid of
+   points at the centers of the voxels dividing the unit cell (as for
+   get_grid_size_n), found as by tree_search, stored in materials[(i*ny
+   + j)*nz + k] for voxel (i,j,k); if fractions is not NULL, the fraction
+   of each voxel filled by its material is also stored (to within tol,
+   by box_material_fractions_in_tree with by_material).
+
+   Rather than searching the tree for every point, we recursively divide
+   the grid, as an octree, into regions of voxels, and classify each
+   region against the objects that may overlap it with
+   classify_box_against_object.  A region that lies outside every
+   object, or inside the first object it doesn't lie outside of, is
+   filled in bulk; otherwise it is divided in two along its longest
+   side, and its children need only consider the objects that the
+   region is not outside of (down to the first object containing it,
+   whose precedence hides the rest).  Small regions are searched point
+   by point.  Each top-level region starts with the objects found by
+   descending only the nodes of the tree whose boxes overlap it, and the
+   top-level regions are processed in parallel with OpenMP. */
+
+typedef struct {
+  geom_box_tree t;
+  int n[3];
+  double lo[3], h[3]; /* voxel i spans lo + h*i to lo + h*(i+1) along each axis */
+  MATERIAL_TYPE *materials;
+  number *fractions;
+  number tol;
+  integer maxeval;
+} material_grid_data;
+
+/* the largest regions (in voxels) that are searched point by point,
+   since classifying the objects costs more than a few point tests */
+#define MATERIAL_GRID_POINT_REGION 64
+
+static geom_box material_grid_box(const material_grid_data *d, const int *i0, const int *i1) {
+  geom_box b;
+  b.low.x = d->lo[0] + d->h[0] * i0[0];
+  b.low.y = d->lo[1] + d->h[1] * i0[1];
+  b.low.z = d->lo[2] + d->h[2] * i0[2];
+  b.high.x = d->lo[0] + d->h[0] * i1[0];
+  b.high.y = d->lo[1] + d->h[1] * i1[1];
+  b.high.z = d->lo[2] + d->h[2] * i1[2];
+  return b;
+}
+
+/* the fraction of the voxel b filled by the material m */
+static double material_grid_fraction(const material_grid_data *d, geom_box b, MATERIAL_TYPE m) {
+  geom_box_fraction f0[16], *f = f0;
+  double fraction = 0;
+  int i, n;
+  n = box_material_fractions_in_tree(b, d->t, d->tol, d->maxeval, 1, f, 16);
+  if (n > 16) {
+    f = MALLOC(geom_box_fraction, n);
+    CHECK(f, "out of memory");
+    n = box_material_fractions_in_tree(b, d->t, d->tol, d->maxeval, 1, f, n);
+  }
+  for (i = 0; i < n; ++i)
+    if (!memcmp(&f[i].material, &m, sizeof(MATERIAL_TYPE))) fraction = f[i].fraction;
+  if (f != f0) FREE(f);
+  return fraction;
+}
+
+/* fill the region i0 <= i < i1 of the grid, given the n objects that
+   may overlap it, in order of decreasing precedence */
+static void material_grid_region(const material_grid_data *d, const int *i0, const int *i1,
+                                 const geom_box_object *objects, int n) {
+  const geom_box b = material_grid_box(d, i0, i1);
+  const int nvoxels = (i1[0] - i0[0]) * (i1[1] - i0[1]) * (i1[2] - i0[2]);
+  geom_box_object *active = MALLOC(geom_box_object, n + 1);
+  int i, j, k, na = 0, inside = 0;
+
+  CHECK(active, "out of memory");
+  for (i = 0; i < n && !inside; ++i) {
+    geom_box bs = b;
+    geom_box_class c;
+    if (!geom_boxes_intersect(&b, &objects[i].box)) continue;
+    geom_box_shift(&bs, vector3_scale(-1, objects[i].shiftby));
+    c = classify_box_against_object(bs, *objects[i].o);
+    if (c == GEOM_BOX_OUTSIDE) continue;
+    active[na++] = objects[i];
+    inside = c == GEOM_BOX_INSIDE;
+  }
+
+  if (na == 0 || (inside && na == 1)) { /* a uniform region */
+    MATERIAL_TYPE m = na ? active[0].o->material : CTX(default_material);
+    for (i = i0[0]; i < i1[0]; ++i)
+      for (j = i0[1]; j < i1[1]; ++j)
+        for (k = i0[2]; k < i1[2]; ++k) {
+          size_t ijk = ((size_t)i * d->n[1] + j) * d->n[2] + k;
+          d->materials[ijk] = m;
+          if (d->fractions) d->fractions[ijk] = 1;
+        }
+  }
+  else if (nvoxels == 1 || (!d->fractions && nvoxels <= MATERIAL_GRID_POINT_REGION))
+    for (i = i0[0]; i < i1[0]; ++i)
+      for (j = i0[1]; j < i1[1]; ++j)
+        for (k = i0[2]; k < i1[2]; ++k) {
+          vector3 p;
+          MATERIAL_TYPE m = CTX(default_material);
+          size_t ijk = ((size_t)i * d->n[1] + j) * d->n[2] + k;
+          int l;
+          p.x = d->lo[0] + d->h[0] * (i + 0.5);
+          p.y = d->lo[1] + d->h[1] * (j + 0.5);
+          p.z = d->lo[2] + d->h[2] * (k + 0.5);
+          for (l = 0; l < na; ++l)
+            if (geom_box_contains_point(&active[l].box, p) &&
+                point_in_fixed_objectp(vector3_minus(p, active[l].shiftby), *active[l].o)) {
+              m = active[l].o->material;
+              break;
+            }
+          d->materials[ijk] = m;
+          if (d->fractions) d->fractions[ijk] = material_grid_fraction(d, b, m);
+        }
+  else { /* divide the longest side of the region in two */
+    int axis = 0, c0[3], c1[3];
+    for (i = 1; i < 3; ++i)
+      if ((i1[i] - i0[i]) * d->h[i] > (i1[axis] - i0[axis]) * d->h[axis] && i1[i] - i0[i] > 1)
+        axis = i;
+    if (i1[axis] - i0[axis] < 2) /* (e.g. if the voxels are very anisotropic) */
+      for (axis = 0; i1[axis] - i0[axis] < 2; ++axis)
+        ;
+    for (i = 0; i < 3; ++i) {
+      c0[i] = i0[i];
+      c1[i] = i1[i];
+    }
+    c1[axis] = c0[axis] = (i0[axis] + i1[axis]) / 2;
+    material_grid_region(d, i0, c1, active, na);
+    material_grid_region(d, c0, i1, active, na);
+  }
+  FREE(active);
+}
+
+void material_grid_in_tree(geom_box_tree t, int nx, int ny, int nz, number tol, integer maxeval,
+                           MATERIAL_TYPE *materials, number *fractions) {
+  const geom_context *ctx = geom_current_context;
+  const int n[3] = {nx, ny, nz};
+  material_grid_data d;
+  int nb[3], nblocks, ib, i;
+
+  CHECK(nx > 0 && ny > 0 && nz > 0, "invalid grid size in material_grid_in_tree");
+  d.t = t;
+  d.materials = materials;
+  d.fractions = fractions;
+  d.tol = tol;
+  d.maxeval = maxeval;
+  for (i = 0; i < 3; ++i) {
+    d.n[i] = n[i];
+    d.h[i] = VEC_I(CTX(geometry_lattice).size, i) / n[i];
+    d.lo[i] = -0.5 * VEC_I(CTX(geometry_lattice).size, i);
+    nb[i] = MIN(n[i], 4); /* the top-level regions */
+  }
+  nblocks = nb[0] * nb[1] * nb[2];
+#ifdef _OPENMP
+#pragma omp parallel if (nblocks > 1)
+#endif
+  {
+    const geom_context *prev = geom_set_context(ctx); /* as in the calling thread */
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+    for (ib = 0; ib < nblocks; ++ib) {
+      geom_box_object *objects;
+      geom_box rb;
+      int b[3], i0[3], i1[3], k, nobjects;
+      b[0] = ib / (nb[1] * nb[2]);
+      b[1] = (ib / nb[2]) % nb[1];
+      b[2] = ib % nb[2];
+      for (k = 0; k < 3; ++k) {
+        i0[k] = (int)((long)n[k] * b[k] / nb[k]);
+        i1[k] = (int)((long)n[k] * (b[k] + 1) / nb[k]);
+      }
+      /* only the objects in the nodes of the tree overlapping the region */
+      rb = material_grid_box(&d, i0, i1);
+      nobjects = box_objects_in_tree(t, &rb, NULL);
+      objects = MALLOC(geom_box_object, nobjects + 1);
+      CHECK(objects, "out of memory");
+      nobjects = unique_box_objects(objects, box_objects_in_tree(t, &rb, objects));
+      material_grid_region(&d, i0, i1, objects, nobjects);
+      FREE(objects);
+    }
+    geom_set_context(prev);
+  }
+}
+
+/**************************************************************************/
+
 void display_geom_box_tree(int indentby, geom_box_tree t) {
   int i;
 
@@ -1875,6 +5575,42 @@ void geom_box_tree_stats(geom_box_tree t, int *depth, int *nobjects) {
   get_tree_stats(t, depth, nobjects);
 }
 
+/* helper function for geom_box_tree_stats_cost: the expected cost of
+   searching t for a query point uniformly distributed in b0, i.e. the sum
+   over the nodes of the probability of visiting the node times the cost
+   of visiting it and of testing its objects' bounding boxes.  (Dimensions
+   beyond the dimensionality of the geometry, or empty in b0, are ignored.) */
+static double get_tree_cost(geom_box_tree t, const geom_box *b0) {
+  double prob = 1;
+  int j;
+
+  if (!t) return 0;
+  for (j = 0; j < CTX(dimensions); ++j) {
+    double L0 = VEC_I(b0->high, j) - VEC_I(b0->low, j);
+    if (L0 > 0) prob *= (VEC_I(t->b.high, j) - VEC_I(t->b.low, j)) / L0;
+  }
+  return prob * (GEOM_BOX_TREE_SAH_TRAVERSAL_COST + t->nobjects) + get_tree_cost(t->t1, b0) +
+         get_tree_cost(t->t2, b0);
+}
+
+/* Like geom_box_tree_stats, but also returns the expected cost of a
+   search for a point uniformly distributed in the tree's bounding box,
+   in units of object bounding-box tests (counting each node visited as
+   GEOM_BOX_TREE_SAH_TRAVERSAL_COST tests).  This is the quantity that the
+   GEOM_BOX_TREE_SAH builder minimizes, and is useful for comparing trees
+   built with different geom_box_tree_builder settings. */
+void geom_box_tree_stats_cost(geom_box_tree t, int *depth, int *nobjects, double *cost) {
+  geom_box_tree_stats(t, depth, nobjects);
+  *cost = t ? get_tree_cost(t, &t->b) : 0;
+}
+
+/* Return whether t should be rebalanced, because its expected search
+   cost (see geom_box_tree_stats_cost) exceeds max_ratio times cost0,
+   typically the cost of the tree when it was created. */
+boolean geom_box_tree_needs_rebalance(geom_box_tree t, double cost0, double max_ratio) {
+  return t && get_tree_cost(t, &t->b) > max_ratio * cost0;
+}
+
 /**************************************************************************/
 
 #ifndef LIBCTLGEOM
@@ -2016,6 +5752,17 @@ static void mesh_triangle_vertices(const mesh *m, int face_id,
   *v2 = m->vertices.items[mesh_priv(m)->face_indices[3 * face_id + 2]];
 }
 
+/* The outward unit normal of a face (unnormalized if the face is
+   degenerate), as cached by init_mesh unless the mesh is compact. */
+static vector3 mesh_face_normal(const mesh *m, int face_id) {
+  vector3 v0, v1, v2;
+  mesh_triangle_vertices(m, face_id, &v0, &v1, &v2);
+  vector3 n = vector3_cross(vector3_minus(v1, v0), vector3_minus(v2, v0));
+  double len = vector3_norm(n);
+  double area_eps = 1e-20 * mesh_priv(m)->lengthscale * mesh_priv(m)->lengthscale;
+  return (len > area_eps) ? vector3_scale(1.0 / len, n) : n;
+}
+
 /* Compute the AABB of a single triangle. */
 static void mesh_triangle_bbox(const mesh *m, int face_id, geom_box *box) {
   vector3 v0, v1, v2;
@@ -2028,17 +5775,6 @@ static void mesh_triangle_bbox(const mesh *m, int face_id, geom_box *box) {
   box->high.z = fmax(v0.z, fmax(v1.z, v2.z));
 }
 
-/* Compute the centroid of a triangle. */
-static vector3 mesh_triangle_centroid(const mesh *m, int face_id) {
-  vector3 v0, v1, v2;
-  mesh_triangle_vertices(m, face_id, &v0, &v1, &v2);
-  vector3 c;
-  c.x = (v0.x + v1.x + v2.x) / 3.0;
-  c.y = (v0.y + v1.y + v2.y) / 3.0;
-  c.z = (v0.z + v1.z + v2.z) / 3.0;
-  return c;
-}
-
 /* Compute the AABB and centroid of a triangle in one pass. */
 static void mesh_triangle_bbox_centroid(const mesh *m, int face_id,
                                         geom_box *box, vector3 *centroid) {
@@ -2070,73 +5806,126 @@ static double geom_box_surface_area(const geom_box *b) {
 #define MESH_BVH_MAX_LEAF_SIZE 4
 #define MESH_BVH_NUM_BINS 12
 
-/* Recursive BVH build. Returns the index of the root node for this subtree.
-   face_ids[start..start+count-1] are the faces in this node. */
-static int mesh_bvh_build(mesh *m, int *face_ids, int start, int count,
-                          mesh_bvh_node *nodes, int *num_nodes) {
-  int node_idx = (*num_nodes)++;
-  mesh_bvh_node *node = &nodes[node_idx];
+/* faces per task (or chunk of a loop) when building in parallel */
+#define MESH_BVH_PARALLEL_MIN 16384
+
+/* The bounding box and centroid of each face, computed once before the
+   build rather than from the vertices at every level. */
+typedef struct {
+  geom_box box;
+  vector3 centroid;
+} mesh_bvh_face;
+
+static void mesh_bvh_empty_bins(int bin_counts[3][MESH_BVH_NUM_BINS],
+                                geom_box bin_boxes[3][MESH_BVH_NUM_BINS]) {
+  for (int axis = 0; axis < 3; axis++)
+    for (int b = 0; b < MESH_BVH_NUM_BINS; b++) {
+      bin_counts[axis][b] = 0;
+      bin_boxes[axis][b].low.x = bin_boxes[axis][b].low.y = bin_boxes[axis][b].low.z = 1e300;
+      bin_boxes[axis][b].high.x = bin_boxes[axis][b].high.y = bin_boxes[axis][b].high.z = -1e300;
+    }
+}
+
+/* Merge the bounding box of faces face_ids[start..end-1] into *node_box. */
+static void mesh_bvh_box_chunk(const mesh_bvh_face *faces, const int *face_ids, int start,
+                               int end, geom_box *node_box) {
+  geom_box box = faces[face_ids[start]].box;
+  for (int i = start + 1; i < end; i++)
+    geom_box_union(&box, &box, &faces[face_ids[i]].box);
+#ifdef _OPENMP
+#pragma omp critical(mesh_bvh_chunk)
+#endif
+  geom_box_union(node_box, node_box, &box);
+}
+
+/* Merge the SAH bins, along each axis with extent at least min_extent,
+   of the faces face_ids[start..end-1] into bin_counts and bin_boxes.
+   Counts and box unions don't depend on the order of the faces, so
+   chunks can be binned in parallel with the same result. */
+static void mesh_bvh_bin_chunk(const mesh_bvh_face *faces, const int *face_ids, int start,
+                               int end, const geom_box *node_box, double min_extent,
+                               int bin_counts[3][MESH_BVH_NUM_BINS],
+                               geom_box bin_boxes[3][MESH_BVH_NUM_BINS]) {
+  int counts[3][MESH_BVH_NUM_BINS];
+  geom_box boxes[3][MESH_BVH_NUM_BINS];
+  mesh_bvh_empty_bins(counts, boxes);
+  for (int axis = 0; axis < 3; axis++) {
+    double lo = VEC_I(node_box->low, axis), hi = VEC_I(node_box->high, axis);
+    if (hi - lo < min_extent) continue;
+    double inv_range = MESH_BVH_NUM_BINS / (hi - lo);
+    for (int i = start; i < end; i++) {
+      const mesh_bvh_face *f = &faces[face_ids[i]];
+      int bin = (int)((VEC_I(f->centroid, axis) - lo) * inv_range);
+      if (bin < 0) bin = 0;
+      if (bin >= MESH_BVH_NUM_BINS) bin = MESH_BVH_NUM_BINS - 1;
+      counts[axis][bin]++;
+      geom_box_union(&boxes[axis][bin], &boxes[axis][bin], &f->box);
+    }
+  }
+#ifdef _OPENMP
+#pragma omp critical(mesh_bvh_chunk)
+#endif
+  for (int axis = 0; axis < 3; axis++)
+    for (int b = 0; b < MESH_BVH_NUM_BINS; b++) {
+      bin_counts[axis][b] += counts[axis][b];
+      geom_box_union(&bin_boxes[axis][b], &bin_boxes[axis][b], &boxes[axis][b]);
+    }
+}
+
+/* Choose the SAH split of the node holding faces face_ids[start..start+
+   count-1], setting *node_box to their bounding box, and partition them
+   so that the first faces (the return value) go to the left child;
+   returns 0 if the node should be a leaf.  For large nodes the box and
+   the bins are computed over chunks of the faces as parallel tasks. */
+static int mesh_bvh_split(const mesh *m, const mesh_bvh_face *faces, int *face_ids, int start,
+                          int count, geom_box *node_box) {
+#ifdef _OPENMP
+  int nchunks = count / MESH_BVH_PARALLEL_MIN;
+#endif
+  double min_extent = 1e-15 * mesh_priv(m)->lengthscale;
 
   /* Compute bounding box of all faces in this range. */
-  geom_box face_box, node_box;
-  mesh_triangle_bbox(m, face_ids[start], &face_box);
-  node_box = face_box;
-  for (int i = 1; i < count; i++) {
-    mesh_triangle_bbox(m, face_ids[start + i], &face_box);
-    geom_box_union(&node_box, &node_box, &face_box);
+  *node_box = faces[face_ids[start]].box;
+#ifdef _OPENMP
+  if (nchunks > 1) {
+#pragma omp taskloop
+    for (int c = 0; c < nchunks; c++)
+      mesh_bvh_box_chunk(faces, face_ids, start + (int)((long)count * c / nchunks),
+                         start + (int)((long)count * (c + 1) / nchunks), node_box);
   }
-  bvh_node_set_box(node, &node_box);
+  else
+#endif
+    mesh_bvh_box_chunk(faces, face_ids, start, start + count, node_box);
 
   /* Leaf node if few enough faces. */
-  if (count <= MESH_BVH_MAX_LEAF_SIZE) {
-    node->left_child = -1;
-    node->right_child = -1;
-    node->face_start = start;
-    node->face_count = count;
-    return node_idx;
+  if (count <= MESH_BVH_MAX_LEAF_SIZE) return 0;
+
+  /* Bin face centroids along all three axes. */
+  int bin_counts[3][MESH_BVH_NUM_BINS];
+  geom_box bin_boxes[3][MESH_BVH_NUM_BINS];
+  mesh_bvh_empty_bins(bin_counts, bin_boxes);
+#ifdef _OPENMP
+  if (nchunks > 1) {
+#pragma omp taskloop shared(bin_counts, bin_boxes)
+    for (int c = 0; c < nchunks; c++)
+      mesh_bvh_bin_chunk(faces, face_ids, start + (int)((long)count * c / nchunks),
+                         start + (int)((long)count * (c + 1) / nchunks), node_box, min_extent,
+                         bin_counts, bin_boxes);
   }
+  else
+#endif
+    mesh_bvh_bin_chunk(faces, face_ids, start, start + count, node_box, min_extent, bin_counts,
+                       bin_boxes);
 
   /* Find the best split using SAH with binning. */
   double best_cost = 1e300;
   int best_axis = -1, best_split = -1;
-  double parent_area = geom_box_surface_area(&node_box);
+  double parent_area = geom_box_surface_area(node_box);
   if (parent_area == 0) parent_area = 1e-30 * mesh_priv(m)->lengthscale * mesh_priv(m)->lengthscale;
 
   for (int axis = 0; axis < 3; axis++) {
-    double lo, hi;
-    switch (axis) {
-      case 0: lo = node_box.low.x; hi = node_box.high.x; break;
-      case 1: lo = node_box.low.y; hi = node_box.high.y; break;
-      default: lo = node_box.low.z; hi = node_box.high.z; break;
-    }
-    if (hi - lo < 1e-15 * mesh_priv(m)->lengthscale) continue;
-
-    /* Bin face centroids. */
-    int bin_counts[MESH_BVH_NUM_BINS];
-    geom_box bin_boxes[MESH_BVH_NUM_BINS];
-    for (int b = 0; b < MESH_BVH_NUM_BINS; b++) {
-      bin_counts[b] = 0;
-      bin_boxes[b].low.x = bin_boxes[b].low.y = bin_boxes[b].low.z = 1e300;
-      bin_boxes[b].high.x = bin_boxes[b].high.y = bin_boxes[b].high.z = -1e300;
-    }
-
-    double inv_range = MESH_BVH_NUM_BINS / (hi - lo);
-    for (int i = 0; i < count; i++) {
-      geom_box fb;
-      vector3 c;
-      mesh_triangle_bbox_centroid(m, face_ids[start + i], &fb, &c);
-      double val;
-      switch (axis) {
-        case 0: val = c.x; break;
-        case 1: val = c.y; break;
-        default: val = c.z; break;
-      }
-      int bin = (int)((val - lo) * inv_range);
-      if (bin < 0) bin = 0;
-      if (bin >= MESH_BVH_NUM_BINS) bin = MESH_BVH_NUM_BINS - 1;
-      bin_counts[bin]++;
-      geom_box_union(&bin_boxes[bin], &bin_boxes[bin], &fb);
-    }
+    double lo = VEC_I(node_box->low, axis), hi = VEC_I(node_box->high, axis);
+    if (hi - lo < min_extent) continue;
 
     /* Sweep from left to evaluate SAH cost at each split. */
     geom_box left_box;
@@ -2153,9 +5942,9 @@ static int mesh_bvh_build(mesh *m, int *face_ids, int start, int count,
       rb.high.x = rb.high.y = rb.high.z = -1e300;
       int rc = 0;
       for (int b = MESH_BVH_NUM_BINS - 1; b >= 0; b--) {
-        if (bin_counts[b] > 0) {
-          geom_box_union(&rb, &rb, &bin_boxes[b]);
-          rc += bin_counts[b];
+        if (bin_counts[axis][b] > 0) {
+          geom_box_union(&rb, &rb, &bin_boxes[axis][b]);
+          rc += bin_counts[axis][b];
         }
         right_boxes[b] = rb;
         right_counts[b] = rc;
@@ -2164,9 +5953,9 @@ static int mesh_bvh_build(mesh *m, int *face_ids, int start, int count,
 
     for (int split = 1; split < MESH_BVH_NUM_BINS; split++) {
       int b = split - 1;
-      if (bin_counts[b] > 0) {
-        geom_box_union(&left_box, &left_box, &bin_boxes[b]);
-        left_count += bin_counts[b];
+      if (bin_counts[axis][b] > 0) {
+        geom_box_union(&left_box, &left_box, &bin_boxes[axis][b]);
+        left_count += bin_counts[axis][b];
       }
       if (left_count == 0 || right_counts[split] == 0) continue;
 
@@ -2182,31 +5971,14 @@ static int mesh_bvh_build(mesh *m, int *face_ids, int start, int count,
   }
 
   /* If no good split found, make a leaf. */
-  if (best_axis < 0) {
-    node->left_child = -1;
-    node->right_child = -1;
-    node->face_start = start;
-    node->face_count = count;
-    return node_idx;
-  }
+  if (best_axis < 0) return 0;
 
   /* Partition face_ids by the best split. */
-  double lo, hi;
-  switch (best_axis) {
-    case 0: lo = node_box.low.x; hi = node_box.high.x; break;
-    case 1: lo = node_box.low.y; hi = node_box.high.y; break;
-    default: lo = node_box.low.z; hi = node_box.high.z; break;
-  }
+  double lo = VEC_I(node_box->low, best_axis), hi = VEC_I(node_box->high, best_axis);
   double inv_range = MESH_BVH_NUM_BINS / (hi - lo);
   int left_end = start;
   for (int i = start; i < start + count; i++) {
-    vector3 c = mesh_triangle_centroid(m, face_ids[i]);
-    double val;
-    switch (best_axis) {
-      case 0: val = c.x; break;
-      case 1: val = c.y; break;
-      default: val = c.z; break;
-    }
+    double val = VEC_I(faces[face_ids[i]].centroid, best_axis);
     int bin = (int)((val - lo) * inv_range);
     if (bin < 0) bin = 0;
     if (bin >= MESH_BVH_NUM_BINS) bin = MESH_BVH_NUM_BINS - 1;
@@ -2220,54 +5992,318 @@ static int mesh_bvh_build(mesh *m, int *face_ids, int start, int count,
 
   /* Handle degenerate partition. */
   int left_count_final = left_end - start;
-  if (left_count_final == 0 || left_count_final == count) {
-    left_count_final = count / 2;
-    left_end = start + left_count_final;
+  if (left_count_final == 0 || left_count_final == count) left_count_final = count / 2;
+  return left_count_final;
+}
+
+/* Recursive BVH build. Returns the index of the root node for this subtree.
+   face_ids[start..start+count-1] are the faces in this node. */
+static int mesh_bvh_build(const mesh *m, const mesh_bvh_face *faces, int *face_ids, int start,
+                          int count, mesh_bvh_node *nodes, int *num_nodes) {
+  int node_idx = (*num_nodes)++;
+  geom_box node_box;
+  int left_count = mesh_bvh_split(m, faces, face_ids, start, count, &node_box);
+  mesh_bvh_node *node = &nodes[node_idx];
+  bvh_node_set_box(node, &node_box);
+
+  if (left_count == 0) {
+    node->left_child = -1;
+    node->right_child = -1;
+    node->face_start = start;
+    node->face_count = count;
+    return node_idx;
   }
 
   node->face_start = -1;
   node->face_count = 0;
-  node->left_child = mesh_bvh_build(m, face_ids, start, left_count_final, nodes, num_nodes);
+  node->left_child = mesh_bvh_build(m, faces, face_ids, start, left_count, nodes, num_nodes);
   /* Re-fetch node pointer since array may have been indexed differently. */
   node = &nodes[node_idx];
-  node->right_child = mesh_bvh_build(m, face_ids, left_end, count - left_count_final, nodes, num_nodes);
+  node->right_child =
+      mesh_bvh_build(m, faces, face_ids, start + left_count, count - left_count, nodes, num_nodes);
   return node_idx;
 }
 
+/* As mesh_bvh_build, but building the two subtrees of large nodes as
+   parallel tasks.  Since their sizes aren't known in advance, the
+   subtree of a node at index base, with count faces, is stored in the
+   2*count - 1 slots from base (the most it can need): its left subtree
+   from base+1 and its right subtree from base+2*left_count, leaving
+   gaps that mesh_bvh_compact removes. */
+static void mesh_bvh_build_tasks(const mesh *m, const mesh_bvh_face *faces, int *face_ids,
+                                 int start, int count, mesh_bvh_node *nodes, int base) {
+  if (count < MESH_BVH_PARALLEL_MIN) {
+    int num_nodes = base;
+    mesh_bvh_build(m, faces, face_ids, start, count, nodes, &num_nodes);
+    return;
+  }
+
+  geom_box node_box;
+  int left_count = mesh_bvh_split(m, faces, face_ids, start, count, &node_box);
+  mesh_bvh_node *node = &nodes[base];
+  bvh_node_set_box(node, &node_box);
+
+  if (left_count == 0) {
+    node->left_child = -1;
+    node->right_child = -1;
+    node->face_start = start;
+    node->face_count = count;
+    return;
+  }
+
+  node->face_start = -1;
+  node->face_count = 0;
+  node->left_child = base + 1;
+  node->right_child = base + 2 * left_count;
+#ifdef _OPENMP
+#pragma omp task
+#endif
+  mesh_bvh_build_tasks(m, faces, face_ids, start, left_count, nodes, base + 1);
+  mesh_bvh_build_tasks(m, faces, face_ids, start + left_count, count - left_count, nodes,
+                       base + 2 * left_count);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+}
+
+/* Move the subtree at index b of a tree built by mesh_bvh_build_tasks
+   to the depth-first order of mesh_bvh_build, in place (each node moves
+   down, past nodes already moved); returns its new index. */
+static int mesh_bvh_compact(mesh_bvh_node *nodes, int b, int *num_nodes) {
+  mesh_bvh_node node = nodes[b];
+  int q = (*num_nodes)++;
+  if (node.left_child >= 0) {
+    int right = node.right_child;
+    node.left_child = mesh_bvh_compact(nodes, node.left_child, num_nodes);
+    node.right_child = mesh_bvh_compact(nodes, right, num_nodes);
+  }
+  nodes[q] = node;
+  return q;
+}
+
+/* The number of nodes on the longest path from node b to a leaf. */
+static int mesh_bvh_depth(const mesh_bvh_node *nodes, int b) {
+  if (nodes[b].left_child < 0) return 1;
+  int left = mesh_bvh_depth(nodes, nodes[b].left_child);
+  int right = mesh_bvh_depth(nodes, nodes[b].right_child);
+  return 1 + MAX(left, right);
+}
+
+/***************************************************************/
+/* Collapsing the binary BVH into a 4-wide BVH                 */
+/***************************************************************/
+
+/* if nonzero (the default), init_mesh also builds the 4-wide BVH */
+int geom_mesh_qbvh = 1;
+
+/* Store the subtree of the binary node b as the 4-wide node q: its
+   children are found by repeatedly opening the inner node of largest
+   surface area among b's descendants (up to four), so that the wide
+   tree keeps the SAH build's partitions.  Nodes are stored in
+   depth-first order; returns q. */
+static int mesh_qbvh_collapse(const mesh_internal *mi, int b, mesh_qbvh_node *qnodes,
+                              int *num_qnodes) {
+  int q = (*num_qnodes)++;
+  int kids[MESH_QBVH_WIDTH], nkids = 0;
+
+  if (mi->bvh[b].left_child < 0) /* a leaf root */
+    kids[nkids++] = b;
+  else {
+    kids[nkids++] = mi->bvh[b].left_child;
+    kids[nkids++] = mi->bvh[b].right_child;
+  }
+  while (nkids < MESH_QBVH_WIDTH) {
+    int best = -1;
+    double best_area = -1;
+    for (int i = 0; i < nkids; i++) {
+      const mesh_bvh_node *node = &mi->bvh[kids[i]];
+      if (node->left_child >= 0) {
+        geom_box box;
+        box.low = node->bbox_low;
+        box.high = node->bbox_high;
+        double area = geom_box_surface_area(&box);
+        if (area > best_area) {
+          best_area = area;
+          best = i;
+        }
+      }
+    }
+    if (best < 0) break;
+    kids[nkids++] = mi->bvh[kids[best]].right_child;
+    kids[best] = mi->bvh[kids[best]].left_child;
+  }
+
+  for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+    mesh_qbvh_node *qn = &qnodes[q];
+    if (i < nkids) {
+      const mesh_bvh_node *node = &mi->bvh[kids[i]];
+      for (int a = 0; a < 3; a++) {
+        qn->bbox_low[a][i] = VEC_I(node->bbox_low, a);
+        qn->bbox_high[a][i] = VEC_I(node->bbox_high, a);
+      }
+      qn->face_start[i] = node->face_start;
+      qn->face_count[i] = node->face_count;
+      qn->child[i] = node->left_child < 0 ? -1 : mesh_qbvh_collapse(mi, kids[i], qnodes, num_qnodes);
+    }
+    else { /* an empty box, at infinite distance from any point */
+      for (int a = 0; a < 3; a++) {
+        qn->bbox_low[a][i] = HUGE_VAL;
+        qn->bbox_high[a][i] = -HUGE_VAL;
+      }
+      qn->child[i] = -1;
+      qn->face_start[i] = qn->face_count[i] = 0;
+    }
+  }
+  return q;
+}
+
+/* The number of nodes on the longest path from node q to a leaf. */
+static int mesh_qbvh_depth(const mesh_qbvh_node *qnodes, int q) {
+  int depth = 0;
+  for (int i = 0; i < MESH_QBVH_WIDTH; i++)
+    if (qnodes[q].child[i] >= 0) {
+      int d = mesh_qbvh_depth(qnodes, qnodes[q].child[i]);
+      depth = MAX(depth, d);
+    }
+  return 1 + depth;
+}
+
 /***************************************************************/
-/* Ray-triangle intersection (Moller-Trumbore)                 */
+/* Quantizing the binary BVH for compact meshes                */
 /***************************************************************/
 
-#define MESH_BARY_EPS 1e-10
+/* if nonzero (default 0), init_mesh stores meshes compactly */
+int geom_mesh_compact = 0;
+
+/* The coordinate q/MESH_CBVH_QMAX of the way from lo to hi. */
+static double mesh_cbvh_dequantize(double lo, double hi, int q) {
+  return q == MESH_CBVH_QMAX ? hi : lo + (hi - lo) * (q / (double)MESH_CBVH_QMAX);
+}
+
+/* The box of child i of a quantized node whose own box is *box. */
+static void mesh_cbvh_child_box(const geom_box *box, const mesh_cbvh_node *node, int i,
+                                geom_box *child) {
+  child->low.x = mesh_cbvh_dequantize(box->low.x, box->high.x, node->bbox_low[i][0]);
+  child->low.y = mesh_cbvh_dequantize(box->low.y, box->high.y, node->bbox_low[i][1]);
+  child->low.z = mesh_cbvh_dequantize(box->low.z, box->high.z, node->bbox_low[i][2]);
+  child->high.x = mesh_cbvh_dequantize(box->low.x, box->high.x, node->bbox_high[i][0]);
+  child->high.y = mesh_cbvh_dequantize(box->low.y, box->high.y, node->bbox_high[i][1]);
+  child->high.z = mesh_cbvh_dequantize(box->low.z, box->high.z, node->bbox_high[i][2]);
+}
+
+/* Store the subtree of the binary node b, whose box as seen by the
+   traversal is *box, in the quantized BVH, returning its child code.
+   Each quantized child box is checked against the dequantized value and
+   widened if roundoff made it smaller than the binary one, so that it
+   always contains the child's faces. */
+static int mesh_cbvh_quantize(mesh_internal *mi, int b, const geom_box *box, mesh_cbvh_node *nodes,
+                              int *num_nodes) {
+  const mesh_bvh_node *node = &mi->bvh[b];
+  if (node->left_child < 0) {
+    int last = node->face_start + node->face_count - 1;
+    mi->bvh_face_ids[last] = ~mi->bvh_face_ids[last];
+    return -1 - node->face_start;
+  }
 
-/* Test intersection of ray (origin + t * dir) with triangle (v0, v1, v2).
-   Returns 1 if intersection found, with *t_out set to the parameter.
-   det_eps should be ~1e-12 * lengthscale^2 (determinant has area units).
-   Also returns barycentric coords u, v if non-NULL. */
-static int ray_triangle_intersect(vector3 origin, vector3 dir,
-                                  vector3 v0, vector3 v1, vector3 v2,
-                                  double det_eps,
-                                  double *t_out, double *u_out, double *v_out) {
-  vector3 e1 = vector3_minus(v1, v0);
-  vector3 e2 = vector3_minus(v2, v0);
-  vector3 h = vector3_cross(dir, e2);
-  double a = vector3_dot(e1, h);
+  int q = (*num_nodes)++;
+  int kids[2] = {node->left_child, node->right_child};
+  for (int i = 0; i < 2; i++) {
+    const mesh_bvh_node *kid = &mi->bvh[kids[i]];
+    for (int a = 0; a < 3; a++) {
+      double lo = VEC_I(box->low, a), hi = VEC_I(box->high, a);
+      int qlo = 0, qhi = MESH_CBVH_QMAX;
+      if (hi > lo) {
+        double scale = MESH_CBVH_QMAX / (hi - lo);
+        qlo = MAX(0, MIN(MESH_CBVH_QMAX, (int)floor((VEC_I(kid->bbox_low, a) - lo) * scale)));
+        qhi = MAX(0, MIN(MESH_CBVH_QMAX, (int)ceil((VEC_I(kid->bbox_high, a) - lo) * scale)));
+        while (qlo > 0 && mesh_cbvh_dequantize(lo, hi, qlo) > VEC_I(kid->bbox_low, a)) qlo--;
+        while (qhi < MESH_CBVH_QMAX && mesh_cbvh_dequantize(lo, hi, qhi) < VEC_I(kid->bbox_high, a))
+          qhi++;
+      }
+      nodes[q].bbox_low[i][a] = (unsigned short)qlo;
+      nodes[q].bbox_high[i][a] = (unsigned short)qhi;
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    geom_box kid_box;
+    mesh_cbvh_child_box(box, &nodes[q], i, &kid_box);
+    nodes[q].child[i] = mesh_cbvh_quantize(mi, kids[i], &kid_box, nodes, num_nodes);
+  }
+  return q;
+}
 
-  if (fabs(a) < det_eps) return 0;
+/***************************************************************/
+/* Watertight ray-triangle intersection                        */
+/***************************************************************/
 
-  double f = 1.0 / a;
-  vector3 s = vector3_minus(origin, v0);
-  double u = f * vector3_dot(s, h);
-  if (u < -MESH_BARY_EPS || u > 1.0 + MESH_BARY_EPS) return 0;
+/* A ray prepared for the watertight ray-triangle test of Woop, Benthin
+   and Wald (2013): kz is the axis along which dir is largest, and the
+   shear (sx, sy, sz) maps dir onto the z' axis of the permuted axes
+   (kx, ky, kz), so that each triangle is tested in the 2d plane z' = 0,
+   where the ray is the point (0, 0). */
+typedef struct {
+  vector3 origin;
+  int kx, ky, kz;
+  double sx, sy, sz;
+} mesh_ray;
+
+static void mesh_ray_init(mesh_ray *r, vector3 origin, vector3 dir) {
+  double ax = fabs(dir.x), ay = fabs(dir.y), az = fabs(dir.z);
+  r->origin = origin;
+  r->kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+  r->kx = (r->kz + 1) % 3;
+  r->ky = (r->kx + 1) % 3;
+  r->sx = VEC_I(dir, r->kx) / VEC_I(dir, r->kz);
+  r->sy = VEC_I(dir, r->ky) / VEC_I(dir, r->kz);
+  r->sz = 1.0 / VEC_I(dir, r->kz);
+}
+
+/* Test intersection of the ray with triangle face_id of m, returning 1
+   with *t_out set to the parameter along dir if it is hit.
+
+   The edge functions (the signed areas spanned by the ray and each
+   projected edge) are computed with the edge's endpoints in order of
+   vertex index, so the two triangles sharing an edge get exactly
+   opposite values and a ray can't slip between them.  A ray exactly on
+   an edge (edge function zero) is assigned to one side of it, as if it
+   were displaced by (-eps, eps^2) in the projected plane: only the
+   triangle that would then contain it counts the hit.  Every crossing
+   of a closed surface, even through an edge or a vertex, is therefore
+   counted exactly once, and a ray that only touches the surface is
+   counted an even number of times. */
+static int ray_triangle_intersect(const mesh_ray *r, const mesh *m, int face_id, double *t_out) {
+  const int *vi = &mesh_priv(m)->face_indices[3 * face_id];
+  double x[3], y[3], z[3], f[3];
+  int pos = 0, neg = 0;
+
+  for (int k = 0; k < 3; k++) {
+    vector3 a = vector3_minus(m->vertices.items[vi[k]], r->origin);
+    double az = VEC_I(a, r->kz);
+    x[k] = VEC_I(a, r->kx) - r->sx * az;
+    y[k] = VEC_I(a, r->ky) - r->sy * az;
+    z[k] = r->sz * az;
+  }
 
-  vector3 q = vector3_cross(s, e1);
-  double v = f * vector3_dot(dir, q);
-  if (v < -MESH_BARY_EPS || u + v > 1.0 + MESH_BARY_EPS) return 0;
+  /* edge k runs from vertex k to vertex k+1 */
+  for (int k = 0; k < 3; k++) {
+    int j = (k + 1) % 3;
+    f[k] = vi[k] < vi[j] ? x[k] * y[j] - y[k] * x[j] : -(x[j] * y[k] - y[j] * x[k]);
+    pos |= f[k] > 0;
+    neg |= f[k] < 0;
+  }
+  if (pos == neg) return 0; /* outside an edge, or degenerate in projection */
+
+  double sign = pos ? 1 : -1;
+  for (int k = 0; k < 3; k++)
+    if (f[k] == 0) {
+      int j = (k + 1) % 3;
+      double dx = sign * (x[j] - x[k]), dy = sign * (y[j] - y[k]);
+      if (!(dy > 0 || (dy == 0 && dx > 0))) return 0;
+    }
 
-  double t = f * vector3_dot(e2, q);
-  *t_out = t;
-  if (u_out) *u_out = u;
-  if (v_out) *v_out = v;
+  /* interpolate z' at the ray with the barycentric weights f/det */
+  double det = f[0] + f[1] + f[2];
+  *t_out = (f[0] * z[2] + f[1] * z[0] + f[2] * z[1]) / det;
   return 1;
 }
 
@@ -2275,6 +6311,10 @@ static int ray_triangle_intersect(vector3 origin, vector3 dir,
 /* Ray-AABB intersection test                                  */
 /***************************************************************/
 
+/* relative slack in the ray-box tests, well above the roundoff error of
+   the slab parameters */
+#define MESH_BOX_SLACK 1e-12
+
 static int ray_bvh_node_intersect(vector3 origin, vector3 inv_dir, const mesh_bvh_node *node,
                                   double t_min, double t_max) {
   double tx1 = (node->bbox_low.x - origin.x) * inv_dir.x;
@@ -2292,9 +6332,56 @@ static int ray_bvh_node_intersect(vector3 origin, vector3 inv_dir, const mesh_bv
   tmin = fmax(tmin, fmin(tz1, tz2));
   tmax = fmin(tmax, fmax(tz1, tz2));
 
+  /* allow for roundoff, so that a ray grazing the box (e.g. through an
+     edge of a triangle in the box's face) is never culled */
+  tmax += MESH_BOX_SLACK * (fabs(tmin) + fabs(tmax));
   return tmax >= fmax(tmin, t_min) && tmin <= t_max;
 }
 
+/* Test the ray against the four child boxes of a 4-wide node at once,
+   as in ray_bvh_node_intersect for t in (-1e30, 1e30); bit i of the
+   result is set if child i is hit.  The lanes are computed without
+   branches, so that the compiler can vectorize the loops. */
+static int ray_qbvh_node_intersect(const double origin[3], const double inv_dir[3],
+                                   const mesh_qbvh_node *node) {
+  double tmin[MESH_QBVH_WIDTH], tmax[MESH_QBVH_WIDTH];
+  int hits = 0;
+
+  for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+    tmin[i] = -1e30;
+    tmax[i] = 1e30;
+  }
+  for (int a = 0; a < 3; a++)
+    for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+      double t1 = (node->bbox_low[a][i] - origin[a]) * inv_dir[a];
+      double t2 = (node->bbox_high[a][i] - origin[a]) * inv_dir[a];
+      double lo = t1 < t2 ? t1 : t2, hi = t1 < t2 ? t2 : t1;
+      tmin[i] = tmin[i] > lo ? tmin[i] : lo;
+      tmax[i] = tmax[i] < hi ? tmax[i] : hi;
+    }
+  for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+    double slack = MESH_BOX_SLACK * ((tmin[i] < 0 ? -tmin[i] : tmin[i]) +
+                                     (tmax[i] < 0 ? -tmax[i] : tmax[i]));
+    hits |= (tmax[i] + slack >= tmin[i] && (node->child[i] >= 0 || node->face_count[i] > 0)) << i;
+  }
+  return hits;
+}
+
+/* The squared distances from p to the four child boxes of a 4-wide
+   node (infinite for empty slots). */
+static void point_qbvh_node_dist2(const double p[3], const mesh_qbvh_node *node,
+                                  double dist2[MESH_QBVH_WIDTH]) {
+  for (int i = 0; i < MESH_QBVH_WIDTH; i++)
+    dist2[i] = 0;
+  for (int a = 0; a < 3; a++)
+    for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+      double d1 = node->bbox_low[a][i] - p[a], d2 = p[a] - node->bbox_high[a][i];
+      double d = d1 > d2 ? d1 : d2;
+      d = d > 0 ? d : 0;
+      dist2[i] += d * d;
+    }
+}
+
 /***************************************************************/
 /* Closest point on triangle                                   */
 /***************************************************************/
@@ -2393,14 +6480,187 @@ static double closest_point_on_triangle(vector3 p, vector3 v0, vector3 v1, vecto
 /* BVH-accelerated mesh queries                                */
 /***************************************************************/
 
+/* The traversal stacks hold at most bvh_stack_size (or qbvh_stack_size)
+   entries, set by init_mesh from the depth of the tree.  They are on the
+   C stack for all but very deep trees: mesh_stack returns buf if it has
+   room for size bytes, and otherwise a heap array to be released with
+   mesh_stack_free. */
+#define MESH_BVH_STACK 64
+#define MESH_QBVH_STACK 256
+
+static void *mesh_stack(void *buf, size_t buf_size, size_t size) {
+  if (size <= buf_size) return buf;
+  void *stack = malloc(size);
+  CHECK(stack, "out of memory");
+  return stack;
+}
+
+static void mesh_stack_free(void *stack, void *buf) {
+  if (stack != buf) free(stack);
+}
+
+/* As find_closest_face, using the 4-wide BVH: the children of each node
+   are visited nearest first, testing the faces of leaves immediately and
+   pushing inner nodes with their box distances, so that nodes farther
+   than the closest face found by the time they are popped are skipped
+   without being fetched. */
+static int find_closest_face_qbvh(const mesh *m, vector3 p, double *dist2) {
+  const mesh_internal *mi = mesh_priv(m);
+  const double pa[3] = {p.x, p.y, p.z};
+  int best_face = -1;
+  double best_dist2 = 1e300;
+
+  int stack_buf[MESH_QBVH_STACK];
+  double stack_dist2_buf[MESH_QBVH_STACK];
+  int *stack = (int *)mesh_stack(stack_buf, sizeof(stack_buf), mi->qbvh_stack_size * sizeof(int));
+  double *stack_dist2 = (double *)mesh_stack(stack_dist2_buf, sizeof(stack_dist2_buf),
+                                             mi->qbvh_stack_size * sizeof(double));
+  int stack_top = 0;
+  stack[stack_top] = 0;
+  stack_dist2[stack_top++] = 0;
+
+  while (stack_top > 0) {
+    stack_top--;
+    if (stack_dist2[stack_top] > best_dist2) continue;
+    const mesh_qbvh_node *node = &mi->qbvh[stack[stack_top]];
+
+    /* Sort the children that might hold a closer face by distance. */
+    double d2[MESH_QBVH_WIDTH];
+    int order[MESH_QBVH_WIDTH], n = 0;
+    point_qbvh_node_dist2(pa, node, d2);
+    for (int i = 0; i < MESH_QBVH_WIDTH; i++)
+      if (d2[i] <= best_dist2) {
+        int j = n++;
+        for (; j > 0 && d2[order[j - 1]] > d2[i]; j--)
+          order[j] = order[j - 1];
+        order[j] = i;
+      }
+
+    for (int k = 0; k < n; k++) {
+      int i = order[k];
+      if (node->child[i] >= 0 || d2[i] > best_dist2) continue;
+      for (int f = 0; f < node->face_count[i]; f++) {
+        int fid = mi->bvh_face_ids[node->face_start[i] + f];
+        vector3 v0 = m->vertices.items[mi->face_indices[3 * fid]];
+        vector3 v1 = m->vertices.items[mi->face_indices[3 * fid + 1]];
+        vector3 v2 = m->vertices.items[mi->face_indices[3 * fid + 2]];
+        vector3 closest;
+        double fd2 = closest_point_on_triangle(p, v0, v1, v2, &closest);
+        if (fd2 < best_dist2 || (fd2 == best_dist2 && fid < best_face)) {
+          best_dist2 = fd2;
+          best_face = fid;
+        }
+      }
+    }
+    /* Push the inner children farthest first, so the nearest is popped first. */
+    for (int k = n - 1; k >= 0; k--) {
+      int i = order[k];
+      if (node->child[i] < 0 || d2[i] > best_dist2) continue;
+      stack[stack_top] = node->child[i];
+      stack_dist2[stack_top++] = d2[i];
+    }
+  }
+
+  mesh_stack_free(stack, stack_buf);
+  mesh_stack_free(stack_dist2, stack_dist2_buf);
+  *dist2 = best_dist2;
+  return best_face;
+}
+
+/* The squared distance from p to the box b (0 inside it). */
+static double mesh_box_dist2(vector3 p, const geom_box *b) {
+  double dx = fmax(0, fmax(b->low.x - p.x, p.x - b->high.x));
+  double dy = fmax(0, fmax(b->low.y - p.y, p.y - b->high.y));
+  double dz = fmax(0, fmax(b->low.z - p.z, p.z - b->high.z));
+  return dx * dx + dy * dy + dz * dz;
+}
+
+/* As find_closest_face, using the quantized BVH of a compact mesh; the
+   box of each node is dequantized from its parent's as it is pushed.
+   The quantized tree has the shape of the binary one, so its traversal
+   stacks need bvh_stack_size entries. */
+static int find_closest_face_cbvh(const mesh *m, vector3 p, double *dist2) {
+  const mesh_internal *mi = mesh_priv(m);
+  int best_face = -1;
+  double best_dist2 = 1e300;
+
+  int stack_buf[MESH_BVH_STACK];
+  geom_box stack_box_buf[MESH_BVH_STACK];
+  double stack_dist2_buf[MESH_BVH_STACK];
+  int *stack = (int *)mesh_stack(stack_buf, sizeof(stack_buf), mi->bvh_stack_size * sizeof(int));
+  geom_box *stack_box = (geom_box *)mesh_stack(stack_box_buf, sizeof(stack_box_buf),
+                                               mi->bvh_stack_size * sizeof(geom_box));
+  double *stack_dist2 = (double *)mesh_stack(stack_dist2_buf, sizeof(stack_dist2_buf),
+                                             mi->bvh_stack_size * sizeof(double));
+  int stack_top = 0;
+  stack[stack_top] = mi->cbvh_root;
+  stack_box[stack_top] = mi->bbox;
+  stack_dist2[stack_top++] = mesh_box_dist2(p, &mi->bbox);
+
+  while (stack_top > 0) {
+    stack_top--;
+    int code = stack[stack_top];
+    if (stack_dist2[stack_top] > best_dist2) continue;
+
+    if (code < 0) {
+      /* Leaf: test all faces. */
+      for (int k = -1 - code, last = 0; !last; k++) {
+        int fid = mi->bvh_face_ids[k];
+        if ((last = fid < 0)) fid = ~fid;
+        vector3 v0 = m->vertices.items[mi->face_indices[3 * fid]];
+        vector3 v1 = m->vertices.items[mi->face_indices[3 * fid + 1]];
+        vector3 v2 = m->vertices.items[mi->face_indices[3 * fid + 2]];
+        vector3 closest;
+        double d2 = closest_point_on_triangle(p, v0, v1, v2, &closest);
+        if (d2 < best_dist2 || (d2 == best_dist2 && fid < best_face)) {
+          best_dist2 = d2;
+          best_face = fid;
+        }
+      }
+      continue;
+    }
+
+    const mesh_cbvh_node *node = &mi->cbvh[code];
+    geom_box box = stack_box[stack_top], kid_box[2];
+    double kid_dist2[2];
+    for (int i = 0; i < 2; i++) {
+      mesh_cbvh_child_box(&box, node, i, &kid_box[i]);
+      kid_dist2[i] = mesh_box_dist2(p, &kid_box[i]);
+    }
+    /* Push the farther child first so the nearer child is popped first. */
+    int nearer = kid_dist2[1] < kid_dist2[0];
+    for (int j = 0; j < 2; j++) {
+      int i = j == 0 ? !nearer : nearer;
+      if (kid_dist2[i] > best_dist2) continue;
+      stack[stack_top] = node->child[i];
+      stack_box[stack_top] = kid_box[i];
+      stack_dist2[stack_top++] = kid_dist2[i];
+    }
+  }
+
+  mesh_stack_free(stack, stack_buf);
+  mesh_stack_free(stack_box, stack_box_buf);
+  mesh_stack_free(stack_dist2, stack_dist2_buf);
+  *dist2 = best_dist2;
+  return best_face;
+}
+
 /* Find the closest face to point p using BVH traversal.
-   Returns the face index and sets *dist2 to the squared distance. */
+   Returns the face index and sets *dist2 to the squared distance.
+   Of several equally close faces (e.g. if the closest point is a shared
+   edge or vertex), the one with the smallest index is returned, so
+   that the result does not depend on the layout of the BVH. */
 static int find_closest_face(const mesh *m, vector3 p, double *dist2) {
+  if (mesh_priv(m)->qbvh) return find_closest_face_qbvh(m, p, dist2);
+  if (mesh_priv(m)->cbvh) return find_closest_face_cbvh(m, p, dist2);
+
   int best_face = -1;
   double best_dist2 = 1e300;
 
   /* Stack-based traversal with pruning. */
-  int stack[64];
+  int stack_buf[MESH_BVH_STACK];
+  int *stack = (int *)mesh_stack(stack_buf, sizeof(stack_buf),
+                                 mesh_priv(m)->bvh_stack_size * sizeof(int));
   int stack_top = 0;
   stack[stack_top++] = 0;
 
@@ -2413,7 +6673,7 @@ static int find_closest_face(const mesh *m, vector3 p, double *dist2) {
     double dy = fmax(0, fmax(node->bbox_low.y - p.y, p.y - node->bbox_high.y));
     double dz = fmax(0, fmax(node->bbox_low.z - p.z, p.z - node->bbox_high.z));
     double box_dist2 = dx * dx + dy * dy + dz * dz;
-    if (box_dist2 >= best_dist2) continue;
+    if (box_dist2 > best_dist2) continue;
 
     if (node->left_child < 0) {
       /* Leaf: test all faces. */
@@ -2424,13 +6684,12 @@ static int find_closest_face(const mesh *m, vector3 p, double *dist2) {
         vector3 v2 = m->vertices.items[mesh_priv(m)->face_indices[3 * fid + 2]];
         vector3 closest;
         double d2 = closest_point_on_triangle(p, v0, v1, v2, &closest);
-        if (d2 < best_dist2) {
+        if (d2 < best_dist2 || (d2 == best_dist2 && fid < best_face)) {
           best_dist2 = d2;
           best_face = fid;
         }
       }
     } else {
-      if (stack_top + 2 > 64) continue;
       /* Push the farther child first so the nearer child is popped first,
          giving better pruning of the farther subtree. */
       const mesh_bvh_node *left = &mesh_priv(m)->bvh[node->left_child];
@@ -2453,6 +6712,7 @@ static int find_closest_face(const mesh *m, vector3 p, double *dist2) {
     }
   }
 
+  mesh_stack_free(stack, stack_buf);
   *dist2 = best_dist2;
   return best_face;
 }
@@ -2504,8 +6764,82 @@ static void mesh_ray_all_intersections(const mesh *m, vector3 origin, vector3 di
   inv_dir.y = (fabs(dir.y) > 1e-30) ? 1.0 / dir.y : 1e30;
   inv_dir.z = (fabs(dir.z) > 1e-30) ? 1.0 / dir.z : 1e30;
 
-  double det_eps = 1e-12 * mesh_priv(m)->lengthscale * mesh_priv(m)->lengthscale;
-  int stack[64];
+  mesh_ray ray;
+  if (dir.x == 0 && dir.y == 0 && dir.z == 0) return;
+  mesh_ray_init(&ray, origin, dir);
+
+  if (mesh_priv(m)->qbvh) {
+    const mesh_internal *mi = mesh_priv(m);
+    const double origin_a[3] = {origin.x, origin.y, origin.z};
+    const double inv_dir_a[3] = {inv_dir.x, inv_dir.y, inv_dir.z};
+    int qstack_buf[MESH_QBVH_STACK];
+    int *qstack =
+        (int *)mesh_stack(qstack_buf, sizeof(qstack_buf), mi->qbvh_stack_size * sizeof(int));
+    int qstack_top = 0;
+    qstack[qstack_top++] = 0;
+
+    while (qstack_top > 0) {
+      const mesh_qbvh_node *node = &mi->qbvh[qstack[--qstack_top]];
+      int hit = ray_qbvh_node_intersect(origin_a, inv_dir_a, node);
+      for (int i = 0; i < MESH_QBVH_WIDTH; i++) {
+        if (!(hit & (1 << i))) continue;
+        if (node->child[i] >= 0) {
+          qstack[qstack_top++] = node->child[i];
+          continue;
+        }
+        for (int f = 0; f < node->face_count[i]; f++) {
+          double t;
+          if (ray_triangle_intersect(&ray, m, mi->bvh_face_ids[node->face_start[i] + f], &t))
+            mesh_hit_list_push(hits, t);
+        }
+      }
+    }
+    mesh_stack_free(qstack, qstack_buf);
+    return;
+  }
+
+  if (mesh_priv(m)->cbvh) {
+    const mesh_internal *mi = mesh_priv(m);
+    int cstack_buf[MESH_BVH_STACK];
+    geom_box cstack_box_buf[MESH_BVH_STACK];
+    int *cstack =
+        (int *)mesh_stack(cstack_buf, sizeof(cstack_buf), mi->bvh_stack_size * sizeof(int));
+    geom_box *cstack_box = (geom_box *)mesh_stack(cstack_box_buf, sizeof(cstack_box_buf),
+                                                  mi->bvh_stack_size * sizeof(geom_box));
+    int cstack_top = 0;
+    cstack[cstack_top] = mi->cbvh_root;
+    cstack_box[cstack_top++] = mi->bbox;
+
+    while (cstack_top > 0) {
+      cstack_top--;
+      int code = cstack[cstack_top];
+      mesh_bvh_node box_node; /* just the box, for ray_bvh_node_intersect */
+      bvh_node_set_box(&box_node, &cstack_box[cstack_top]);
+      if (!ray_bvh_node_intersect(origin, inv_dir, &box_node, -1e30, 1e30)) continue;
+
+      if (code < 0) {
+        for (int k = -1 - code, last = 0; !last; k++) {
+          int fid = mi->bvh_face_ids[k];
+          double t;
+          if ((last = fid < 0)) fid = ~fid;
+          if (ray_triangle_intersect(&ray, m, fid, &t)) mesh_hit_list_push(hits, t);
+        }
+      } else {
+        geom_box box = cstack_box[cstack_top];
+        for (int i = 0; i < 2; i++) {
+          mesh_cbvh_child_box(&box, &mi->cbvh[code], i, &cstack_box[cstack_top]);
+          cstack[cstack_top++] = mi->cbvh[code].child[i];
+        }
+      }
+    }
+    mesh_stack_free(cstack, cstack_buf);
+    mesh_stack_free(cstack_box, cstack_box_buf);
+    return;
+  }
+
+  int stack_buf[MESH_BVH_STACK];
+  int *stack = (int *)mesh_stack(stack_buf, sizeof(stack_buf),
+                                 mesh_priv(m)->bvh_stack_size * sizeof(int));
   int stack_top = 0;
   stack[stack_top++] = 0;
 
@@ -2518,21 +6852,16 @@ static void mesh_ray_all_intersections(const mesh *m, vector3 origin, vector3 di
 
     if (node->left_child < 0) {
       for (int i = 0; i < node->face_count; i++) {
-        int fid = mesh_priv(m)->bvh_face_ids[node->face_start + i];
-        vector3 v0 = m->vertices.items[mesh_priv(m)->face_indices[3 * fid]];
-        vector3 v1 = m->vertices.items[mesh_priv(m)->face_indices[3 * fid + 1]];
-        vector3 v2 = m->vertices.items[mesh_priv(m)->face_indices[3 * fid + 2]];
-
         double t;
-        if (ray_triangle_intersect(origin, dir, v0, v1, v2, det_eps, &t, NULL, NULL))
+        if (ray_triangle_intersect(&ray, m, mesh_priv(m)->bvh_face_ids[node->face_start + i], &t))
           mesh_hit_list_push(hits, t);
       }
     } else {
-      if (stack_top + 2 > 64) continue;
       stack[stack_top++] = node->left_child;
       stack[stack_top++] = node->right_child;
     }
   }
+  mesh_stack_free(stack, stack_buf);
 }
 
 static int mesh_dcmp(const void *a, const void *b) {
@@ -2541,83 +6870,156 @@ static int mesh_dcmp(const void *a, const void *b) {
   return (da > db) - (da < db);
 }
 
-/* Remove duplicate intersection parameters within tolerance.
-   TODO(after #75): unify with the prism slist dedup in
-   intersect_line_with_prism — same data structure, same operation. */
-static int remove_duplicate_intersections(double *slist, int count, double tol) {
-  if (count <= 1) return count;
-  int j = 0;
-  for (int i = 1; i < count; i++) {
-    if (slist[i] - slist[j] > tol)
-      slist[++j] = slist[i];
-  }
-  return j + 1;
-}
-
-/* Count ray-mesh intersections using BVH traversal.
-   Collects all intersection t-values, deduplicates, and returns the count.
-   If had_degenerate is non-NULL, sets it to 1 if any near-duplicate
-   t-values were found (indicating a potential edge/vertex hit). */
-static int count_ray_mesh_intersections_ex(const mesh *m, vector3 origin, vector3 dir,
-                                           int *had_degenerate) {
+/* Count the crossings of the ray origin + t*dir (t > 0) with the mesh
+   surface.  Since ray_triangle_intersect counts every crossing exactly
+   once, no deduplication of the hits is needed. */
+static int count_ray_mesh_intersections(const mesh *m, vector3 origin, vector3 dir) {
   mesh_hit_list hits;
   mesh_hit_list_init(&hits);
   mesh_ray_all_intersections(m, origin, dir, &hits);
 
-  /* Keep only forward intersections (t > eps). */
-  double fwd_eps = 1e-12 * mesh_priv(m)->lengthscale;
   int nforward = 0;
   for (int i = 0; i < hits.count; i++)
-    if (hits.data[i] > fwd_eps)
-      hits.data[nforward++] = hits.data[i];
-
-  if (nforward > 1) {
-    qsort(hits.data, nforward, sizeof(double), mesh_dcmp);
-    double dedup_tol = 1e-10 * mesh_priv(m)->lengthscale;
-    int deduped = remove_duplicate_intersections(hits.data, nforward, dedup_tol);
-    if (had_degenerate) *had_degenerate = (deduped != nforward);
-    nforward = deduped;
-  } else {
-    if (had_degenerate) *had_degenerate = 0;
-  }
+    if (hits.data[i] > 0) nforward++;
 
   mesh_hit_list_free(&hits);
   return nforward;
 }
 
-static int count_ray_mesh_intersections(const mesh *m, vector3 origin, vector3 dir) {
-  return count_ray_mesh_intersections_ex(m, origin, dir, NULL);
+static const vector3 mesh_ray_dir = {0.57735026918962576, 0.57735026918962576,
+                                     0.57735026918962576}; /* (1,1,1)/√3 */
+
+/***************************************************************/
+/* Occupancy grid                                              */
+/***************************************************************/
+
+/* A coarse grid of cubic cells over the mesh's bounding box, each
+   classified as inside or outside the mesh, or as (possibly) meeting
+   the surface, so that point_in_mesh only casts rays from surface
+   cells. */
+enum { MESH_CELL_OUTSIDE, MESH_CELL_INSIDE, MESH_CELL_SURFACE };
+
+/* if positive, init_mesh builds an occupancy grid for closed meshes with
+   this many cells along the longest side of the bounding box */
+int geom_mesh_grid_resolution = 0;
+
+static int mesh_grid_cell(const mesh_internal *mi, vector3 p) {
+  int i = (int)floor((p.x - mi->grid_low.x) * mi->grid_inv_h);
+  int j = (int)floor((p.y - mi->grid_low.y) * mi->grid_inv_h);
+  int k = (int)floor((p.z - mi->grid_low.z) * mi->grid_inv_h);
+  if (i < 0 || j < 0 || k < 0 || i >= mi->grid_n[0] || j >= mi->grid_n[1] || k >= mi->grid_n[2])
+    return -1;
+  return (i * mi->grid_n[1] + j) * mi->grid_n[2] + k;
+}
+
+/* Build the occupancy grid of a closed mesh: mark the cells that each
+   triangle may meet (those in its bounding box that its plane passes
+   through, with a little slack for roundoff), then flood-fill the
+   remaining cells.  Each connected region of non-surface cells is
+   separated from the surface, so it is entirely inside or outside, and
+   casting a single ray from one of its cells classifies all of them. */
+static void mesh_grid_build(const mesh *m, int resolution) {
+  mesh_internal *mi = mesh_priv(m);
+  const geom_box *root = &mi->bbox;
+  double slack = 1e-9 * mi->lengthscale;
+  double extent = fmax(root->high.x - root->low.x,
+                       fmax(root->high.y - root->low.y, root->high.z - root->low.z));
+  double h = (extent + 2 * slack) / resolution;
+
+  /* cells of side h covering the bounding box, plus the slack */
+  mi->grid_low.x = root->low.x - slack;
+  mi->grid_low.y = root->low.y - slack;
+  mi->grid_low.z = root->low.z - slack;
+  mi->grid_inv_h = 1 / h;
+  for (int a = 0; a < 3; a++)
+    mi->grid_n[a] = MAX(1, (int)ceil((VEC_I(root->high, a) - VEC_I(root->low, a) +
+                                      2 * slack) * mi->grid_inv_h));
+  size_t ncells = (size_t)mi->grid_n[0] * mi->grid_n[1] * mi->grid_n[2];
+  unsigned char *grid = (unsigned char *)malloc(ncells);
+  CHECK(grid, "out of memory");
+  memset(grid, MESH_CELL_OUTSIDE, ncells);
+
+  for (int f = 0; f < mi->num_faces; f++) {
+    vector3 v0, v1, v2;
+    geom_box box;
+    int lo[3], hi[3];
+    mesh_triangle_vertices(m, f, &v0, &v1, &v2);
+    mesh_triangle_bbox(m, f, &box);
+    vector3 n = vector3_cross(vector3_minus(v1, v0), vector3_minus(v2, v0));
+    for (int a = 0; a < 3; a++) {
+      lo[a] = MAX(0, (int)floor((VEC_I(box.low, a) - slack - VEC_I(mi->grid_low, a)) * mi->grid_inv_h));
+      hi[a] = MIN(mi->grid_n[a] - 1,
+                  (int)floor((VEC_I(box.high, a) + slack - VEC_I(mi->grid_low, a)) * mi->grid_inv_h));
+    }
+    /* the plane meets a cell if the center is within the cell's
+       projection onto the normal */
+    double radius = 0.5 * h * (fabs(n.x) + fabs(n.y) + fabs(n.z)) + slack * vector3_norm(n);
+    for (int i = lo[0]; i <= hi[0]; i++)
+      for (int j = lo[1]; j <= hi[1]; j++)
+        for (int k = lo[2]; k <= hi[2]; k++) {
+          vector3 c = {mi->grid_low.x + (i + 0.5) * h, mi->grid_low.y + (j + 0.5) * h,
+                       mi->grid_low.z + (k + 0.5) * h};
+          if (fabs(vector3_dot(n, vector3_minus(c, v0))) <= radius)
+            grid[(i * mi->grid_n[1] + j) * mi->grid_n[2] + k] = MESH_CELL_SURFACE;
+        }
+  }
+
+  /* flood-fill each unvisited region of non-surface cells (marked as
+     MESH_CELL_OUTSIDE so far) with the classification of its first cell */
+  unsigned char *visited = (unsigned char *)calloc(ncells, 1);
+  int *queue = (int *)malloc(ncells * sizeof(int));
+  CHECK(visited && queue, "out of memory");
+  for (size_t c0 = 0; c0 < ncells; c0++) {
+    if (grid[c0] == MESH_CELL_SURFACE || visited[c0]) continue;
+    int i0 = (int)(c0 / ((size_t)mi->grid_n[1] * mi->grid_n[2]));
+    int j0 = (int)(c0 / mi->grid_n[2] % mi->grid_n[1]), k0 = (int)(c0 % mi->grid_n[2]);
+    vector3 p = {mi->grid_low.x + (i0 + 0.5) * h, mi->grid_low.y + (j0 + 0.5) * h,
+                 mi->grid_low.z + (k0 + 0.5) * h};
+    unsigned char cls =
+        count_ray_mesh_intersections(m, p, mesh_ray_dir) % 2 ? MESH_CELL_INSIDE : MESH_CELL_OUTSIDE;
+    size_t head = 0, tail = 0;
+    queue[tail++] = (int)c0;
+    visited[c0] = 1;
+    while (head < tail) {
+      int c = queue[head++];
+      int ijk[3] = {c / (mi->grid_n[1] * mi->grid_n[2]), c / mi->grid_n[2] % mi->grid_n[1],
+                    c % mi->grid_n[2]};
+      grid[c] = cls;
+      for (int a = 0; a < 3; a++)
+        for (int step = -1; step <= 1; step += 2) {
+          int nb[3] = {ijk[0], ijk[1], ijk[2]};
+          nb[a] += step;
+          if (nb[a] < 0 || nb[a] >= mi->grid_n[a]) continue;
+          int cn = (nb[0] * mi->grid_n[1] + nb[1]) * mi->grid_n[2] + nb[2];
+          if (grid[cn] != MESH_CELL_SURFACE && !visited[cn]) {
+            visited[cn] = 1;
+            queue[tail++] = cn;
+          }
+        }
+    }
+  }
+  free(queue);
+  free(visited);
+  mi->grid = grid;
 }
 
 /***************************************************************/
 /* Core mesh geometric operations                              */
 /***************************************************************/
 
-static const vector3 mesh_ray_dirs[3] = {
-  {0.57735026918962576, 0.57735026918962576, 0.57735026918962576},  /* (1,1,1)/√3 */
-  {0.80178372573727319, 0.53452248382484879, 0.26726124191242440},  /* (3,2,1)/√14 */
-  {0.12309149097933272, 0.49236596391733088, 0.86164043685532904},  /* (1,4,7)/√66 */
-};
 
 static boolean point_in_mesh(const mesh *m, vector3 p) {
   if (!m->is_closed) return 0;
 
-  /* Fast path: cast one ray. If no degenerate edge/vertex hits were
-     detected during deduplication, trust the result immediately.
-     Only fall back to 3-ray majority vote when a degenerate case
-     is detected (near-duplicate t-values removed). */
-  int had_degenerate;
-  int crossings = count_ray_mesh_intersections_ex(m, p, mesh_ray_dirs[0], &had_degenerate);
-  if (!had_degenerate)
-    return (crossings % 2) == 1;
-
-  /* Degenerate hit detected — cast two more rays and take majority vote. */
-  int votes = (crossings % 2 == 1) ? 1 : 0;
-  for (int d = 1; d < 3; d++) {
-    crossings = count_ray_mesh_intersections(m, p, mesh_ray_dirs[d]);
-    if (crossings % 2 == 1) votes++;
+  if (mesh_priv(m)->grid) {
+    int c = mesh_grid_cell(mesh_priv(m), p);
+    if (c < 0) return 0; /* outside the bounding box */
+    if (mesh_priv(m)->grid[c] != MESH_CELL_SURFACE) return mesh_priv(m)->grid[c] == MESH_CELL_INSIDE;
   }
-  return votes >= 2;
+
+  /* The parity of the crossings along a single ray is exact, even if the
+     ray passes through edges or vertices (see ray_triangle_intersect). */
+  return (count_ray_mesh_intersections(m, p, mesh_ray_dir) % 2) == 1;
 }
 
 static vector3 normal_to_mesh(const mesh *m, vector3 p) {
@@ -2627,13 +7029,19 @@ static vector3 normal_to_mesh(const mesh *m, vector3 p) {
     vector3 zero = {0, 0, 0};
     return zero;
   }
-  return mesh_priv(m)->face_normals[face];
+  if (mesh_priv(m)->face_normals) return mesh_priv(m)->face_normals[face];
+  return mesh_face_normal(m, face);
+}
+
+static double distance_to_mesh(const mesh *m, vector3 p) {
+  double dist2;
+  if (find_closest_face(m, p, &dist2) < 0) return HUGE_VAL;
+  return sqrt(dist2);
 }
 
 static void get_mesh_bounding_box(const mesh *m, geom_box *box) {
-  if (mesh_priv(m)->num_bvh_nodes > 0) {
-    box->low = mesh_priv(m)->bvh[0].bbox_low;
-    box->high = mesh_priv(m)->bvh[0].bbox_high;
+  if (mesh_priv(m)->bvh || mesh_priv(m)->cbvh) {
+    *box = mesh_priv(m)->bbox;
   } else {
     box->low = box->high = m->vertices.items[0];
     for (int i = 1; i < m->vertices.num_items; i++)
@@ -2658,6 +7066,23 @@ static void display_mesh_info(int indentby, const geometric_object *o) {
   ctl_printf("%*s     %d vertices, %d faces, %s\n", indentby, "",
              m->vertices.num_items, mesh_priv(m)->num_faces,
              m->is_closed ? "closed" : "OPEN (WARNING)");
+  if (mesh_priv(m)->qbvh)
+    ctl_printf("%*s     4-wide BVH, %d nodes (%.1f kB)\n", indentby, "",
+               mesh_priv(m)->num_qbvh_nodes,
+               mesh_priv(m)->num_qbvh_nodes * sizeof(mesh_qbvh_node) / 1024.0);
+  if (mesh_priv(m)->cbvh)
+    ctl_printf("%*s     compact, %d quantized BVH nodes (%.1f kB)\n", indentby, "",
+               mesh_priv(m)->num_cbvh_nodes,
+               mesh_priv(m)->num_cbvh_nodes * sizeof(mesh_cbvh_node) / 1024.0);
+  if (mesh_priv(m)->grid) {
+    const mesh_internal *mi = mesh_priv(m);
+    size_t ncells = (size_t)mi->grid_n[0] * mi->grid_n[1] * mi->grid_n[2], nsurface = 0;
+    for (size_t c = 0; c < ncells; c++)
+      nsurface += mi->grid[c] == MESH_CELL_SURFACE;
+    ctl_printf("%*s     occupancy grid %dx%dx%d (%.1f kB), %.1f%% surface cells\n", indentby, "",
+               mi->grid_n[0], mi->grid_n[1], mi->grid_n[2], ncells / 1024.0,
+               100.0 * nsurface / ncells);
+  }
 }
 
 static double intersect_line_segment_with_mesh(const mesh *m, vector3 p, vector3 d,
@@ -2666,10 +7091,7 @@ static double intersect_line_segment_with_mesh(const mesh *m, vector3 p, vector3
   mesh_hit_list_init(&hits);
   mesh_ray_all_intersections(m, p, d, &hits);
 
-  if (hits.count > 1) {
-    qsort(hits.data, hits.count, sizeof(double), mesh_dcmp);
-    hits.count = remove_duplicate_intersections(hits.data, hits.count, 1e-10 * mesh_priv(m)->lengthscale);
-  }
+  if (hits.count > 1) qsort(hits.data, hits.count, sizeof(double), mesh_dcmp);
 
   /* The sorted intersection list gives all surface crossings along the
      full ray. At t=-inf we are outside, so the parity after k crossings
@@ -2695,17 +7117,46 @@ static double intersect_line_segment_with_mesh(const mesh *m, vector3 p, vector3
   return ds > 0.0 ? ds : 0.0;
 }
 
+/* All crossings of the line p+s*d with the mesh surface, sorted (each
+   counted once), in the same form as intersect_line_with_prism:
+   slist has room for slist_len values, and if the return value (the
+   number of crossings) is larger, the caller should retry with a bigger
+   slist.  As in intersect_line_segment_with_mesh, the line is outside at
+   s = -infinity and inside after an odd number of crossings. */
+static int intersect_line_with_mesh(const mesh *m, vector3 p, vector3 d, double *slist,
+                                    int slist_len) {
+  mesh_hit_list hits;
+  mesh_hit_list_init(&hits);
+  mesh_ray_all_intersections(m, p, d, &hits);
+
+  if (hits.count > 1) qsort(hits.data, hits.count, sizeof(double), mesh_dcmp);
+  int count = hits.count;
+  for (int i = 0; i < count && i < slist_len; i++)
+    slist[i] = hits.data[i];
+  mesh_hit_list_free(&hits);
+  return count;
+}
+
 /* Forward declaration; init_mesh body lives below. */
-static void init_mesh(geometric_object *o);
+static void init_mesh(geometric_object *o, mesh_options opts);
+
+/* The mesh options of the current context (or the globals). */
+static mesh_options mesh_current_options(void) {
+  mesh_options opts;
+  opts.qbvh = CTX(geom_mesh_qbvh);
+  opts.grid_resolution = CTX(geom_mesh_grid_resolution);
+  opts.compact = CTX(geom_mesh_compact);
+  return opts;
+}
 
 /* Build the opaque mesh_internal cache for a mesh whose public fields
    (vertices, face_indices) have just been populated and whose internal
    pointer is NULL. */
-static void mesh_init_internal(mesh *m) {
+static void mesh_init_internal(mesh *m, mesh_options opts) {
   geometric_object o;
   /* only need to initialize a single field of o, since that's all init_mesh looks at */
   o.subclass.mesh_data = m;
-  init_mesh(&o);
+  init_mesh(&o, opts);
 }
 
 /* Free the opaque mesh_internal cache and all its nested allocations.
@@ -2715,9 +7166,11 @@ static void mesh_internal_free(void *p) {
   mesh_internal *mi = (mesh_internal *)p;
   free(mi->face_indices);
   free(mi->face_normals);
-  free(mi->face_areas);
   free(mi->bvh);
   free(mi->bvh_face_ids);
+  free(mi->qbvh);
+  free(mi->cbvh);
+  free(mi->grid);
   free(mi);
 }
 
@@ -2726,9 +7179,11 @@ static void mesh_internal_free(void *p) {
    (after-copy ...) / (after-destroy ...). */
 void CTLIO mesh_after_copy(mesh *m) {
   /* The auto-generated mesh_copy shallow-copies internal from the source;
-     discard that pointer so this copy gets its own cache, then build it. */
+     discard that pointer so this copy gets its own cache, then build it
+     with the same options as the source's. */
+  mesh_options opts = m->internal ? mesh_priv(m)->opts : mesh_current_options();
   m->internal = NULL;
-  mesh_init_internal(m);
+  mesh_init_internal(m, opts);
 }
 
 void CTLIO mesh_after_destroy(mesh *m) {
@@ -2737,15 +7192,22 @@ void CTLIO mesh_after_destroy(mesh *m) {
 
 /***************************************************************/
 /* init_mesh: allocate the opaque mesh_internal cache, unpack   */
-/* face_indices into a flat int array, compute face normals,    */
-/* areas, centroid, lengthscale, check closure, and build BVH.  */
+/* face_indices into a flat int array, compute face normals    */
+/* (unless compact), centroid, lengthscale, check closure, and  */
+/* build the BVH.                                               */
 /*                                                              */
 /* NOT THREAD-SAFE: writes the per-mesh internal cache.         */
 /* Invoked only from the mesh constructors and from reinit_mesh;*/
-/* both rely on it running single-threaded per mesh.            */
+/* both rely on it running single-threaded per mesh.  For large */
+/* meshes it uses threads itself, with the same results.        */
 /***************************************************************/
 
-static void init_mesh(geometric_object *o) {
+static int mesh_int_cmp(const void *a, const void *b) {
+  int ia = *(const int *)a, ib = *(const int *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+static void init_mesh(geometric_object *o, mesh_options opts) {
   mesh *m = o->subclass.mesh_data;
   int nv = m->vertices.num_items;
 
@@ -2754,6 +7216,7 @@ static void init_mesh(geometric_object *o) {
   mesh_internal *p = (mesh_internal *)calloc(1, sizeof(mesh_internal));
   CHECK(p, "out of memory");
   m->internal = (SCM) p;
+  p->opts = opts;
 
   /* Unpack face_indices: the public vector3_list stores 3 ints per
      triangle packed into a vector3 (x, y, z are the indices as doubles,
@@ -2763,6 +7226,9 @@ static void init_mesh(geometric_object *o) {
   p->num_faces = nf;
   p->face_indices = (int *)malloc(3 * nf * sizeof(int));
   CHECK(p->face_indices, "out of memory");
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
   for (int f = 0; f < nf; f++) {
     p->face_indices[3 * f]     = (int)m->face_indices.items[f].x;
     p->face_indices[3 * f + 1] = (int)m->face_indices.items[f].y;
@@ -2791,23 +7257,15 @@ static void init_mesh(geometric_object *o) {
     if (mesh_priv(m)->lengthscale == 0) mesh_priv(m)->lengthscale = 1.0;
   }
 
-  /* Compute face normals and areas. */
-  mesh_priv(m)->face_normals = (vector3 *)malloc(nf * sizeof(vector3));
-  CHECK(mesh_priv(m)->face_normals, "out of memory");
-  mesh_priv(m)->face_areas = (double *)malloc(nf * sizeof(double));
-  CHECK(mesh_priv(m)->face_areas, "out of memory");
-
-  double area_eps = 1e-20 * mesh_priv(m)->lengthscale * mesh_priv(m)->lengthscale;
-  for (int f = 0; f < nf; f++) {
-    vector3 v0 = m->vertices.items[mesh_priv(m)->face_indices[3 * f]];
-    vector3 v1 = m->vertices.items[mesh_priv(m)->face_indices[3 * f + 1]];
-    vector3 v2 = m->vertices.items[mesh_priv(m)->face_indices[3 * f + 2]];
-    vector3 e1 = vector3_minus(v1, v0);
-    vector3 e2 = vector3_minus(v2, v0);
-    vector3 n = vector3_cross(e1, e2);
-    double len = vector3_norm(n);
-    mesh_priv(m)->face_areas[f] = 0.5 * len;
-    mesh_priv(m)->face_normals[f] = (len > area_eps) ? vector3_scale(1.0 / len, n) : n;
+  /* Cache the face normals, unless the mesh is compact. */
+  if (!opts.compact) {
+    mesh_priv(m)->face_normals = (vector3 *)malloc(nf * sizeof(vector3));
+    CHECK(mesh_priv(m)->face_normals, "out of memory");
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
+    for (int f = 0; f < nf; f++)
+      mesh_priv(m)->face_normals[f] = mesh_face_normal(m, f);
   }
 
   /* Compute centroid. */
@@ -2817,59 +7275,66 @@ static void init_mesh(geometric_object *o) {
   mesh_priv(m)->centroid = vector3_scale(1.0 / nv, mesh_priv(m)->centroid);
 
   /* Check if mesh is closed: every edge must be shared by exactly 2 faces.
-     An edge is identified by a sorted pair of vertex indices. We use a
-     hash table mapping edge → face count. */
+     An edge is identified by a sorted pair of vertex indices (vlo, vhi).
+     We bucket the edges by vlo, counting sort style, then sort each
+     bucket by vhi and check that each vhi occurs exactly twice. */
   {
-    /* Hash table size: next power of 2 above 3*nf (each face has 3 edges). */
-    int htsize = 1;
-    while (htsize < 4 * nf) htsize <<= 1;
-    int htmask = htsize - 1;
-
-    /* Each bucket stores (v_lo, v_hi, count). Use open addressing. */
-    int *ht_vlo = (int *)calloc(htsize, sizeof(int));
-    int *ht_vhi = (int *)calloc(htsize, sizeof(int));
-    int *ht_cnt = (int *)calloc(htsize, sizeof(int));
-    /* Mark empty slots with -1. */
-    for (int i = 0; i < htsize; i++) ht_vlo[i] = -1;
-
-    m->is_closed = 1;
-    for (int f = 0; f < nf && m->is_closed; f++) {
+    int *edge_start = (int *)calloc(nv + 1, sizeof(int));
+    int *edge_fill = (int *)malloc(nv * sizeof(int));
+    int *edge_vhi = (int *)malloc(3 * nf * sizeof(int));
+    CHECK(edge_start && edge_fill && edge_vhi, "out of memory");
+    const int *fi = mesh_priv(m)->face_indices;
+
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
+    for (int f = 0; f < nf; f++)
       for (int e = 0; e < 3; e++) {
-        int va = mesh_priv(m)->face_indices[3 * f + e];
-        int vb = mesh_priv(m)->face_indices[3 * f + (e + 1) % 3];
-        int vlo = (va < vb) ? va : vb;
-        int vhi = (va < vb) ? vb : va;
-        unsigned int h = (unsigned int)(vlo * 73856093u ^ vhi * 19349663u) & htmask;
-        /* Linear probing. */
-        while (1) {
-          if (ht_vlo[h] == -1) {
-            /* Empty slot: insert new edge. */
-            ht_vlo[h] = vlo;
-            ht_vhi[h] = vhi;
-            ht_cnt[h] = 1;
-            break;
-          } else if (ht_vlo[h] == vlo && ht_vhi[h] == vhi) {
-            /* Found existing edge. */
-            ht_cnt[h]++;
-            if (ht_cnt[h] > 2) m->is_closed = 0; /* non-manifold edge */
-            break;
-          }
-          h = (h + 1) & htmask;
-        }
+        int va = fi[3 * f + e], vb = fi[3 * f + (e + 1) % 3];
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+        edge_start[((va < vb) ? va : vb) + 1]++;
       }
+    for (int v = 0; v < nv; v++) {
+      edge_start[v + 1] += edge_start[v];
+      edge_fill[v] = edge_start[v];
     }
-    /* Check that all edges have exactly 2 faces. */
-    if (m->is_closed) {
-      for (int i = 0; i < htsize; i++) {
-        if (ht_vlo[i] != -1 && ht_cnt[i] != 2) {
-          m->is_closed = 0;
-          break;
-        }
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
+    for (int f = 0; f < nf; f++)
+      for (int e = 0; e < 3; e++) {
+        int va = fi[3 * f + e], vb = fi[3 * f + (e + 1) % 3], k;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+        k = edge_fill[(va < vb) ? va : vb]++;
+        edge_vhi[k] = (va < vb) ? vb : va;
       }
+
+    /* Sort each bucket (usually a handful of edges, by insertion). */
+    int closed = 1;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 4096) reduction(&& : closed) if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
+    for (int v = 0; v < nv; v++) {
+      int *vhi = edge_vhi + edge_start[v], n = edge_start[v + 1] - edge_start[v];
+      if (n > 32)
+        qsort(vhi, n, sizeof(int), mesh_int_cmp);
+      else
+        for (int i = 1; i < n; i++) {
+          int x = vhi[i], k = i;
+          for (; k > 0 && vhi[k - 1] > x; k--) vhi[k] = vhi[k - 1];
+          vhi[k] = x;
+        }
+      for (int i = 0; i < n; i += 2)
+        if (i + 1 >= n || vhi[i] != vhi[i + 1] || (i + 2 < n && vhi[i + 2] == vhi[i])) closed = 0;
     }
-    free(ht_vlo);
-    free(ht_vhi);
-    free(ht_cnt);
+    m->is_closed = closed;
+    free(edge_start);
+    free(edge_fill);
+    free(edge_vhi);
 
     if (!m->is_closed)
       ctl_printf("WARNING: mesh is not closed (not all edges shared by exactly 2 faces).\n"
@@ -2945,13 +7410,17 @@ static void init_mesh(geometric_object *o) {
     }
 
     /* Flip faces in components with negative signed volume. */
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
     for (int f = 0; f < nf; f++) {
       int ci = comp_id[mesh_priv(m)->face_indices[3 * f]];
       if (comp_vol[ci] < 0) {
         int tmp = mesh_priv(m)->face_indices[3 * f + 1];
         mesh_priv(m)->face_indices[3 * f + 1] = mesh_priv(m)->face_indices[3 * f + 2];
         mesh_priv(m)->face_indices[3 * f + 2] = tmp;
-        mesh_priv(m)->face_normals[f] = vector3_scale(-1.0, mesh_priv(m)->face_normals[f]);
+        if (mesh_priv(m)->face_normals)
+          mesh_priv(m)->face_normals[f] = vector3_scale(-1.0, mesh_priv(m)->face_normals[f]);
       }
     }
 
@@ -2970,8 +7439,59 @@ static void init_mesh(geometric_object *o) {
   for (int i = 0; i < nf; i++)
     mesh_priv(m)->bvh_face_ids[i] = i;
 
+  mesh_bvh_face *faces = (mesh_bvh_face *)malloc(nf * sizeof(mesh_bvh_face));
+  CHECK(faces, "out of memory");
+#ifdef _OPENMP
+#pragma omp parallel for if (nf >= MESH_BVH_PARALLEL_MIN)
+#endif
+  for (int f = 0; f < nf; f++)
+    mesh_triangle_bbox_centroid(m, f, &faces[f].box, &faces[f].centroid);
+
+  /* Build the subtrees of large nodes as tasks, then move the nodes
+     into the order of a serial mesh_bvh_build, so that the BVH doesn't
+     depend on the number of threads. */
+#ifdef _OPENMP
+#pragma omp parallel if (nf >= 2 * MESH_BVH_PARALLEL_MIN)
+#pragma omp single
+#endif
+  mesh_bvh_build_tasks(m, faces, mesh_priv(m)->bvh_face_ids, 0, nf, mesh_priv(m)->bvh, 0);
   mesh_priv(m)->num_bvh_nodes = 0;
-  mesh_bvh_build(m, mesh_priv(m)->bvh_face_ids, 0, nf, mesh_priv(m)->bvh, &mesh_priv(m)->num_bvh_nodes);
+  mesh_bvh_compact(mesh_priv(m)->bvh, 0, &mesh_priv(m)->num_bvh_nodes);
+  free(faces);
+  mesh_priv(m)->bbox.low = mesh_priv(m)->bvh[0].bbox_low;
+  mesh_priv(m)->bbox.high = mesh_priv(m)->bvh[0].bbox_high;
+
+  /* A depth-first traversal of the binary tree, pushing both children of
+     each inner node, has at most one entry per level on its stack, and
+     one of the 4-wide tree at most three per level plus four. */
+  mesh_priv(m)->bvh_stack_size = mesh_bvh_depth(mesh_priv(m)->bvh, 0) + 1;
+
+  /* A compact mesh keeps only the quantized BVH, with a node per inner
+     binary node. */
+  if (opts.compact) {
+    mesh_priv(m)->cbvh =
+        (mesh_cbvh_node *)malloc((mesh_priv(m)->num_bvh_nodes / 2 + 1) * sizeof(mesh_cbvh_node));
+    CHECK(mesh_priv(m)->cbvh, "out of memory");
+    mesh_priv(m)->num_cbvh_nodes = 0;
+    mesh_priv(m)->cbvh_root = mesh_cbvh_quantize(mesh_priv(m), 0, &mesh_priv(m)->bbox,
+                                                 mesh_priv(m)->cbvh, &mesh_priv(m)->num_cbvh_nodes);
+    free(mesh_priv(m)->bvh);
+    mesh_priv(m)->bvh = NULL;
+    mesh_priv(m)->num_bvh_nodes = 0;
+  }
+  else if (opts.qbvh) {
+    /* Collapse it into the 4-wide BVH, which has at most one node per
+       inner binary node (and one for a leaf root). */
+    int max_qnodes = mesh_priv(m)->num_bvh_nodes / 2 + 1;
+    mesh_priv(m)->qbvh = (mesh_qbvh_node *)malloc(max_qnodes * sizeof(mesh_qbvh_node));
+    CHECK(mesh_priv(m)->qbvh, "out of memory");
+    mesh_priv(m)->num_qbvh_nodes = 0;
+    mesh_qbvh_collapse(mesh_priv(m), 0, mesh_priv(m)->qbvh, &mesh_priv(m)->num_qbvh_nodes);
+    mesh_priv(m)->qbvh_stack_size = 3 * mesh_qbvh_depth(mesh_priv(m)->qbvh, 0) + 1;
+  }
+
+  if (opts.grid_resolution > 0 && m->is_closed)
+    mesh_grid_build(m, opts.grid_resolution);
 }
 
 /***************************************************************/
@@ -2992,7 +7512,7 @@ static void reinit_mesh(geometric_object *o) {
      subsequent reinit_mesh calls are no-op fast-path returns and safe
      under concurrency. */
   if (m->internal != NULL) return;
-  init_mesh(o);
+  init_mesh(o, mesh_current_options());
 }
 
 static int mesh_is_auto_center(vector3 c) {
@@ -3047,7 +7567,7 @@ geometric_object make_mesh_with_center(material_type material, vector3 center,
 
   /* Initialize derived data (allocates m->internal, computes normals,
      closure check, BVH). */
-  init_mesh(&o);
+  init_mesh(&o, mesh_current_options());
 
   /* Set center from the (possibly shifted) centroid. */
   o.center = mesh_priv(m)->centroid;
@@ -3561,6 +8081,45 @@ vector3 normal_to_prism(prism *prsm, vector3 pc) {
   return prism_vector_p2c(prsm, retval);
 }
 
+/***************************************************************/
+/* return the (unsigned) distance from pc to the surface of    */
+/* the prism: the minimum distance to the floor, the ceiling,  */
+/* and the side walls, each of which is a planar trapezoid     */
+/* that we split into two triangles.                           */
+/***************************************************************/
+static double distance_to_prism_polygon(vector3 pp, vector3 *nodes, int num_nodes, double z) {
+  double dz = pp.z - z, d;
+  int nv;
+  if (node_in_polygon(pp.x, pp.y, nodes, num_nodes)) return fabs(dz);
+  pp.z = z;
+  d = min_distance_to_line_segment(pp, nodes[num_nodes - 1], nodes[0]);
+  for (nv = 1; nv < num_nodes; nv++)
+    d = fmin(d, min_distance_to_line_segment(pp, nodes[nv - 1], nodes[nv]));
+  return sqrt(d * d + dz * dz);
+}
+
+double distance_to_prism(prism *prsm, vector3 pc) {
+  vector3 *vps_bottom = prsm->vertices_p.items;
+  vector3 *vps_top = prsm->vertices_top_p.items;
+  int num_vertices = prsm->vertices_p.num_items;
+  vector3 pp = prism_coordinate_c2p(prsm, pc), closest;
+  double d = distance_to_prism_polygon(pp, vps_bottom, num_vertices, 0.0);
+  int nv;
+
+  if (prsm->height > 0.0) {
+    double d2 = d * d;
+    for (nv = 0; nv < num_vertices; nv++) {
+      int nvp1 = (nv == (num_vertices - 1) ? 0 : nv + 1);
+      d2 = fmin(d2, closest_point_on_triangle(pp, vps_bottom[nv], vps_bottom[nvp1],
+                                              vps_top[nvp1], &closest));
+      d2 = fmin(d2, closest_point_on_triangle(pp, vps_bottom[nv], vps_top[nvp1], vps_top[nv],
+                                              &closest));
+    }
+    d = fmin(sqrt(d2), distance_to_prism_polygon(pp, vps_top, num_vertices, prsm->height));
+  }
+  return d;
+}
+
 /***************************************************************/
 /* Compute the area of a polygon using its vertices.           */
 /***************************************************************/
@@ -127,10 +127,24 @@ PyObject* material_of_numpy_points_in_tree(double* points, int n_points, int dim
         return NULL;
     }
 
+    vector3* p = (vector3*)malloc(sizeof(vector3) * n_points);
+    material_type* materials = (material_type*)malloc(sizeof(material_type) * n_points);
+    if ((!p || !materials) && n_points > 0) {
+        free(p);
+        free(materials);
+        return PyErr_NoMemory();
+    }
+    for (int i = 0; i < n_points; i++) {
+        p[i].x = points[i*3];
+        p[i].y = points[i*3 + 1];
+        p[i].z = points[i*3 + 2];
+    }
+    material_of_points_in_tree(p, n_points, t, materials, NULL);
+    free(p);
+
     PyObject* result = PyList_New(n_points);
     for (int i = 0; i < n_points; i++) {
-        vector3 p = {points[i*3], points[i*3 + 1], points[i*3 + 2]};
-        material_type material = material_of_point_in_tree(p, t);
+        material_type material = materials[i];
 
         if (material == NULL) {
             PyObject* nan = PyFloat_FromDouble(NPY_NAN);  // Create numpy.nan
@@ -141,6 +155,7 @@ PyObject* material_of_numpy_points_in_tree(double* points, int n_points, int dim
             PyList_SET_ITEM(result, i, mat);
         }
     }
+    free(materials);
     return result;
 }
 %}
@@ -26,6 +26,9 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "ctlgeom.h"
 
@@ -247,6 +250,35 @@ static void test_cube_vs_block(void) {
   printf("done (%d mismatches)\n", mismatches);
 }
 
+/************************************************************************/
+/* Test: signed distance to the cube mesh matches that of the block     */
+/************************************************************************/
+static void test_cube_signed_distance(void) {
+  printf("test_cube_signed_distance... ");
+  geometric_object cube_mesh = make_cube_mesh(NULL);
+  vector3 center = {0, 0, 0};
+  vector3 e1 = {1, 0, 0}, e2 = {0, 1, 0}, e3 = {0, 0, 1};
+  vector3 size = {1, 1, 1};
+  geometric_object cube_block = make_block(NULL, center, e1, e2, e3, size);
+  double max_diff = 0;
+  int i;
+
+  srand(271828);
+  for (i = 0; i < 10000; i++) {
+    vector3 p;
+    p.x = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    p.y = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    p.z = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    max_diff = fmax(max_diff, fabs(signed_distance_to_fixed_object(p, cube_mesh) -
+                                   signed_distance_to_fixed_object(p, cube_block)));
+  }
+  ASSERT_NEAR("cube mesh distance matches block", max_diff, 0.0, 1e-12);
+
+  geometric_object_destroy(cube_mesh);
+  geometric_object_destroy(cube_block);
+  printf("done\n");
+}
+
 /************************************************************************/
 /* Test: random line segments — cube mesh vs block                      */
 /* Compare interior length from intersect_line_segment_with_object      */
@@ -672,6 +704,346 @@ static void test_many_intersections(void) {
   printf("done\n");
 }
 
+/************************************************************************/
+/* Helper: a bumpy UV sphere of radius ~1, with nth rings of latitude   */
+/* and nph of longitude, 2*nph*(nth-1) triangles.                       */
+/************************************************************************/
+static geometric_object make_bumpy_sphere_mesh(int nth, int nph) {
+  int nv = (nth - 1) * nph + 2;
+  int nf = 2 * nph * (nth - 1);
+  vector3 *verts = (vector3 *)malloc(nv * sizeof(vector3));
+  int *tris = (int *)malloc(nf * 3 * sizeof(int));
+  int i, j, n = 0;
+
+  /* vertex 0 is the north pole, nv-1 the south pole, and ring i (of
+     nph vertices) starts at 1 + i*nph */
+  verts[0] = (vector3){0, 0, 1};
+  verts[nv - 1] = (vector3){0, 0, -1};
+  for (i = 0; i < nth - 1; i++)
+    for (j = 0; j < nph; j++) {
+      double th = K_PI * (i + 1) / nth, ph = 2 * K_PI * j / nph;
+      double r = 1 + 0.1 * sin(5 * th) * cos(3 * ph);
+      verts[1 + i * nph + j] = (vector3){r * sin(th) * cos(ph), r * sin(th) * sin(ph), r * cos(th)};
+    }
+  for (j = 0; j < nph; j++) {
+    int j1 = (j + 1) % nph;
+    tris[3 * n] = 0, tris[3 * n + 1] = 1 + j, tris[3 * n + 2] = 1 + j1, n++;
+    for (i = 0; i < nth - 2; i++) {
+      int a = 1 + i * nph + j, b = 1 + i * nph + j1;
+      tris[3 * n] = a, tris[3 * n + 1] = a + nph, tris[3 * n + 2] = b + nph, n++;
+      tris[3 * n] = a, tris[3 * n + 1] = b + nph, tris[3 * n + 2] = b, n++;
+    }
+    tris[3 * n] = nv - 1, tris[3 * n + 1] = 1 + (nth - 2) * nph + j1;
+    tris[3 * n + 2] = 1 + (nth - 2) * nph + j, n++;
+  }
+
+  geometric_object o = make_mesh(NULL, verts, nv, tris, nf);
+  free(verts);
+  free(tris);
+  return o;
+}
+
+/************************************************************************/
+/* Helper: the number of differences between the point-in, distance,    */
+/* normal, and line-segment results of a and b at 20000 random points   */
+/* and lines in [-1.2,1.2]^3, drawn with the given seed.                */
+/************************************************************************/
+static int mesh_query_mismatches(geometric_object a, geometric_object b, unsigned seed) {
+  int i, mismatches = 0;
+
+  srand(seed);
+  for (i = 0; i < 20000; i++) {
+    vector3 p, d;
+    p.x = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    p.y = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    p.z = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    d.x = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    d.y = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    d.z = (rand() / (double)RAND_MAX) * 2.0 - 1.0;
+    if (point_in_fixed_objectp(p, a) != point_in_fixed_objectp(p, b)) mismatches++;
+    if (signed_distance_to_fixed_object(p, a) != signed_distance_to_fixed_object(p, b))
+      mismatches++;
+    if (!vector3_equal(normal_to_fixed_object(p, a), normal_to_fixed_object(p, b))) mismatches++;
+    if (intersect_line_segment_with_object(p, d, a, -1, 2) !=
+        intersect_line_segment_with_object(p, d, b, -1, 2))
+      mismatches++;
+  }
+  return mismatches;
+}
+
+/************************************************************************/
+/* Helper: the text shown by display_geometric_object_info for o.       */
+/************************************************************************/
+static char display_text[1024];
+
+static void append_display_text(const char *s) {
+  strncat(display_text, s, sizeof(display_text) - strlen(display_text) - 1);
+}
+
+static const char *mesh_info(geometric_object o) {
+  display_text[0] = 0;
+  ctl_printf_callback = append_display_text;
+  display_geometric_object_info(0, o);
+  ctl_printf_callback = NULL;
+  return display_text;
+}
+
+/************************************************************************/
+/* Test: 4-wide BVH matches the binary BVH.                             */
+/* A bumpy UV sphere with a few thousand triangles, built with and      */
+/* without geom_mesh_qbvh, gives identical point-in, normal, distance,  */
+/* and line-segment results at random points and lines.  Copies and     */
+/* meshes made in a context use the 4-wide BVH as they were asked to.   */
+/************************************************************************/
+static void test_qbvh_matches_binary(void) {
+  printf("test_qbvh_matches_binary... ");
+
+  geom_mesh_qbvh = 0;
+  geometric_object binary = make_bumpy_sphere_mesh(40, 60);
+  geom_mesh_qbvh = 1;
+  geometric_object wide = make_bumpy_sphere_mesh(40, 60);
+
+  ASSERT_TRUE("4-wide BVH matches binary BVH", mesh_query_mismatches(binary, wide, 161803) == 0);
+
+  /* copies are built as the original was, and a context overrides the
+     global setting */
+  geometric_object binary_copy, context_mesh;
+  geom_context ctx;
+  geometric_object_copy(&binary, &binary_copy);
+  geom_context_init(&ctx);
+  ctx.geom_mesh_qbvh = 0;
+  geom_set_context(&ctx);
+  context_mesh = make_tetra_mesh(NULL);
+  geom_set_context(NULL);
+  ASSERT_TRUE("4-wide BVH shown", strstr(mesh_info(wide), "4-wide BVH") != NULL);
+  ASSERT_TRUE("copy of binary mesh has no 4-wide BVH", !strstr(mesh_info(binary_copy), "4-wide BVH"));
+  ASSERT_TRUE("context turns off 4-wide BVH", !strstr(mesh_info(context_mesh), "4-wide BVH"));
+
+  geometric_object_destroy(binary);
+  geometric_object_destroy(wide);
+  geometric_object_destroy(binary_copy);
+  geometric_object_destroy(context_mesh);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Helper: whether o is displayed as a compact mesh, and if so the      */
+/* number of nodes of its quantized BVH.                                */
+/************************************************************************/
+static int compact_mesh_nodes(geometric_object o, int *nodes) {
+  const char *line = strstr(mesh_info(o), "compact, ");
+  return line && sscanf(line, "compact, %d quantized BVH nodes", nodes) == 1;
+}
+
+/************************************************************************/
+/* Test: a compact mesh (quantized BVH, no normal cache) gives the      */
+/* same results as the default one, since faces are still tested        */
+/* exactly, and its copies are compact too.                             */
+/************************************************************************/
+static void test_compact_mesh(void) {
+  printf("test_compact_mesh... ");
+
+  geometric_object full = make_bumpy_sphere_mesh(40, 60);
+  geom_mesh_compact = 1;
+  geometric_object compact = make_bumpy_sphere_mesh(40, 60);
+  geometric_object tetra = make_tetra_mesh(NULL);
+  geom_mesh_compact = 0;
+
+  geom_box b1, b2;
+  geom_get_bounding_box(full, &b1);
+  geom_get_bounding_box(compact, &b2);
+  ASSERT_TRUE("compact bounding box",
+              vector3_equal(b1.low, b2.low) && vector3_equal(b1.high, b2.high));
+
+  ASSERT_TRUE("compact mesh matches full mesh", mesh_query_mismatches(full, compact, 141421) == 0);
+
+  /* the quantized BVH has a node per inner node of the binary one */
+  int nodes = -1;
+  ASSERT_TRUE("full sphere is not compact", !compact_mesh_nodes(full, &nodes));
+  ASSERT_TRUE("compact sphere has a quantized BVH", compact_mesh_nodes(compact, &nodes) && nodes > 0);
+
+  /* a mesh small enough that its BVH is a single leaf, so that the
+     quantized BVH has no nodes; q is closest to the center of the face
+     x+y+z = -1 */
+  ASSERT_TRUE("compact tetrahedron root is a leaf", compact_mesh_nodes(tetra, &nodes) && nodes == 0);
+  vector3 c = {0, 0, 0}, q = {-1, -1, -1};
+  ASSERT_TRUE("compact tetrahedron contains center", point_in_fixed_objectp(c, tetra));
+  ASSERT_NEAR("compact tetrahedron normal", vector3_dot(normal_to_fixed_object(q, tetra), q),
+              sqrt(3.0), TOLERANCE);
+  ASSERT_NEAR("compact tetrahedron distance", fabs(signed_distance_to_fixed_object(q, tetra)),
+              2 / sqrt(3.0), TOLERANCE);
+
+  /* copies of a compact mesh are compact, and a context can ask for it */
+  geometric_object compact_copy, context_mesh;
+  geom_context ctx;
+  geometric_object_copy(&compact, &compact_copy);
+  geom_context_init(&ctx);
+  ctx.geom_mesh_compact = 1;
+  geom_set_context(&ctx);
+  context_mesh = make_tetra_mesh(NULL);
+  geom_set_context(NULL);
+  ASSERT_TRUE("copy of compact mesh is compact", compact_mesh_nodes(compact_copy, &nodes));
+  ASSERT_TRUE("context makes compact mesh", compact_mesh_nodes(context_mesh, &nodes));
+
+  geometric_object_destroy(full);
+  geometric_object_destroy(compact);
+  geometric_object_destroy(tetra);
+  geometric_object_destroy(compact_copy);
+  geometric_object_destroy(context_mesh);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: a mesh built by several threads gives the same results as one  */
+/* built by a single thread (the BVH should be identical).  The sphere  */
+/* has enough faces for init_mesh to build its BVH with tasks.           */
+/************************************************************************/
+static void test_parallel_init(void) {
+  printf("test_parallel_init... ");
+
+#ifdef _OPENMP
+  int nthreads = omp_get_max_threads();
+  omp_set_num_threads(1);
+#endif
+  geometric_object serial = make_bumpy_sphere_mesh(130, 130);
+#ifdef _OPENMP
+  omp_set_num_threads(4);
+#endif
+  geometric_object parallel = make_bumpy_sphere_mesh(130, 130);
+#ifdef _OPENMP
+  omp_set_num_threads(nthreads);
+#endif
+  ASSERT_TRUE("parallel mesh is closed", parallel.subclass.mesh_data->is_closed);
+
+  ASSERT_TRUE("parallel init matches serial init",
+              mesh_query_mismatches(serial, parallel, 271828) == 0);
+
+  geometric_object_destroy(serial);
+  geometric_object_destroy(parallel);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: occupancy grid gives the same point_in_mesh results.           */
+/* The bumpy sphere with and without a 16-cell grid, at random points,  */
+/* and at the centers and corners of the grid cells; copies and meshes  */
+/* made in a context get the grid they were asked for.                  */
+/************************************************************************/
+static void test_occupancy_grid(void) {
+  printf("test_occupancy_grid... ");
+  int i, j, k, mismatches = 0;
+
+  geometric_object plain = make_bumpy_sphere_mesh(40, 60);
+  geom_mesh_grid_resolution = 16;
+  geometric_object gridded = make_bumpy_sphere_mesh(40, 60);
+  geom_mesh_grid_resolution = 0;
+
+  srand(141421);
+  for (i = 0; i < 20000; i++) {
+    vector3 p;
+    p.x = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    p.y = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    p.z = (rand() / (double)RAND_MAX) * 2.4 - 1.2;
+    if (point_in_fixed_objectp(p, plain) != point_in_fixed_objectp(p, gridded)) mismatches++;
+  }
+  geom_box box;
+  geom_get_bounding_box(gridded, &box);
+  double h = (box.high.x - box.low.x) / 32;
+  for (i = -2; i <= 34; i++)
+    for (j = -2; j <= 34; j++)
+      for (k = -2; k <= 34; k++) {
+        vector3 p = {box.low.x + i * h, box.low.y + j * h, box.low.z + k * h};
+        if (point_in_fixed_objectp(p, plain) != point_in_fixed_objectp(p, gridded)) mismatches++;
+      }
+  ASSERT_TRUE("occupancy grid matches ray casting", mismatches == 0);
+
+  /* copies keep the grid of the original, and a context can ask for one */
+  geometric_object gridded_copy, context_mesh;
+  geom_context ctx;
+  geometric_object_copy(&gridded, &gridded_copy);
+  geom_context_init(&ctx);
+  ctx.geom_mesh_grid_resolution = 8;
+  geom_set_context(&ctx);
+  context_mesh = make_tetra_mesh(NULL);
+  geom_set_context(NULL);
+  ASSERT_TRUE("copy keeps occupancy grid", strstr(mesh_info(gridded_copy), "occupancy grid 16x") != NULL);
+  ASSERT_TRUE("context adds occupancy grid", strstr(mesh_info(context_mesh), "occupancy grid") != NULL);
+  ASSERT_TRUE("no occupancy grid by default", !strstr(mesh_info(plain), "occupancy grid"));
+
+  geometric_object_destroy(plain);
+  geometric_object_destroy(gridded);
+  geometric_object_destroy(gridded_copy);
+  geometric_object_destroy(context_mesh);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: structured axis-aligned mesh probed on a grid.                 */
+/* A cube whose faces are divided into unit squares, probed at points   */
+/* of a half-unit grid, so that the (1,1,1) rays of point_in_mesh and   */
+/* the diagonal lines below pass exactly through its edges and          */
+/* vertices.  Each crossing must be counted exactly once.               */
+/************************************************************************/
+static void test_grid_mesh_edge_hits(void) {
+  printf("test_grid_mesh_edge_hits... ");
+  enum { N = 3 }; /* squares per side; the cube is [-N/2, N/2]^3 */
+  int index[N + 1][N + 1][N + 1];
+  vector3 verts[(N + 1) * (N + 1) * (N + 1)];
+  int tris[6 * N * N * 2 * 3];
+  int i, j, k, nv = 0, nf = 0, mismatches = 0;
+
+  for (i = 0; i <= N; i++)
+    for (j = 0; j <= N; j++)
+      for (k = 0; k <= N; k++) {
+        index[i][j][k] = -1;
+        if (i == 0 || i == N || j == 0 || j == N || k == 0 || k == N) {
+          index[i][j][k] = nv;
+          verts[nv++] = (vector3){i - 0.5 * N, j - 0.5 * N, k - 0.5 * N};
+        }
+      }
+  /* each face (normal along axis a, on side s), with squares spanned by
+     the axes u and v, wound counterclockwise about the outward normal */
+  for (int a = 0; a < 3; a++)
+    for (int s = 0; s <= N; s += N)
+      for (int u = 0; u < N; u++)
+        for (int v = 0; v < N; v++) {
+          int c[4], g[3];
+          for (int q = 0; q < 4; q++) {
+            g[a] = s;
+            g[(a + 1) % 3] = u + (q == 1 || q == 2);
+            g[(a + 2) % 3] = v + (q >= 2);
+            c[q] = index[g[0]][g[1]][g[2]];
+          }
+          if (s == 0) { /* reverse the winding on the low side */
+            int tmp = c[1];
+            c[1] = c[3];
+            c[3] = tmp;
+          }
+          tris[3 * nf] = c[0], tris[3 * nf + 1] = c[1], tris[3 * nf + 2] = c[2], nf++;
+          tris[3 * nf] = c[0], tris[3 * nf + 1] = c[2], tris[3 * nf + 2] = c[3], nf++;
+        }
+
+  geometric_object obj = make_mesh(NULL, verts, nv, tris, nf);
+  vector3 diag = {1, 1, 1};
+
+  for (i = -4; i <= 4; i++)
+    for (j = -4; j <= 4; j++)
+      for (k = -4; k <= 4; k++) {
+        vector3 p = {0.5 * i, 0.5 * j, 0.5 * k};
+        double m = fmax(fabs(p.x), fmax(fabs(p.y), fabs(p.z)));
+        /* p + t*diag is in the cube for |p_i + t| <= N/2 */
+        double t0 = fmax(-1, -0.5 * N - fmin(p.x, fmin(p.y, p.z)));
+        double t1 = fmin(1, 0.5 * N - fmax(p.x, fmax(p.y, p.z)));
+        if (m != 0.5 * N && point_in_fixed_objectp(p, obj) != (m < 0.5 * N)) mismatches++;
+        if (fabs(intersect_line_segment_with_object(p, diag, obj, -1, 1) - fmax(0, t1 - t0)) > 1e-12)
+          mismatches++;
+      }
+  ASSERT_TRUE("grid mesh: edge and vertex hits counted once", mismatches == 0);
+
+  geometric_object_destroy(obj);
+  printf("done\n");
+}
+
 /************************************************************************/
 int main(void) {
   geom_initialize();
@@ -682,6 +1054,7 @@ int main(void) {
   test_cube_bounding_box();
   test_cube_normals();
   test_cube_vs_block();
+  test_cube_signed_distance();
   test_cube_segments_vs_block();
   test_cube_line_segment();
   test_copy_destroy();
@@ -695,6 +1068,11 @@ int main(void) {
   test_isolated_vertex();
   test_mixed_winding();
   test_many_intersections();
+  test_qbvh_matches_binary();
+  test_grid_mesh_edge_hits();
+  test_occupancy_grid();
+  test_parallel_init();
+  test_compact_mesh();
 
   printf("\n%d test failures\n", test_failures);
   return test_failures > 0 ? 1 : 0;
@@ -0,0 +1,1526 @@
+/* libctl: flexible Guile-based control files for scientific software
+ * Copyright (C) 1998-2020 Massachusetts Institute of Technology and Steven G. Johnson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA  02111-1307, USA.
+ *
+ * Steven G. Johnson can be contacted at stevenj@alum.mit.edu.
+ */
+
+/************************************************************************/
+/* test-tree.c: unit test for geom_box_tree searches in libctlgeom      */
+/************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "ctlgeom.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define K_PI 3.141592653589793238462643383279502884197
+#define NUM_POINTS 20000
+
+static int test_failures = 0;
+
+#define ASSERT_TRUE(msg, cond)                                                \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "FAIL: %s (line %d)\n", msg, __LINE__);                 \
+      test_failures++;                                                        \
+    }                                                                         \
+  } while (0)
+
+/* return a uniform random number in [a,b] */
+static double myurand(double a, double b) { return (b - a) * (rand() / (double)RAND_MAX) + a; }
+
+static vector3 make_vector3(double x, double y, double z) {
+  vector3 v;
+  v.x = x;
+  v.y = y;
+  v.z = z;
+  return v;
+}
+
+static vector3 random_point_in_cell(void) {
+  return make_vector3(myurand(-0.5, 0.5) * geometry_lattice.size.x,
+                      myurand(-0.5, 0.5) * geometry_lattice.size.y,
+                      myurand(-0.5, 0.5) * geometry_lattice.size.z);
+}
+
+/* material "pointers" are just distinct tags identifying each object */
+#define MATERIAL(i) ((void *)((char *)NULL + (i) + 1))
+
+/************************************************************************/
+/* Helper: a photonic-crystal-like geometry in a 4x4x4 cell: a slab,    */
+/* a 4x4x4 lattice of spheres, and some randomly oriented cylinders,    */
+/* several of which stick out of the cell.                              */
+/************************************************************************/
+static geometric_object_list make_crystal_geometry(void) {
+  geometric_object_list g;
+  vector3 e1 = {1, 0, 0}, e2 = {0, 1, 0}, e3 = {0, 0, 1};
+  int i, j, k, n = 0;
+
+  geometry_lattice.size = make_vector3(4, 4, 4);
+  g.num_items = 1 + 64 + 16;
+  g.items = (geometric_object *)malloc(sizeof(geometric_object) * g.num_items);
+
+  g.items[n] = make_block(MATERIAL(n), make_vector3(0, 0, 0.3), e1, e2, e3,
+                          make_vector3(1e20, 1e20, 0.4));
+  ++n;
+  for (i = 0; i < 4; ++i)
+    for (j = 0; j < 4; ++j)
+      for (k = 0; k < 4; ++k, ++n)
+        g.items[n] = make_sphere(MATERIAL(n), make_vector3(i - 1.5, j - 1.5, k - 1.5),
+                                 myurand(0.2, 0.45));
+  while (n < g.num_items) {
+    vector3 axis = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+    g.items[n] = make_cylinder(MATERIAL(n), random_point_in_cell(), myurand(0.05, 0.3),
+                               myurand(0.5, 2), axis);
+    ++n;
+  }
+  return g;
+}
+
+static void destroy_geometry(geometric_object_list g) {
+  int i;
+  for (i = 0; i < g.num_items; ++i)
+    geometric_object_destroy(g.items[i]);
+  free(g.items);
+}
+
+static geom_box cell_box(void) {
+  geom_box b;
+  b.low = vector3_scale(-0.5, geometry_lattice.size);
+  b.high = vector3_scale(0.5, geometry_lattice.size);
+  return b;
+}
+
+/* check the tree search against a brute-force search of the geometry */
+static int count_tree_mismatches(geometric_object_list g, geom_box_tree t) {
+  int i, mismatches = 0;
+  for (i = 0; i < NUM_POINTS; ++i) {
+    vector3 p = random_point_in_cell();
+    if (material_of_point_in_tree(p, t) != material_of_point0(g, p)) ++mismatches;
+  }
+  return mismatches;
+}
+
+/************************************************************************/
+/* Test: both builders give the same answers as a brute-force search,   */
+/* with and without periodicity.                                        */
+/************************************************************************/
+static void test_builders_match_brute_force(void) {
+  geometric_object_list g;
+  geom_box_tree t;
+  int periodic;
+
+  printf("test_builders_match_brute_force... ");
+  g = make_crystal_geometry();
+  for (periodic = 0; periodic <= 1; ++periodic) {
+    ensure_periodicity = periodic;
+
+    geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+    t = create_geom_box_tree0(g, cell_box());
+    ASSERT_TRUE("balanced tree matches brute force", count_tree_mismatches(g, t) == 0);
+    destroy_geom_box_tree(t);
+
+    geom_box_tree_builder = GEOM_BOX_TREE_SAH;
+    t = create_geom_box_tree0(g, cell_box());
+    ASSERT_TRUE("SAH tree matches brute force", count_tree_mismatches(g, t) == 0);
+    destroy_geom_box_tree(t);
+  }
+  geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+  ensure_periodicity = 1;
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: the SAH builder reduces the expected number of object tests,   */
+/* and may be selected by a geom_context.                               */
+/************************************************************************/
+static void test_sah_cost(void) {
+  geometric_object_list g;
+  geom_box_tree t;
+  int depth, nobjects;
+  double cost_balanced, cost_sah, cost_ctx;
+  geom_context ctx;
+
+  printf("test_sah_cost... ");
+  g = make_crystal_geometry();
+
+  geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats_cost(t, &depth, &nobjects, &cost_balanced);
+  destroy_geom_box_tree(t);
+
+  geom_box_tree_builder = GEOM_BOX_TREE_SAH;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats_cost(t, &depth, &nobjects, &cost_sah);
+  destroy_geom_box_tree(t);
+  geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+
+  /* the builder of the current context is used instead of the global */
+  geom_context_init(&ctx);
+  ctx.geom_box_tree_builder = GEOM_BOX_TREE_SAH;
+  t = create_geom_box_tree0_ctx(&ctx, g, cell_box());
+  geom_box_tree_stats_cost(t, &depth, &nobjects, &cost_ctx);
+  destroy_geom_box_tree(t);
+
+  printf("(cost %g balanced vs. %g SAH) ", cost_balanced, cost_sah);
+  ASSERT_TRUE("SAH tree has a positive cost", cost_sah > 0);
+  ASSERT_TRUE("SAH tree is cheaper than balanced tree", cost_sah < cost_balanced);
+  ASSERT_TRUE("context selects the SAH builder", cost_ctx == cost_sah);
+
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/* check that every geom_tree_search/geom_tree_search_next sequence in
+   t2 matches that in t1, returning the number of mismatched points */
+static int count_search_mismatches(geom_box_tree t1, geom_box_tree t2, const geom_box *b) {
+  int i, mismatches = 0;
+  for (i = 0; i < NUM_POINTS; ++i) {
+    vector3 p;
+    int oi1, oi2;
+    geom_box_tree tp1, tp2;
+    p.x = myurand(b->low.x, b->high.x);
+    p.y = myurand(b->low.y, b->high.y);
+    p.z = myurand(b->low.z, b->high.z);
+    tp1 = geom_tree_search(p, t1, &oi1);
+    tp2 = geom_tree_search(p, t2, &oi2);
+    while (tp1 && tp2) {
+      if (tp1->objects[oi1].o != tp2->objects[oi2].o ||
+          !vector3_equal(tp1->objects[oi1].shiftby, tp2->objects[oi2].shiftby) ||
+          tp1->objects[oi1].precedence != tp2->objects[oi2].precedence)
+        break;
+      tp1 = geom_tree_search_next(p, tp1, &oi1);
+      tp2 = geom_tree_search_next(p, tp2, &oi2);
+    }
+    if (tp1 || tp2) ++mismatches;
+  }
+  return mismatches;
+}
+
+/************************************************************************/
+/* Test: a compiled tree gives identical search results to the tree it  */
+/* was compiled from, including after restricting both to a sub-box.   */
+/************************************************************************/
+static void test_compiled_tree(void) {
+  geometric_object_list g;
+  geom_box_tree t, tc, tr, trc;
+  geom_box b = cell_box(), bsub;
+  int depth, nobjects, depthc, nobjectsc;
+  double cost, costc;
+
+  printf("test_compiled_tree... ");
+  g = make_crystal_geometry();
+  t = create_geom_box_tree0(g, b);
+  tc = compile_geom_box_tree(t);
+  ASSERT_TRUE("compiled tree is compiled", tc->compiled && !t->compiled);
+
+  geom_box_tree_stats_cost(t, &depth, &nobjects, &cost);
+  geom_box_tree_stats_cost(tc, &depthc, &nobjectsc, &costc);
+  ASSERT_TRUE("compiled tree has the same shape",
+              depth == depthc && nobjects == nobjectsc && cost == costc);
+  ASSERT_TRUE("compiled tree matches brute force", count_tree_mismatches(g, tc) == 0);
+  ASSERT_TRUE("compiled tree searches match", count_search_mismatches(t, tc, &b) == 0);
+
+  bsub.low = make_vector3(-0.7, -1.2, 0.1);
+  bsub.high = make_vector3(0.9, 0.3, 1.6);
+  tr = restrict_geom_box_tree(t, &bsub);
+  trc = restrict_geom_box_tree(tc, &bsub);
+  ASSERT_TRUE("restricted compiled tree is compiled", trc->compiled && !tr->compiled);
+  ASSERT_TRUE("restricted compiled tree searches match",
+              count_search_mismatches(tr, trc, &bsub) == 0);
+
+  destroy_geom_box_tree(trc);
+  destroy_geom_box_tree(tr);
+  destroy_geom_box_tree(tc);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: the batched searches give the same results as searching for    */
+/* each point separately.                                               */
+/************************************************************************/
+static void test_batched_search(void) {
+  geometric_object_list g;
+  geom_box_tree t, tc;
+  vector3 *p, *shiftby;
+  void **materials;
+  boolean *inobject;
+  const geometric_object **objects;
+  int *precedence;
+  int i, mismatches, n = NUM_POINTS + 17; /* not a multiple of the block size */
+
+  printf("test_batched_search... ");
+  g = make_crystal_geometry();
+  t = create_geom_box_tree0(g, cell_box());
+  tc = compile_geom_box_tree(t);
+
+  p = (vector3 *)malloc(sizeof(vector3) * n);
+  shiftby = (vector3 *)malloc(sizeof(vector3) * n);
+  materials = (void **)malloc(sizeof(void *) * n);
+  inobject = (boolean *)malloc(sizeof(boolean) * n);
+  objects = (const geometric_object **)malloc(sizeof(geometric_object *) * n);
+  precedence = (int *)malloc(sizeof(int) * n);
+  for (i = 0; i < n; ++i) /* include points outside the unit cell */
+    p[i] = vector3_scale(1.5, random_point_in_cell());
+
+  material_of_points_in_tree(p, n, t, materials, inobject);
+  for (i = mismatches = 0; i < n; ++i) {
+    boolean in;
+    void *m = material_of_point_in_tree_inobject(p[i], t, &in);
+    mismatches += m != materials[i] || in != inobject[i];
+  }
+  ASSERT_TRUE("batched materials match", mismatches == 0);
+
+  material_of_points_in_tree(p, n, tc, materials, NULL);
+  for (i = mismatches = 0; i < n; ++i)
+    mismatches += material_of_point_in_tree(p[i], tc) != materials[i];
+  ASSERT_TRUE("batched materials in compiled tree match", mismatches == 0);
+
+  for (i = 0; i < n; ++i)
+    p[i] = random_point_in_cell();
+  objects_of_points_in_tree(p, n, t, objects, shiftby, precedence);
+  for (i = mismatches = 0; i < n; ++i) {
+    vector3 s;
+    int prec;
+    const geometric_object *o = object_of_point_in_tree(p[i], t, &s, &prec);
+    mismatches += o != objects[i] || !vector3_equal(s, shiftby[i]) || prec != precedence[i];
+  }
+  ASSERT_TRUE("batched objects match", mismatches == 0);
+
+  free(precedence);
+  free(objects);
+  free(inobject);
+  free(materials);
+  free(shiftby);
+  free(p);
+  destroy_geom_box_tree(tc);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: searching with a cursor in a grid sweep gives the same results */
+/* as searching from the root, including for points outside the cell   */
+/* and on its boundary.                                                 */
+/************************************************************************/
+static void test_cursor(void) {
+  geometric_object_list g;
+  geom_box_tree t, tc;
+  geom_box_tree_cursor c, cc;
+  int i, j, k, n = 24, mismatches = 0;
+
+  printf("test_cursor... ");
+  g = make_crystal_geometry();
+  t = create_geom_box_tree0(g, cell_box());
+  tc = compile_geom_box_tree(t);
+  geom_box_tree_cursor_init(&c, t);
+  geom_box_tree_cursor_init(&cc, tc);
+
+  for (i = 0; i < n; ++i)
+    for (j = 0; j < n; ++j)
+      for (k = 0; k < n; ++k) { /* extends past the cell, to test shifting */
+        vector3 p = make_vector3(5.0 * i / n - 2.5, 5.0 * j / n - 2.5, 4.0 * k / n - 2);
+        vector3 s, sc;
+        int prec, precc, oi, oic;
+        boolean in;
+        const geometric_object *o = object_of_point_in_tree(p, t, &s, &prec);
+        geom_box_tree tp = geom_tree_search(p, tc, &oi);
+        mismatches += o != object_of_point_in_tree_cursor(p, &c, &sc, &precc) ||
+                      !vector3_equal(s, sc) || prec != precc;
+        mismatches += tp != geom_tree_search_cursor(p, &cc, &oic) || (tp && oi != oic);
+        mismatches += material_of_point_in_tree(p, t) != material_of_point_in_tree_cursor(p, &c, &in);
+      }
+  ASSERT_TRUE("cursor searches match", mismatches == 0);
+
+  destroy_geom_box_tree(tc);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: moving, inserting, and removing objects in a tree gives the    */
+/* same answers as a brute-force search of the modified geometry, both  */
+/* before and after rebalancing.                                        */
+/************************************************************************/
+
+/* brute-force search of the objects g.items[alive[0..nalive-1]] */
+static int count_incremental_mismatches(geometric_object_list g, const int *alive, int nalive,
+                                        geom_box_tree t) {
+  geometric_object_list ga;
+  int i, mismatches;
+  ga.num_items = nalive;
+  ga.items = (geometric_object *)malloc(sizeof(geometric_object) * nalive);
+  for (i = 0; i < nalive; ++i)
+    ga.items[i] = g.items[alive[i]]; /* shallow copies */
+  mismatches = count_tree_mismatches(ga, t);
+  free(ga.items);
+  return mismatches;
+}
+
+static void test_incremental_updates(void) {
+  geometric_object_list g;
+  geom_box_tree t;
+  int alive[128], nalive, periodic, i, depth, nobjects, precedence;
+  double cost0;
+
+  printf("test_incremental_updates... ");
+  for (periodic = 0; periodic <= 1; ++periodic) {
+    int ninitial;
+    ensure_periodicity = periodic;
+    g = make_crystal_geometry();
+    ninitial = g.num_items;
+    /* the tree stores pointers to the objects, so leave room for new ones */
+    g.items = (geometric_object *)realloc(g.items, sizeof(geometric_object) * 128);
+    for (nalive = 0; nalive < g.num_items; ++nalive)
+      alive[nalive] = nalive;
+
+    t = create_geom_box_tree0(g, cell_box());
+    geom_box_tree_stats_cost(t, &depth, &nobjects, &cost0);
+    precedence = nobjects + 1;
+
+    /* move some of the spheres */
+    for (i = 1; i < 65; i += 7) {
+      g.items[i].center = vector3_plus(g.items[i].center, make_vector3(0.3, -0.2, 0.25));
+      geom_fix_object_ptr(g.items + i);
+      ASSERT_TRUE("moved object found", geom_box_tree_update(t, g.items + i));
+    }
+    ASSERT_TRUE("tree matches after moves",
+                count_incremental_mismatches(g, alive, nalive, t) == 0);
+
+    /* remove some of the spheres and cylinders */
+    for (i = nalive - 1; i > 0; i -= 5) {
+      ASSERT_TRUE("removed object found", geom_box_tree_remove(t, g.items + alive[i]));
+      memmove(alive + i, alive + i + 1, sizeof(int) * (nalive - i - 1));
+      --nalive;
+    }
+    ASSERT_TRUE("tree matches after removals",
+                count_incremental_mismatches(g, alive, nalive, t) == 0);
+
+    /* insert new objects, which take precedence over the old ones */
+    while (g.num_items < ninitial + 20) {
+      vector3 axis = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+      int n = g.num_items++;
+      if (n % 2)
+        g.items[n] = make_sphere(MATERIAL(n), random_point_in_cell(), myurand(0.2, 0.6));
+      else
+        g.items[n] = make_cylinder(MATERIAL(n), random_point_in_cell(), myurand(0.05, 0.3),
+                                   myurand(0.5, 2), axis);
+      geom_box_tree_insert(t, g.items + n, precedence++);
+      alive[nalive++] = n;
+    }
+    ASSERT_TRUE("tree matches after insertions",
+                count_incremental_mismatches(g, alive, nalive, t) == 0);
+
+    /* rebalancing changes nothing but the cost */
+    geom_box_tree_rebalance(t);
+    ASSERT_TRUE("tree matches after rebalancing",
+                count_incremental_mismatches(g, alive, nalive, t) == 0);
+    ASSERT_TRUE("rebalanced tree needs no rebalancing",
+                !geom_box_tree_needs_rebalance(t, cost0, 2.0));
+    /* the last of the initial objects was the first one removed */
+    ASSERT_TRUE("removed object not found", !geom_box_tree_remove(t, g.items + ninitial - 1));
+
+    destroy_geom_box_tree(t);
+    destroy_geometry(g);
+  }
+  ensure_periodicity = 1;
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: a large tree, built in parallel if OpenMP is enabled, is the   */
+/* same regardless of the number of threads.                            */
+/************************************************************************/
+static int trees_identical(geom_box_tree t1, geom_box_tree t2) {
+  int i;
+  if (!t1 || !t2) return t1 == t2;
+  if (!vector3_equal(t1->b.low, t2->b.low) || !vector3_equal(t1->b.high, t2->b.high) ||
+      t1->nobjects != t2->nobjects)
+    return 0;
+  for (i = 0; i < t1->nobjects; ++i)
+    if (t1->objects[i].o != t2->objects[i].o ||
+        t1->objects[i].precedence != t2->objects[i].precedence ||
+        !vector3_equal(t1->objects[i].shiftby, t2->objects[i].shiftby) ||
+        !vector3_equal(t1->objects[i].box.low, t2->objects[i].box.low) ||
+        !vector3_equal(t1->objects[i].box.high, t2->objects[i].box.high))
+      return 0;
+  return trees_identical(t1->t1, t2->t1) && trees_identical(t1->t2, t2->t2);
+}
+
+static void test_parallel_build(void) {
+  geometric_object_list g;
+  geom_box_tree t1, t2;
+  int i, j, k, n = 0, builder;
+
+  printf("test_parallel_build... ");
+  geometry_lattice.size = make_vector3(16, 16, 4);
+  g.num_items = 16 * 16 * 8;
+  g.items = (geometric_object *)malloc(sizeof(geometric_object) * g.num_items);
+  for (i = 0; i < 16; ++i)
+    for (j = 0; j < 16; ++j)
+      for (k = 0; k < 8; ++k, ++n)
+        g.items[n] = make_sphere(MATERIAL(n), make_vector3(i - 7.5, j - 7.5, 0.5 * k - 1.75),
+                                 myurand(0.1, 0.4));
+
+  for (builder = 0; builder <= 1; ++builder) {
+    geom_box_tree_builder = builder ? GEOM_BOX_TREE_SAH : GEOM_BOX_TREE_BALANCED;
+#ifdef _OPENMP
+    omp_set_num_threads(1);
+#endif
+    t1 = create_geom_box_tree0(g, cell_box());
+#ifdef _OPENMP
+    omp_set_num_threads(4);
+#endif
+    t2 = create_geom_box_tree0(g, cell_box());
+    ASSERT_TRUE("tree independent of the number of threads", trees_identical(t1, t2));
+    destroy_geom_box_tree(t2);
+    destroy_geom_box_tree(t1);
+  }
+
+  geom_box_tree_builder = GEOM_BOX_TREE_BALANCED;
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: periodic trees store only the shifted copies of objects that   */
+/* intersect the cell, once each, including for a cell of zero size     */
+/* along one axis.                                                      */
+/************************************************************************/
+static int count_duplicate_objects(geom_box_tree t) {
+  int i, j, n = 0;
+  if (!t) return 0;
+  for (i = 0; i < t->nobjects; ++i)
+    for (j = 0; j < i; ++j)
+      n += t->objects[i].o == t->objects[j].o &&
+           vector3_equal(t->objects[i].shiftby, t->objects[j].shiftby);
+  return n + count_duplicate_objects(t->t1) + count_duplicate_objects(t->t2);
+}
+
+static void test_periodic_copies(void) {
+  geometric_object_list g;
+  geom_box_tree t;
+  int depth, nobjects, nobjects0;
+  lattice lattice0;
+
+  printf("test_periodic_copies... ");
+  g = make_crystal_geometry();
+
+  ensure_periodicity = 0;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats(t, &depth, &nobjects0);
+  destroy_geom_box_tree(t);
+
+  ensure_periodicity = 1;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats(t, &depth, &nobjects);
+  ASSERT_TRUE("periodic copies only at the cell edges", nobjects < 2 * nobjects0);
+  ASSERT_TRUE("no duplicate periodic copies", count_duplicate_objects(t) == 0);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+
+  /* along an axis of size 0, every shift is the zero shift */
+  lattice0 = geometry_lattice;
+  geometry_lattice.size = make_vector3(1, 1, 0);
+  g.num_items = 1;
+  g.items = (geometric_object *)malloc(sizeof(geometric_object));
+  g.items[0] = make_sphere(MATERIAL(0), make_vector3(0, 0, 0), 0.2);
+  ensure_periodicity = 0;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats(t, &depth, &nobjects0);
+  destroy_geom_box_tree(t);
+  ensure_periodicity = 1;
+  t = create_geom_box_tree0(g, cell_box());
+  geom_box_tree_stats(t, &depth, &nobjects);
+  ASSERT_TRUE("one copy along an axis of size 0",
+              nobjects == nobjects0 && count_duplicate_objects(t) == 0);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  geometry_lattice = lattice0;
+
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: restricted views give the same search results as restricted    */
+/* copies, for points in the restriction box, for a grid of chunks, and */
+/* cursors on views find nothing outside the box.                       */
+/************************************************************************/
+static void test_restricted_view(void) {
+  geometric_object_list g;
+  geom_box_tree t, tc, tr, tv, tcv;
+  geom_box b;
+  int i, j, k, m, mismatches = 0, nviews = 0, depth, nobjects, depthv, nobjectsv;
+  double y, z;
+
+  printf("test_restricted_view... ");
+  g = make_crystal_geometry();
+  b = cell_box();
+  t = create_geom_box_tree0(g, b);
+  tc = compile_geom_box_tree(t);
+  geom_box_tree_stats(t, &depth, &nobjects);
+
+  for (i = 0; i < 4; ++i)
+    for (j = 0; j < 4; ++j)
+      for (k = 0; k < 2; ++k) { /* 4x4x2 chunks, as for domain decomposition */
+        geom_box bc;
+        geom_box_tree_cursor c;
+        bc.low = make_vector3(b.low.x + i, b.low.y + j, b.low.z + 2 * k);
+        bc.high = make_vector3(bc.low.x + 1, bc.low.y + 1, bc.low.z + 2);
+        tr = restrict_geom_box_tree(t, &bc);
+        tv = restrict_geom_box_tree_view(t, &bc);
+        tcv = restrict_geom_box_tree_view(tc, &bc);
+        mismatches += count_search_mismatches(tr, tv, &bc) + count_search_mismatches(tr, tcv, &bc);
+        geom_box_tree_cursor_init(&c, tcv);
+        for (m = 0; m < 1000; ++m) {
+          vector3 p = make_vector3(myurand(bc.low.x, bc.high.x), myurand(bc.low.y, bc.high.y),
+                                   myurand(bc.low.z, bc.high.z));
+          boolean in;
+          mismatches += material_of_point_in_tree(p, tr) != material_of_point_in_tree_cursor(p, &c, &in);
+        }
+
+        /* sweep cursors along x, across both faces of bc: points outside
+           bc are never found, even if they are in the view's subtree */
+        geom_box_tree_cursor_init(&c, tv);
+        y = bc.low.y + 0.3 * (bc.high.y - bc.low.y);
+        z = bc.low.z + 0.6 * (bc.high.z - bc.low.z);
+        for (m = 0; m < 200; ++m) {
+          double w = bc.high.x - bc.low.x;
+          vector3 p = make_vector3(bc.low.x - w + (m + 0.5) * 0.015 * w, y, z);
+          int in_b = bc.low.x < p.x && p.x < bc.high.x, oindex, oindexc;
+          geom_box_tree found = geom_tree_search(p, tv, &oindex);
+          geom_box_tree foundc = geom_tree_search_cursor(p, &c, &oindexc);
+          mismatches += foundc != found || (found && oindexc != oindex) || (found && !in_b);
+        }
+        geom_box_tree_stats(tv, &depthv, &nobjectsv);
+        nviews += depthv < depth;
+        destroy_geom_box_tree(tcv);
+        destroy_geom_box_tree(tv);
+        destroy_geom_box_tree(tr);
+      }
+  ASSERT_TRUE("restricted views match restricted trees", mismatches == 0);
+  ASSERT_TRUE("restricted views skip the top of the tree", nviews > 0);
+  ASSERT_TRUE("parent trees intact after destroying views",
+              count_tree_mismatches(g, t) == 0 && count_search_mismatches(t, tc, &b) == 0);
+
+  destroy_geom_box_tree(tc);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: a saved tree loads back as an equivalent tree, but only for    */
+/* the geometry that it was built from.                                 */
+/************************************************************************/
+static void test_save_load(void) {
+  const char *fname = "test-tree.tmp";
+  geometric_object_list g;
+  geom_box_tree t, tl;
+  geom_box b, b2;
+  double radius;
+  FILE *f;
+
+  printf("test_save_load... ");
+  g = make_crystal_geometry();
+  b = cell_box();
+  t = create_geom_box_tree0(g, b);
+
+  ASSERT_TRUE("tree saved", save_geom_box_tree(t, g, fname));
+  tl = load_geom_box_tree(fname, g, b);
+  ASSERT_TRUE("tree loaded", tl != NULL && tl->compiled);
+  if (tl) {
+    ASSERT_TRUE("loaded tree searches match", count_search_mismatches(t, tl, &b) == 0);
+    ASSERT_TRUE("loaded tree matches brute force", count_tree_mismatches(g, tl) == 0);
+    destroy_geom_box_tree(tl);
+  }
+
+  /* changing the materials doesn't matter, but changing the objects does */
+  g.items[3].material = MATERIAL(1000);
+  tl = load_geom_box_tree(fname, g, b);
+  ASSERT_TRUE("tree loaded after changing a material", tl != NULL);
+  destroy_geom_box_tree(tl);
+  radius = g.items[3].subclass.sphere_data->radius;
+  g.items[3].subclass.sphere_data->radius = radius * 1.01;
+  ASSERT_TRUE("stale tree rejected", load_geom_box_tree(fname, g, b) == NULL);
+  g.items[3].subclass.sphere_data->radius = radius;
+  b2 = b;
+  b2.high.x *= 0.5;
+  ASSERT_TRUE("tree for a different box rejected", load_geom_box_tree(fname, g, b2) == NULL);
+  ensure_periodicity = 0;
+  ASSERT_TRUE("tree for different periodicity rejected", load_geom_box_tree(fname, g, b) == NULL);
+  ensure_periodicity = 1;
+
+  /* a file with trailing garbage is rejected */
+  f = fopen(fname, "r+b");
+  if (f) {
+    fseek(f, 0, SEEK_END);
+    ASSERT_TRUE("garbage appended", fwrite("x", 1, 1, f) == 1);
+    fclose(f);
+  }
+  ASSERT_TRUE("corrupted file rejected", load_geom_box_tree(fname, g, b) == NULL);
+
+  remove(fname);
+  ASSERT_TRUE("missing file rejected", load_geom_box_tree(fname, g, b) == NULL);
+
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: two geometry contexts with different lattices, periodicity,    */
+/* and geometries can be used in turn (and concurrently, from separate  */
+/* threads), giving the same answers as the globals.                    */
+/************************************************************************/
+#define NUM_CONTEXT_POINTS 5000
+
+static int count_context_mismatches(const geom_context *ctx, geom_box_tree t, const vector3 *p,
+                                    const vector3 *shifted, void *const *materials) {
+  int i, mismatches = 0;
+  for (i = 0; i < NUM_CONTEXT_POINTS; ++i) {
+    boolean in;
+    if (ctx) /* use the given context */
+      mismatches += !vector3_equal(shift_to_unit_cell_ctx(ctx, p[i]), shifted[i]) ||
+                    material_of_point_in_tree_inobject_ctx(ctx, p[i], t, &in) != materials[i] ||
+                    material_of_point_inobject_ctx(ctx, p[i], &in) != materials[i];
+    else /* use the calling thread's current context */
+      mismatches += !vector3_equal(shift_to_unit_cell(p[i]), shifted[i]) ||
+                    material_of_point_in_tree_inobject(p[i], t, &in) != materials[i] ||
+                    material_of_point_inobject(p[i], &in) != materials[i];
+  }
+  return mismatches;
+}
+
+static void test_geom_context(void) {
+  geom_context ctx[2];
+  geom_box_tree t[2], tg;
+  vector3 *p[2], *shifted[2];
+  void **materials[2];
+  int i, k, mismatches = 0;
+  lattice lattice0 = geometry_lattice;
+
+  printf("test_geom_context... ");
+  for (k = 0; k < 2; ++k) { /* expected results, computed with the globals */
+    geometry = make_crystal_geometry();
+    if (k == 1) {
+      geometry_lattice.size = make_vector3(3, 5, 2);
+      ensure_periodicity = 0;
+    }
+    geom_context_init(&ctx[k]);
+    tg = create_geom_box_tree();
+    p[k] = (vector3 *)malloc(sizeof(vector3) * NUM_CONTEXT_POINTS);
+    shifted[k] = (vector3 *)malloc(sizeof(vector3) * NUM_CONTEXT_POINTS);
+    materials[k] = (void **)malloc(sizeof(void *) * NUM_CONTEXT_POINTS);
+    for (i = 0; i < NUM_CONTEXT_POINTS; ++i) {
+      p[k][i] = vector3_scale(k == 0 ? 1.5 : 1.0, random_point_in_cell()); /* periodic if k == 0 */
+      shifted[k][i] = shift_to_unit_cell(p[k][i]);
+      materials[k][i] = material_of_point_in_tree(p[k][i], tg);
+    }
+    destroy_geom_box_tree(tg);
+  }
+
+  /* the globals no longer describe either geometry */
+  geometry.num_items = 0;
+  geometry.items = NULL;
+  geometry_lattice.size = make_vector3(1, 1, 1);
+  ensure_periodicity = 1;
+
+  for (k = 0; k < 2; ++k)
+    t[k] = create_geom_box_tree_ctx(&ctx[k]);
+  for (k = 0; k < 2; ++k)
+    mismatches += count_context_mismatches(&ctx[k], t[k], p[k], shifted[k], materials[k]);
+  ASSERT_TRUE("context variants match the globals", mismatches == 0);
+  ASSERT_TRUE("no context left set", geom_get_context() == NULL);
+
+  /* the *0 functions search the list they are given, even in a context */
+  {
+    geometric_object_list one;
+    const geom_context *prev = geom_set_context(&ctx[1]);
+    int nin = 0;
+    one.num_items = 1;
+    one.items = ctx[1].geometry.items;
+    mismatches = 0;
+    for (i = 0; i < NUM_CONTEXT_POINTS; ++i) {
+      int in = point_in_fixed_objectp(p[1][i], one.items[0]);
+      void *expected = in ? one.items[0].material : ctx[1].default_material;
+      nin += in;
+      if (material_of_point0(one, p[1][i]) != expected) ++mismatches;
+    }
+    geom_set_context(prev);
+    ASSERT_TRUE("material_of_point0 uses its geometry argument", mismatches == 0 && nin > 0);
+  }
+
+#ifdef _OPENMP
+  mismatches = 0;
+#pragma omp parallel for reduction(+ : mismatches) num_threads(2)
+  for (k = 0; k < 2; ++k) {
+    const geom_context *prev = geom_set_context(&ctx[k]);
+    geom_box_tree tk = create_geom_box_tree(); /* may itself run in parallel */
+    mismatches += count_context_mismatches(NULL, tk, p[k], shifted[k], materials[k]) +
+                  count_context_mismatches(&ctx[k], t[k], p[k], shifted[k], materials[k]);
+    destroy_geom_box_tree(tk);
+    geom_set_context(prev);
+  }
+  ASSERT_TRUE("contexts used concurrently match the globals", mismatches == 0);
+#endif
+
+  for (k = 0; k < 2; ++k) {
+    destroy_geom_box_tree(t[k]);
+    destroy_geometry(ctx[k].geometry);
+    free(materials[k]);
+    free(shifted[k]);
+    free(p[k]);
+  }
+  geometry_lattice = lattice0;
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: precompiled object query records, and the batched point-in-   */
+/* object tests, agree with point_in_fixed_objectp for every kind of    */
+/* object, in both Cartesian and skewed lattices.                       */
+/************************************************************************/
+#define NUM_QUERY_OBJECTS 10
+
+static void test_object_queries(void) {
+  geometric_object o[NUM_QUERY_OBJECTS];
+  geom_object_query q[NUM_QUERY_OBJECTS];
+  vector3 e1 = {1, 0, 0}, e2 = {0, 1, 0}, e3 = {0, 0, 1}, c = {0.1, -0.2, 0.05};
+  vector3 axis = {0.3, -0.5, 1.0}, sq[4] = {{-0.5, -0.5, 0}, {0.5, -0.5, 0}, {0.5, 0.5, 0},
+                                            {-0.5, 0.5, 0}};
+  geometric_object_list components;
+  lattice lattice0 = geometry_lattice;
+  int skewed, i, j, kinds = 0, mismatches = 0, batch_mismatches = 0;
+  int n = NUM_POINTS - 3; /* not a multiple of the chunk size */
+  double *x = (double *)malloc(sizeof(double) * n * 3), *y = x + n, *z = y + n;
+  boolean *inside = (boolean *)malloc(sizeof(boolean) * n);
+
+  printf("test_object_queries... ");
+  for (skewed = 0; skewed <= 1; ++skewed) {
+    if (skewed) {
+      geometry_lattice.basis2 = make_vector3(0.3, 1, 0);
+      geometry_lattice.basis3 = make_vector3(0.2, -0.1, 1);
+      geom_fix_lattice();
+    }
+    components.num_items = 2;
+    components.items = (geometric_object *)malloc(sizeof(geometric_object) * 2);
+    components.items[0] = make_sphere(MATERIAL(0), make_vector3(0.5, 0, 0), 0.3);
+    components.items[1] = make_block(MATERIAL(1), make_vector3(-0.5, 0, 0), e1, e2, e3,
+                                     make_vector3(0.4, 0.6, 0.8));
+    o[0] = make_sphere(MATERIAL(0), c, 0.8);
+    o[1] = make_sphere(MATERIAL(0), c, 0);
+    o[2] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, axis);
+    o[3] = make_cone(MATERIAL(0), c, 0.7, 1.5, axis, 0.1);
+    o[4] = make_wedge(MATERIAL(0), c, 0.9, 1.0, axis, -4.0, make_vector3(1, 0, 0));
+    o[5] = make_block(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                      make_vector3(1.2, 0.5, 0.9));
+    o[6] = make_ellipsoid(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                          make_vector3(1.4, 0.7, 1.1));
+    o[7] = make_prism(MATERIAL(0), sq, 4, 1.0, e3);
+    o[8] = make_geometric_object(MATERIAL(0), c);
+    o[9] = make_geometric_object(MATERIAL(0), c);
+    o[9].which_subclass = COMPOUND_GEOMETRIC_OBJECT;
+    o[9].subclass.compound_geometric_object_data = (compound_geometric_object *)malloc(
+        sizeof(compound_geometric_object));
+    o[9].subclass.compound_geometric_object_data->component_objects = components;
+
+    for (j = 0; j < NUM_QUERY_OBJECTS; ++j) {
+      compile_geom_object_query(o + j, q + j);
+      kinds |= 1 << q[j].kind;
+    }
+    ASSERT_TRUE("lattice metric detected", q[0].cartesian == !skewed);
+    for (i = 0; i < n; ++i) {
+      vector3 p = make_vector3(myurand(-1.5, 1.5), myurand(-1.5, 1.5), myurand(-1.5, 1.5));
+      for (j = 0; j < NUM_QUERY_OBJECTS; ++j)
+        mismatches += !point_in_object_query(p, q + j) != !point_in_fixed_objectp(p, o[j]);
+      x[i] = p.x;
+      y[i] = p.y;
+      z[i] = p.z;
+    }
+    for (j = 0; j < NUM_QUERY_OBJECTS; ++j) {
+      point_in_fixed_objectp_batch(o + j, x, y, z, n, inside);
+      for (i = 0; i < n; ++i)
+        batch_mismatches +=
+            !inside[i] != !point_in_fixed_objectp(make_vector3(x[i], y[i], z[i]), o[j]);
+    }
+    for (j = 0; j < NUM_QUERY_OBJECTS; ++j)
+      geometric_object_destroy(o[j]);
+  }
+  ASSERT_TRUE("all kinds of query records tested", kinds == (1 << (GEOM_QUERY_OBJECT + 1)) - 1);
+  ASSERT_TRUE("query records match point_in_fixed_objectp", mismatches == 0);
+  ASSERT_TRUE("batched queries match point_in_fixed_objectp", batch_mismatches == 0);
+
+  free(inside);
+  free(x);
+  geometry_lattice = lattice0;
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: signed distances agree in sign with point_in_fixed_objectp,    */
+/* change no faster than the point moves, and (outside compound         */
+/* objects) step a point exactly onto the surface along the gradient.   */
+/************************************************************************/
+static double cartesian_distance(vector3 p1, vector3 p2) {
+  return vector3_norm(matrix3x3_vector3_mult(geometry_lattice.basis, vector3_minus(p1, p2)));
+}
+
+static void test_signed_distances(void) {
+  geometric_object o[NUM_QUERY_OBJECTS];
+  vector3 e1 = {1, 0, 0}, e2 = {0, 1, 0}, e3 = {0, 0, 1}, c = {0.1, -0.2, 0.05};
+  vector3 axis = {0.3, -0.5, 1.0}, sq[4] = {{-0.5, -0.5, 0}, {0.5, -0.5, 0}, {0.5, 0.5, 0},
+                                            {-0.5, 0.5, 0}};
+  geometric_object_list components;
+  lattice lattice0 = geometry_lattice;
+  int skewed, i, j, sign_errors = 0, lipschitz_errors = 0, surface_errors = 0, batch_errors = 0;
+  int n = 2000;
+  double *x = (double *)malloc(sizeof(double) * n * 4), *y = x + n, *z = y + n, *dist = z + n;
+
+  printf("test_signed_distances... ");
+  for (skewed = 0; skewed <= 1; ++skewed) {
+    if (skewed) {
+      geometry_lattice.basis2 = make_vector3(0.3, 1, 0);
+      geometry_lattice.basis3 = make_vector3(0.2, -0.1, 1);
+      geom_fix_lattice();
+    }
+    components.num_items = 2;
+    components.items = (geometric_object *)malloc(sizeof(geometric_object) * 2);
+    components.items[0] = make_sphere(MATERIAL(0), make_vector3(0.5, 0, 0), 0.3);
+    components.items[1] = make_block(MATERIAL(1), make_vector3(-0.5, 0, 0), e1, e2, e3,
+                                     make_vector3(0.4, 0.6, 0.8));
+    o[0] = make_sphere(MATERIAL(0), c, 0.8);
+    o[1] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, axis);
+    o[2] = make_cone(MATERIAL(0), c, 0.7, 1.5, axis, 0.1);
+    o[3] = make_cone(MATERIAL(0), c, 0.7, 1.5, axis, -0.3);
+    o[4] = make_wedge(MATERIAL(0), c, 0.9, 1.0, axis, -4.0, make_vector3(1, 0, 0));
+    o[5] = make_block(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                      make_vector3(1.2, 0.5, 0.9));
+    o[6] = make_ellipsoid(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                          make_vector3(1.4, 0.7, 1.1));
+    o[7] = make_prism(MATERIAL(0), sq, 4, 1.0, e3);
+    o[8] = make_slanted_prism(MATERIAL(0), sq, 4, 0.5, e3, 0.3);
+    o[9] = make_geometric_object(MATERIAL(0), c);
+    o[9].which_subclass = COMPOUND_GEOMETRIC_OBJECT;
+    o[9].subclass.compound_geometric_object_data = (compound_geometric_object *)malloc(
+        sizeof(compound_geometric_object));
+    o[9].subclass.compound_geometric_object_data->component_objects = components;
+
+    for (i = 0; i < n; ++i) {
+      vector3 p = make_vector3(myurand(-1.5, 1.5), myurand(-1.5, 1.5), myurand(-1.5, 1.5));
+      vector3 dp = make_vector3(myurand(-0.1, 0.1), myurand(-0.1, 0.1), myurand(-0.1, 0.1));
+      x[i] = p.x;
+      y[i] = p.y;
+      z[i] = p.z;
+      for (j = 0; j < NUM_QUERY_OBJECTS; ++j) {
+        double d = signed_distance_to_fixed_object(p, o[j]);
+        double d1 = signed_distance_to_fixed_object(vector3_plus(p, dp), o[j]);
+        if (fabs(d) > 1e-9) sign_errors += (d < 0) != !!point_in_fixed_objectp(p, o[j]);
+        if (skewed) continue; /* blocks and prisms are not rectangular in a skewed lattice */
+        lipschitz_errors += fabs(d1 - d) > cartesian_distance(dp, make_vector3(0, 0, 0)) + 1e-12;
+        if (j != 9 || d > 0) {
+          /* p - d * grad(d) should lie on the surface */
+          const double h = 1e-7;
+          vector3 g;
+          g.x = signed_distance_to_fixed_object(make_vector3(p.x + h, p.y, p.z), o[j]) -
+                signed_distance_to_fixed_object(make_vector3(p.x - h, p.y, p.z), o[j]);
+          g.y = signed_distance_to_fixed_object(make_vector3(p.x, p.y + h, p.z), o[j]) -
+                signed_distance_to_fixed_object(make_vector3(p.x, p.y - h, p.z), o[j]);
+          g.z = signed_distance_to_fixed_object(make_vector3(p.x, p.y, p.z + h), o[j]) -
+                signed_distance_to_fixed_object(make_vector3(p.x, p.y, p.z - h), o[j]);
+          g = unit_vector3(g);
+          d1 = signed_distance_to_fixed_object(vector3_minus(p, vector3_scale(d, g)), o[j]);
+          surface_errors += fabs(d1) > 1e-5;
+        }
+      }
+    }
+    for (j = 0; j < NUM_QUERY_OBJECTS; ++j) {
+      signed_distance_to_fixed_object_batch(o + j, x, y, z, n, dist);
+      for (i = 0; i < n; ++i)
+        batch_errors += fabs(dist[i] - signed_distance_to_fixed_object(
+                                           make_vector3(x[i], y[i], z[i]), o[j])) > 1e-12;
+    }
+    for (j = 0; j < NUM_QUERY_OBJECTS; ++j)
+      geometric_object_destroy(o[j]);
+  }
+  ASSERT_TRUE("sign of distance matches point_in_fixed_objectp", sign_errors == 0);
+  ASSERT_TRUE("distance is 1-Lipschitz", lipschitz_errors == 0);
+  ASSERT_TRUE("gradient step lands on the surface", surface_errors == 0);
+  ASSERT_TRUE("batched distances match", batch_errors == 0);
+
+  free(x);
+  geometry_lattice = lattice0;
+  printf("done\n");
+}
+
+/************************************************************************/
+/* Test: the closed-form overlaps of boxes and ellipsoids with blocks,  */
+/* spheres, and cylinders agree with the cubature, which is used for    */
+/* the same shapes when described as prisms, ellipsoids, and cones.     */
+/************************************************************************/
+#define NUM_OVERLAP_OBJECTS 6
+
+static geometric_object make_box_prism(vector3 center, vector3 size) {
+  vector3 v[4];
+  v[0] = make_vector3(center.x - 0.5 * size.x, center.y - 0.5 * size.y, center.z - 0.5 * size.z);
+  v[1] = make_vector3(center.x + 0.5 * size.x, v[0].y, v[0].z);
+  v[2] = make_vector3(v[1].x, center.y + 0.5 * size.y, v[0].z);
+  v[3] = make_vector3(v[0].x, v[2].y, v[0].z);
+  return make_prism(MATERIAL(0), v, 4, size.z, make_vector3(0, 0, 1));
+}
+
+static void test_analytic_overlaps(void) {
+  geometric_object o[NUM_OVERLAP_OBJECTS], o0[NUM_OVERLAP_OBJECTS];
+  vector3 ex = {1, 0, 0}, ey = {0, 1, 0}, ez = {0, 0, 1}, mez = {0, 0, -1};
+  vector3 c = {0.1, -0.2, 0.05};
+  double max_err = 0, ellipsoid_err = 0;
+  int i, j;
+
+  printf("test_analytic_overlaps... ");
+  geom_planar_overlaps = 0; /* compare with the cubature only */
+  o[0] = make_block(MATERIAL(0), c, ey, mez, ex, make_vector3(1.2, 0.5, 0.9));
+  o0[0] = make_box_prism(c, make_vector3(0.9, 1.2, 0.5));
+  o[1] = make_sphere(MATERIAL(0), c, 0.7);
+  o0[1] = make_ellipsoid(MATERIAL(0), c, ex, ey, ez, make_vector3(1.4, 1.4, 1.4));
+  /* lines along the axis of a cylinder give a discontinuous integrand,
+     for which the cubature is inaccurate, so we compare the x cylinder
+     with the y cylinder o0[2] in a box with x and y swapped */
+  o[2] = make_cylinder(MATERIAL(0), make_vector3(c.y, c.x, c.z), 0.6, 1.2, ex);
+  o0[2] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, ey);
+  o[3] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, ey);
+  o0[3] = make_wedge(MATERIAL(0), c, 0.6, 1.2, ey, 2 * K_PI, ex);
+  o[4] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, mez);
+  o0[4] = make_wedge(MATERIAL(0), c, 0.6, 1.2, mez, 2 * K_PI, ex);
+  o[5] = make_block(MATERIAL(0), c, ex, ey, ez, make_vector3(0.3, 5, 0.4));
+  o0[5] = make_box_prism(c, make_vector3(0.3, 5, 0.4));
+
+  for (i = 0; i < 100; ++i) {
+    geom_box b, swapped;
+    vector3 p = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+    double w = myurand(0.05, 0.5);
+    int dim = i % 3 + 1;
+    b.low = vector3_minus(p, make_vector3(w, myurand(0.05, 0.5), myurand(0.05, 0.5)));
+    b.high = vector3_plus(p, make_vector3(w, myurand(0.05, 0.5), myurand(0.05, 0.5)));
+    if (dim < 3) b.low.z = b.high.z = 0;
+    if (dim < 2) b.low.y = b.high.y = 0;
+    swapped.low = make_vector3(b.low.y, b.low.x, b.low.z);
+    swapped.high = make_vector3(b.high.y, b.high.x, b.high.z);
+    for (j = 0; j < NUM_OVERLAP_OBJECTS; ++j) {
+      double olap = box_overlap_with_object(b, o[j], 1e-6, 10000);
+      double olap0 = box_overlap_with_object(j == 2 ? swapped : b, o0[j], 1e-6, 10000);
+      max_err = fmax(max_err, fabs(olap - olap0));
+    }
+    if (dim < 3) /* the 3d ellipsoid cubature is too inaccurate to compare with */
+      for (j = 0; j < NUM_OVERLAP_OBJECTS; j += 5) {
+        double olap = ellipsoid_overlap_with_object(b, o[j], 1e-6, 10000);
+        double olap0 = ellipsoid_overlap_with_object(b, o0[j], 1e-6, 10000);
+        max_err = fmax(max_err, fabs(olap - olap0));
+      }
+    else if (i < 30) {
+      /* compare with the fraction of a grid of points in the ellipsoid */
+      const int ng = 100;
+      int ix, iy, iz, n = 0, nin = 0;
+      for (ix = 0; ix < ng; ++ix)
+        for (iy = 0; iy < ng; ++iy)
+          for (iz = 0; iz < ng; ++iz) {
+            double u = (ix + 0.5) / ng * 2 - 1, v = (iy + 0.5) / ng * 2 - 1,
+                   t = (iz + 0.5) / ng * 2 - 1;
+            if (u * u + v * v + t * t <= 1) {
+              vector3 q = make_vector3(b.low.x + (b.high.x - b.low.x) * (u + 1) / 2,
+                                       b.low.y + (b.high.y - b.low.y) * (v + 1) / 2,
+                                       b.low.z + (b.high.z - b.low.z) * (t + 1) / 2);
+              ++n;
+              nin += point_in_fixed_objectp(q, o[0]);
+            }
+          }
+      ellipsoid_err = fmax(ellipsoid_err, fabs(ellipsoid_overlap_with_object(b, o[0], 1e-6, 10000) -
+                                               nin / (double)n));
+    }
+  }
+  ASSERT_TRUE("closed-form overlaps match cubature", max_err < 1e-4);
+  ASSERT_TRUE("closed-form ellipsoid overlaps match sampling", ellipsoid_err < 3e-3);
+
+  for (j = 0; j < NUM_OVERLAP_OBJECTS; ++j) {
+    geometric_object_destroy(o[j]);
+    geometric_object_destroy(o0[j]);
+  }
+  geom_planar_overlaps = 1;
+  printf("done (max differences %g, %g)\n", max_err, ellipsoid_err);
+}
+
+/************************************************************************/
+/* Test: the planar approximation of the overlaps of small boxes and    */
+/* ellipsoids agrees with the cubature to within the tolerance.         */
+/************************************************************************/
+#define NUM_PLANAR_OBJECTS 3
+
+static void test_planar_overlaps(void) {
+  geometric_object o[NUM_PLANAR_OBJECTS];
+  vector3 e1 = unit_vector3(make_vector3(1, 1, 0)), e2 = unit_vector3(make_vector3(-1, 1, 0.3));
+  vector3 e3 = vector3_cross(e1, e2);
+  vector3 verts[4] = {{0.9, 0.7, 0.6}, {0.8, -0.7, -0.8}, {-0.9, 0.6, -0.7}, {-0.6, -0.9, 0.8}};
+  int tris[4 * 3] = {0, 1, 2, 0, 3, 1, 0, 2, 3, 1, 3, 2};
+  double max_err = 0;
+  int i, j, is_ellipsoid, npartial = 0, ntotal = 0;
+  geom_context cubature;
+
+  printf("test_planar_overlaps... ");
+  geom_context_init(&cubature);
+  cubature.geom_planar_overlaps = 0;
+  o[0] = make_block(MATERIAL(0), make_vector3(0.1, 0, -0.1), e1, e2, e3, make_vector3(1.3, 0.9, 1.1));
+  o[1] = make_block(MATERIAL(0), make_vector3(0, 0.1, 0), e1, make_vector3(0.3, 1, 0.2), e3,
+                    make_vector3(1.2, 1.0, 0.8));
+  o[2] = make_mesh(MATERIAL(0), verts, 4, tris, 4);
+
+  for (i = 0; i < 150; ++i) {
+    vector3 p0 = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+    vector3 w = make_vector3(myurand(0.005, 0.03), myurand(0.005, 0.03), myurand(0.005, 0.03));
+    int dim = i % 3 + 1;
+    if (dim < 3) p0.z = w.z = 0;
+    if (dim < 2) p0.y = w.y = 0;
+    for (j = 0; j < NUM_PLANAR_OBJECTS; ++j) {
+      /* move p0 onto the surface of o[j] (within the plane of the box),
+         so that most of the boxes straddle the surface */
+      const double h = 1e-7;
+      double d = signed_distance_to_fixed_object(p0, o[j]);
+      vector3 p, g;
+      geom_box b;
+      g.x = signed_distance_to_fixed_object(make_vector3(p0.x + h, p0.y, p0.z), o[j]) - d;
+      g.y = dim < 2 ? 0 : signed_distance_to_fixed_object(make_vector3(p0.x, p0.y + h, p0.z), o[j]) - d;
+      g.z = dim < 3 ? 0 : signed_distance_to_fixed_object(make_vector3(p0.x, p0.y, p0.z + h), o[j]) - d;
+      p = vector3_minus(p0, vector3_scale(d / (vector3_dot(g, g) / h), g));
+      /* ...but not centered on it, for which the cubature is inaccurate */
+      p.x += myurand(-0.5, 0.5) * w.x;
+      p.y += myurand(-0.5, 0.5) * w.y;
+      p.z += myurand(-0.5, 0.5) * w.z;
+      b.low = vector3_minus(p, w);
+      b.high = vector3_plus(p, w);
+      /* the 3d ellipsoid cubature is too inaccurate to compare with */
+      for (is_ellipsoid = 0; is_ellipsoid < (dim < 3 ? 2 : 1); ++is_ellipsoid) {
+        double olap, olap0;
+        olap = is_ellipsoid ? ellipsoid_overlap_with_object(b, o[j], 1e-5, 10000)
+                            : box_overlap_with_object(b, o[j], 1e-5, 10000);
+        olap0 = is_ellipsoid ? ellipsoid_overlap_with_object_ctx(&cubature, b, o[j], 1e-7, 100000)
+                             : box_overlap_with_object_ctx(&cubature, b, o[j], 1e-7, 100000);
+        ++ntotal;
+        if (olap > 0 && olap < 1) ++npartial;
+        max_err = fmax(max_err, fabs(olap - olap0));
+      }
+    }
+  }
+  ASSERT_TRUE("planar overlaps match cubature", max_err < 1e-3);
+
+  for (j = 0; j < NUM_PLANAR_OBJECTS; ++j)
+    geometric_object_destroy(o[j]);
+  printf("done (max difference %g, %d of %d partial)\n", max_err, npartial, ntotal);
+}
+
+/************************************************************************/
+/* Test: box_row_overlaps_with_object agrees with box_overlap_with_object */
+/* for each box of the row.  The prism is an axis-aligned box, and the    */
+/* mesh a tetrahedron, compared with a block and with the cubature.       */
+/************************************************************************/
+#define NUM_ROW_OBJECTS 4
+
+static void test_row_overlaps(void) {
+  geometric_object o[NUM_ROW_OBJECTS], o0[NUM_ROW_OBJECTS];
+  vector3 ex = {1, 0, 0}, ey = {0, 1, 0}, ez = {0, 0, 1}, c = {0.1, -0.2, 0.05};
+  vector3 verts[4] = {{0.9, 0.7, 0.6}, {0.8, -0.7, -0.8}, {-0.9, 0.6, -0.7}, {-0.6, -0.9, 0.8}};
+  int tris[4 * 3] = {0, 1, 2, 0, 3, 1, 0, 2, 3, 1, 3, 2};
+  double max_err = 0, olaps[20];
+  int i, j, k;
+
+  printf("test_row_overlaps... ");
+  o[0] = o0[0] = make_sphere(MATERIAL(0), c, 0.7);
+  o[1] = make_box_prism(c, make_vector3(0.9, 1.2, 0.5));
+  o0[1] = make_block(MATERIAL(0), c, ex, ey, ez, make_vector3(0.9, 1.2, 0.5));
+  o[2] = o0[2] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, ex);
+  o[3] = o0[3] = make_mesh(MATERIAL(0), verts, 4, tris, 4);
+
+  for (i = 0; i < 60; ++i) {
+    geom_box b;
+    vector3 p = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+    int dim = i % 3 + 1, axis = rand() % dim, n = 1 + rand() % 20;
+    double h = myurand(0.02, 0.1);
+    b.low = p;
+    b.high = vector3_plus(p, make_vector3(myurand(0.02, 0.1), myurand(0.02, 0.1),
+                                          myurand(0.02, 0.1)));
+    if (axis == 0) b.high.x = p.x + n * h;
+    if (axis == 1) b.high.y = p.y + n * h;
+    if (axis == 2) b.high.z = p.z + n * h;
+    if (dim < 3) b.low.z = b.high.z = 0;
+    if (dim < 2) b.low.y = b.high.y = 0;
+    for (j = 0; j < NUM_ROW_OBJECTS; ++j) {
+      box_row_overlaps_with_object(b, axis, n, o[j], 1e-6, 100000, olaps);
+      for (k = 0; k < n; ++k) {
+        vector3 e = axis == 0 ? ex : (axis == 1 ? ey : ez);
+        geom_box bk;
+        bk.low = vector3_plus(b.low, vector3_scale(k * h, e));
+        bk.high = vector3_minus(b.high, vector3_scale((n - 1 - k) * h, e));
+        max_err = fmax(max_err, fabs(olaps[k] - box_overlap_with_object(bk, o0[j], 1e-7, 100000)));
+      }
+    }
+  }
+  ASSERT_TRUE("row overlaps match box overlaps", max_err < 1e-4);
+
+  for (j = 0; j < NUM_ROW_OBJECTS; ++j) {
+    geometric_object_destroy(o[j]);
+    if (j == 1) geometric_object_destroy(o0[j]);
+  }
+  printf("done (max difference %g)\n", max_err);
+}
+
+/************************************************************************/
+/* Test: the material fractions of boxes in a tree of overlapping       */
+/* objects agree with sampling the tree on a fine grid, the first       */
+/* (highest-precedence) object gets its whole overlap with the box, and */
+/* the fractions add up to one.                                         */
+/************************************************************************/
+#define NUM_FRACTION_BOXES 10
+#define FRACTION_GRID 32
+
+static void test_material_fractions(void) {
+  geometric_object_list g = make_crystal_geometry();
+  geom_box_tree t = create_geom_box_tree0(g, cell_box());
+  geom_box_fraction f[64];
+  double max_err = 0, max_first_err = 0, max_sum_err = 0;
+  int i, j, k, l, n, nm;
+
+  printf("test_material_fractions... ");
+  for (i = 0; i < NUM_FRACTION_BOXES; ++i) {
+    geom_box b, bs;
+    vector3 size = make_vector3(myurand(0.1, 0.4), myurand(0.1, 0.4), myurand(0.1, 0.4));
+    double sum = 0, counts[64];
+    b.low = vector3_scale(0.8, random_point_in_cell());
+    b.high = vector3_plus(b.low, size);
+    n = box_material_fractions_in_tree(b, t, 1e-6, 100000, 0, f, 64);
+    ASSERT_TRUE("fractions fit", n <= 64);
+    ASSERT_TRUE("default material is last", f[n - 1].o == NULL);
+
+    for (j = 0; j < n; ++j) {
+      sum += f[j].fraction;
+      counts[j] = 0;
+    }
+    max_sum_err = fmax(max_sum_err, fabs(sum - 1));
+
+    if (n > 1) {
+      bs.low = vector3_minus(b.low, f[0].shiftby);
+      bs.high = vector3_minus(b.high, f[0].shiftby);
+      max_first_err = fmax(max_first_err, fabs(f[0].fraction - box_overlap_with_object(
+                                                                    bs, *f[0].o, 1e-7, 100000)));
+    }
+
+    for (j = 0; j < FRACTION_GRID; ++j)
+      for (k = 0; k < FRACTION_GRID; ++k)
+        for (l = 0; l < FRACTION_GRID; ++l) {
+          vector3 p = make_vector3((j + 0.5) / FRACTION_GRID, (k + 0.5) / FRACTION_GRID,
+                                   (l + 0.5) / FRACTION_GRID);
+          vector3 shiftby;
+          int precedence, m;
+          const geometric_object *o;
+          p = vector3_plus(b.low, make_vector3(p.x * size.x, p.y * size.y, p.z * size.z));
+          o = object_of_point_in_tree(p, t, &shiftby, &precedence);
+          for (m = 0; m < n - 1; ++m)
+            if (f[m].o == o && vector3_equal(f[m].shiftby, shiftby)) break;
+          counts[m] += 1;
+        }
+    for (j = 0; j < n; ++j)
+      max_err = fmax(max_err, fabs(f[j].fraction - counts[j] / (FRACTION_GRID * FRACTION_GRID *
+                                                                 FRACTION_GRID)));
+
+    /* merging by material only combines the periodic images */
+    nm = box_material_fractions_in_tree(b, t, 1e-6, 100000, 1, f, 64);
+    for (j = 0, sum = 0; j < nm; ++j)
+      sum += f[j].fraction;
+    ASSERT_TRUE("merged fractions add up to one", fabs(sum - 1) < 1e-9);
+    ASSERT_TRUE("too few fractions are counted",
+                box_material_fractions_in_tree(b, t, 1e-6, 100000, 1, f, 0) == nm);
+  }
+  ASSERT_TRUE("fractions add up to one", max_sum_err < 1e-9);
+  ASSERT_TRUE("first fraction is the whole overlap", max_first_err < 1e-4);
+  ASSERT_TRUE("fractions match sampling", max_err < 0.02);
+
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done (max difference %g from sampling, %g from overlap)\n", max_err, max_first_err);
+}
+
+/************************************************************************/
+/* Test: the segments of random lines through a tree cover the lines    */
+/* in order, and points in each segment belong to its object, also for  */
+/* lines through wedges, which cover only part of their cylinders.      */
+/************************************************************************/
+#define NUM_RAYS 2000
+
+/* check the segments of p + s*d, a <= s <= b, adding to *gaps and
+   *mismatches; returns the number of segments */
+static int check_line_segments(geom_box_tree t, vector3 p, vector3 d, double a, double b,
+                               int *gaps, int *mismatches) {
+  geom_line_segment seg[256];
+  int j, k, n = intersect_line_with_tree(t, p, d, a, b, seg, 256);
+  ASSERT_TRUE("segments fit", n <= 256);
+  ASSERT_TRUE("too few segments are counted", intersect_line_with_tree(t, p, d, a, b, seg, 1) == n);
+  n = intersect_line_with_tree(t, p, d, a, b, seg, 256);
+  if (n < 1 || seg[0].s0 != a || seg[n - 1].s1 != b) ++*gaps;
+  for (j = 0; j < n; ++j) {
+    if (j > 0 && (seg[j].s0 != seg[j - 1].s1 ||
+                  (seg[j].o == seg[j - 1].o && vector3_equal(seg[j].shiftby, seg[j - 1].shiftby))))
+      ++*gaps;
+    for (k = 0; k < 3; ++k) {
+      double s = seg[j].s0 + (k + 1) * 0.25 * (seg[j].s1 - seg[j].s0);
+      vector3 shiftby;
+      int precedence;
+      const geometric_object *o =
+          object_of_point_in_tree(vector3_plus(p, vector3_scale(s, d)), t, &shiftby, &precedence);
+      if (o != seg[j].o || (o && !vector3_equal(shiftby, seg[j].shiftby))) ++*mismatches;
+    }
+  }
+  return n;
+}
+
+static void test_line_segments(void) {
+  geometric_object_list g = make_crystal_geometry(), gw;
+  geom_box_tree t = create_geom_box_tree0(g, cell_box());
+  vector3 ex = {1, 0, 0}, ez = {0, 0, 1};
+  geom_line_segment seg[4];
+  int i, n, mismatches = 0, gaps = 0, total = 0;
+
+  printf("test_line_segments... ");
+  for (i = 0; i < NUM_RAYS; ++i) {
+    vector3 p = random_point_in_cell();
+    vector3 d = make_vector3(myurand(-1, 1), myurand(-1, 1), myurand(-1, 1));
+    double a = myurand(-3, 0), b = myurand(0, 3);
+    if (i % 4 == 0) d.y = d.z = 0; /* include axis-aligned lines */
+    total += check_line_segments(t, p, d, a, b, &gaps, &mismatches);
+  }
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+
+  /* a quarter wedge, a wedge of angle -4 (clockwise, so not convex), and
+     a tilted wedge of angle 5, crossed by lines chosen deterministically
+     so as not to disturb the random numbers of the following tests */
+  gw.num_items = 3;
+  gw.items = (geometric_object *)malloc(sizeof(geometric_object) * gw.num_items);
+  gw.items[0] = make_wedge(MATERIAL(0), make_vector3(0, 0, 0), 1.0, 1.0, ez, K_PI / 2, ex);
+  gw.items[1] = make_wedge(MATERIAL(1), make_vector3(-1, 1, 0.5), 0.8, 1.5, ez, -4.0, ex);
+  gw.items[2] = make_wedge(MATERIAL(2), make_vector3(1, -1, -0.5), 0.8, 1.5,
+                           make_vector3(1, 1, 1), 5.0, ez);
+  t = create_geom_box_tree0(gw, cell_box());
+  n = intersect_line_with_tree(t, make_vector3(-2, -0.5, 0), ex, 0, 4, seg, 4);
+  ASSERT_TRUE("line misses the quarter wedge", n == 1 && seg[0].o == NULL);
+  for (i = 0; i < NUM_RAYS; ++i) {
+    vector3 p = make_vector3(1.9 * sin(1.3 * i), 1.9 * cos(0.7 * i), 0.9 * sin(2.1 * i));
+    vector3 d = make_vector3(cos(0.37 * i), sin(0.37 * i), 0.5 * cos(1.1 * i));
+    total += check_line_segments(t, p, d, -3, 3, &gaps, &mismatches);
+  }
+  ASSERT_TRUE("segments cover the lines", gaps == 0);
+  ASSERT_TRUE("points in segments belong to their objects", mismatches <= total / 1000);
+
+  destroy_geom_box_tree(t);
+  destroy_geometry(gw);
+  printf("done (%d segments, %d mismatches)\n", total, mismatches);
+}
+
+/************************************************************************/
+/* Test: boxes that classify_box_against_object finds to be inside or   */
+/* outside an object contain only points inside or outside it, for      */
+/* every kind of object, in both Cartesian and skewed lattices, and     */
+/* most boxes away from the surface are classified; their overlaps are  */
+/* the same when they are integrated instead.                           */
+/************************************************************************/
+#define NUM_CLASSIFY_OBJECTS 11
+#define NUM_CLASSIFY_BOXES 300
+
+static void test_box_classification(void) {
+  geometric_object o[NUM_CLASSIFY_OBJECTS];
+  vector3 e1 = {1, 0, 0}, e2 = {0, 1, 0}, e3 = {0, 0, 1}, c = {0.1, -0.2, 0.05};
+  vector3 axis = {0.3, -0.5, 1.0}, sq[4] = {{-0.5, -0.5, 0}, {0.5, -0.5, 0}, {0.5, 0.5, 0},
+                                            {-0.5, 0.5, 0}};
+  vector3 verts[4] = {{0.9, 0.7, 0.6}, {0.8, -0.7, -0.8}, {-0.9, 0.6, -0.7}, {-0.6, -0.9, 0.8}};
+  int tris[4 * 3] = {0, 1, 2, 0, 3, 1, 0, 2, 3, 1, 3, 2};
+  geometric_object_list components;
+  lattice lattice0 = geometry_lattice;
+  int skewed, i, j, k, errors = 0, overlap_errors = 0, classified = 0, total = 0;
+  geom_context integrate;
+
+  printf("test_box_classification... ");
+  for (skewed = 0; skewed <= 1; ++skewed) {
+    if (skewed) {
+      geometry_lattice.basis2 = make_vector3(0.3, 1, 0);
+      geometry_lattice.basis3 = make_vector3(0.2, -0.1, 1);
+      geom_fix_lattice();
+    }
+    geom_context_init(&integrate);
+    integrate.geom_classify_overlaps = 0;
+    components.num_items = 2;
+    components.items = (geometric_object *)malloc(sizeof(geometric_object) * 2);
+    components.items[0] = make_sphere(MATERIAL(0), make_vector3(0.5, 0, 0), 0.3);
+    components.items[1] = make_block(MATERIAL(1), make_vector3(-0.5, 0, 0), e1, e2, e3,
+                                     make_vector3(0.4, 0.6, 0.8));
+    o[0] = make_sphere(MATERIAL(0), c, 0.8);
+    o[1] = make_cylinder(MATERIAL(0), c, 0.6, 1.2, axis);
+    o[2] = make_cone(MATERIAL(0), c, 0.7, 1.5, axis, 0.1);
+    o[3] = make_cone(MATERIAL(0), c, 0.7, 1.5, axis, -0.3);
+    o[4] = make_wedge(MATERIAL(0), c, 0.9, 1.0, axis, -4.0, make_vector3(1, 0, 0));
+    o[5] = make_block(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                      make_vector3(1.2, 0.5, 0.9));
+    o[6] = make_ellipsoid(MATERIAL(0), c, make_vector3(1, 1, 0), make_vector3(-1, 1, 0), e3,
+                          make_vector3(1.4, 0.7, 1.1));
+    o[7] = make_ellipsoid(MATERIAL(0), c, make_vector3(1, 0.3, 0), make_vector3(-1, 1, 0), e3,
+                          make_vector3(1.4, 0.7, 1.1));
+    o[8] = make_prism(MATERIAL(0), sq, 4, 1.0, e3);
+    o[9] = make_mesh(MATERIAL(0), verts, 4, tris, 4);
+    o[10] = make_geometric_object(MATERIAL(0), c);
+    o[10].which_subclass = COMPOUND_GEOMETRIC_OBJECT;
+    o[10].subclass.compound_geometric_object_data = (compound_geometric_object *)malloc(
+        sizeof(compound_geometric_object));
+    o[10].subclass.compound_geometric_object_data->component_objects = components;
+
+    for (i = 0; i < NUM_CLASSIFY_BOXES; ++i) {
+      geom_box b;
+      b.low = make_vector3(myurand(-1.5, 1.5), myurand(-1.5, 1.5), myurand(-1.5, 1.5));
+      b.high = vector3_plus(b.low, make_vector3(myurand(0.02, 0.3), myurand(0.02, 0.3),
+                                                myurand(0.02, 0.3)));
+      for (j = 0; j < NUM_CLASSIFY_OBJECTS; ++j) {
+        geom_box_class cls = classify_box_against_object(b, o[j]);
+        ++total;
+        if (cls == GEOM_BOX_MIXED) continue;
+        ++classified;
+        for (k = 0; k < 100; ++k) {
+          vector3 p = make_vector3(myurand(b.low.x, b.high.x), myurand(b.low.y, b.high.y),
+                                   myurand(b.low.z, b.high.z));
+          errors += !point_in_fixed_objectp(p, o[j]) != (cls == GEOM_BOX_OUTSIDE);
+        }
+        /* the overlap is the same whether or not it is integrated */
+        if (i % 10 == 0)
+          overlap_errors += box_overlap_with_object(b, o[j], 1e-4, 10000) != (cls == GEOM_BOX_INSIDE) ||
+                            fabs(box_overlap_with_object_ctx(&integrate, b, o[j], 1e-4, 10000) -
+                                 (cls == GEOM_BOX_INSIDE)) > 1e-4;
+      }
+    }
+    for (j = 0; j < NUM_CLASSIFY_OBJECTS; ++j)
+      geometric_object_destroy(o[j]);
+  }
+  ASSERT_TRUE("classified boxes are uniform", errors == 0);
+  ASSERT_TRUE("classified overlaps match integration", overlap_errors == 0);
+  ASSERT_TRUE("most boxes are classified", classified > 0.8 * total);
+
+  geometry_lattice = lattice0;
+  geom_fix_lattice();
+  printf("done (%d of %d boxes classified)\n", classified, total);
+}
+
+/************************************************************************/
+/* Test: the material grid agrees with searching the tree at the voxel  */
+/* centers, in 3d and 2d, and its fill fractions agree with the         */
+/* fractions of the voxels' own boxes.                                  */
+/************************************************************************/
+#define GRID_NX 24
+#define GRID_NY 20
+#define GRID_NZ 16
+#define FRACTION_NX 8
+
+static void test_material_grid(void) {
+  geometric_object_list g = make_crystal_geometry();
+  geom_box_tree t = create_geom_box_tree0(g, cell_box());
+  MATERIAL_TYPE *m = (MATERIAL_TYPE *)malloc(sizeof(MATERIAL_TYPE) * GRID_NX * GRID_NY * GRID_NZ);
+  number *f = (number *)malloc(sizeof(number) * FRACTION_NX * FRACTION_NX * FRACTION_NX);
+  const int nz[2] = {GRID_NZ, 1};
+  double max_err = 0;
+  int i, j, k, l, mismatches = 0, partial = 0;
+
+  printf("test_material_grid... ");
+  for (l = 0; l < 2; ++l) {
+    material_grid_in_tree(t, GRID_NX, GRID_NY, nz[l], 0, 0, m, NULL);
+    for (i = 0; i < GRID_NX; ++i)
+      for (j = 0; j < GRID_NY; ++j)
+        for (k = 0; k < nz[l]; ++k) {
+          vector3 p = make_vector3((i + 0.5) / GRID_NX - 0.5, (j + 0.5) / GRID_NY - 0.5,
+                                   (k + 0.5) / nz[l] - 0.5);
+          p = make_vector3(p.x * geometry_lattice.size.x, p.y * geometry_lattice.size.y,
+                           p.z * geometry_lattice.size.z);
+          if (m[(i * GRID_NY + j) * nz[l] + k] != material_of_point_in_tree(p, t)) ++mismatches;
+        }
+  }
+  ASSERT_TRUE("grid materials match the tree", mismatches == 0);
+
+  material_grid_in_tree(t, FRACTION_NX, FRACTION_NX, FRACTION_NX, 1e-4, 10000, m, f);
+  for (i = 0; i < FRACTION_NX * FRACTION_NX * FRACTION_NX; ++i) {
+    geom_box b;
+    geom_box_fraction fb[64];
+    double h = geometry_lattice.size.x / FRACTION_NX;
+    int n, ix = i / (FRACTION_NX * FRACTION_NX), iy = (i / FRACTION_NX) % FRACTION_NX,
+           iz = i % FRACTION_NX;
+    if (f[i] < 1) ++partial;
+    if (i % 7) continue; /* check a sample of the voxels against their boxes */
+    b.low = make_vector3(-2 + ix * h, -2 + iy * h, -2 + iz * h);
+    b.high = vector3_plus(b.low, make_vector3(h, h, h));
+    n = box_material_fractions_in_tree(b, t, 1e-4, 10000, 1, fb, 64);
+    for (j = 0; j < n && fb[j].material != m[i]; ++j)
+      ;
+    max_err = fmax(max_err, fabs(f[i] - (j < n ? fb[j].fraction : 0)));
+  }
+  ASSERT_TRUE("some voxels are partially filled", partial > 0);
+  ASSERT_TRUE("grid fractions match the voxel fractions", max_err < 1e-3);
+
+  free(f);
+  free(m);
+  destroy_geom_box_tree(t);
+  destroy_geometry(g);
+  printf("done (%d partial voxels, max difference %g)\n", partial, max_err);
+}
+
+/************************************************************************/
+int main(void) {
+  geom_initialize();
+  srand(314159);
+
+  test_builders_match_brute_force();
+  test_sah_cost();
+  test_compiled_tree();
+  test_batched_search();
+  test_cursor();
+  test_incremental_updates();
+  test_parallel_build();
+  test_periodic_copies();
+  test_restricted_view();
+  test_save_load();
+  test_geom_context();
+  test_object_queries();
+  test_signed_distances();
+  test_analytic_overlaps();
+  test_planar_overlaps();
+  test_row_overlaps();
+  test_material_fractions();
+  test_line_segments();
+  test_box_classification();
+  test_material_grid();
+
+  printf("\n%d test failures\n", test_failures);
+  return test_failures > 0 ? 1 : 0;
+}